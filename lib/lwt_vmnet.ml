@@ -28,6 +28,18 @@ type ipv4_config = Vmnet.ipv4_config = {
     ipv4_netmask: Ipaddr_sexp.V4.t;
 } [@@deriving sexp]
 
+type rule = Vmnet.rule = {
+  protocol: proto;
+  external_port: int;
+  internal_address: Ipaddr_sexp.V4.t;
+  internal_port: int;
+} [@@deriving sexp]
+
+type rx_info = Vmnet.rx_info = {
+  segments: int;
+  timestamp: int;
+} [@@deriving sexp]
+
 type error = Vmnet.error =
  | Failure
  | Mem_failure
@@ -43,35 +55,124 @@ exception Error of error [@@deriving sexp]
 
 exception Permission_denied
 
+exception Timeout [@@deriving sexp]
+
+(* A frame waiting for vmnet to accept it *)
+type send = {
+  frame: Cstruct.t;
+  tx_class: int option;
+  sent: unit Lwt.u;
+}
+
+(* One list of blocked readers per receive queue, and the frames {!write}
+   could not hand to vmnet yet *)
 type t = {
   dev: Vmnet.t;
-  waiters: unit Lwt.u Lwt_dllist.t sexp_opaque;
+  waiters: unit Lwt.u Lwt_dllist.t array sexp_opaque;
+  sendq: send Queue.t sexp_opaque;
+  mutable send_bytes: int;
+  mutable send_max_frames: int;
+  mutable send_max_bytes: int;
+  send_space: unit Lwt_condition.t sexp_opaque;
+  mutable flushing: bool;
 } [@@deriving sexp_of]
 
 let mac {dev; _} = Vmnet.mac dev
 let mtu {dev; _} = Vmnet.mtu dev
 let max_packet_size {dev; _} = Vmnet.max_packet_size dev
+let offload {dev; _} = Vmnet.offload dev
 
 let wakeup_for_read t =
-  match Lwt_dllist.take_opt_l t.waiters with
-  | Some u -> Lwt.wakeup u ()
-  | None -> ()
+  let wakeup queue =
+    match Lwt_dllist.take_opt_l t.waiters.(queue) with
+    | Some u -> Lwt.wakeup u ()
+    | None -> ()
+  in
+  match Vmnet.ready_queues t.dev with
+  | [] -> wakeup 0
+  | queues -> List.iter wakeup queues
+
+let pop_send t =
+  let s = Queue.pop t.sendq in
+  t.send_bytes <- t.send_bytes - Cstruct.len s.frame;
+  Lwt_condition.broadcast t.send_space ();
+  s
+
+(* Hand queued frames to vmnet, in order, until it refuses one.  Frames
+   of the same class go in one batch.  When vmnet rejects a batch, its
+   frames are sent again one at a time ([singles] of them) so that only
+   the frame at fault fails. *)
+let drain_send t =
+  let rec loop singles =
+    if not (Queue.is_empty t.sendq) then begin
+      let tx_class = (Queue.peek t.sendq).tx_class in
+      let limit = if singles > 0 then 1 else 32 in
+      let batch = ref [] in
+      (try
+         Queue.iter (fun s ->
+             if s.tx_class <> tx_class || List.length !batch >= limit then raise Exit;
+             batch := s.frame :: !batch) t.sendq
+       with Exit -> ());
+      let len = List.length !batch in
+      match Vmnet.write_batch ?tx_class t.dev (List.rev !batch) with
+      | n ->
+        for _ = 1 to n do Lwt.wakeup_later (pop_send t).sent () done;
+        if n = len then loop (singles - 1)
+      | exception Vmnet.Error Vmnet.Buffer_exhausted -> ()
+      | exception Vmnet.Error _ when len > 1 -> loop len
+      | exception Vmnet.Error err ->
+        Lwt.wakeup_later_exn (pop_send t).sent (Error err);
+        loop (singles - 1)
+    end in
+  loop 0
+
+(* vmnet does not say when it has room again: retry after [flush_delay]
+   seconds, or on the next event, until the queue is empty *)
+let flush_delay = 0.001
+
+let rec flusher t =
+  drain_send t;
+  if Queue.is_empty t.sendq then begin
+    t.flushing <- false;
+    return_unit
+  end else
+    Lwt_unix.sleep flush_delay >>= fun () -> flusher t
+
+let kick_send t =
+  if not t.flushing && not (Queue.is_empty t.sendq) then begin
+    t.flushing <- true;
+    Lwt.async (fun () -> flusher t)
+  end
 
 let wait_for_event t =
   Vmnet.set_event_handler t.dev;
   let rec loop () =
-    Lwt_preemptive.detach Vmnet.wait_for_event t.dev
+    Lwt_preemptive.detach (fun dev -> Vmnet.wait_for_event dev) t.dev
     >>= fun () ->
     wakeup_for_read t;
+    drain_send t;
     loop ()
   in loop ()
 
-let init ?(mode = Shared_mode) ?(uuid = Uuidm.nil) ?ipv4_config () =
+let pending ?timeout p =
+  let fd = Lwt_unix.of_unix_file_descr ~blocking:false ~set_flags:false
+      (Vmnet.Pending.fd p) in
+  let ready = Lwt_unix.wait_read fd in
+  (match timeout with
+   | None -> ready
+   | Some s -> Lwt.pick [ ready; Lwt_unix.sleep s >>= fun () -> fail Timeout ])
+  >>= fun () ->
+  return (Vmnet.Pending.result p)
+
+let init ?(mode = Shared_mode) ?(uuid = Uuidm.nil) ?ipv4_config ?offload ?timeout () =
   Lwt.catch
   (fun () ->
-    let dev = Vmnet.init ~mode ~uuid ?ipv4_config () in
-    let waiters = Lwt_dllist.create () in
-    let t = { dev; waiters } in
+    pending ?timeout (Vmnet.init_async ~mode ~uuid ?ipv4_config ?offload ())
+    >>= fun dev ->
+    let waiters = Array.init Vmnet.max_queues (fun _ -> Lwt_dllist.create ()) in
+    let t = { dev; waiters; sendq = Queue.create (); send_bytes = 0;
+              send_max_frames = 256; send_max_bytes = 1 lsl 20;
+              send_space = Lwt_condition.create (); flushing = false } in
     let _ = wait_for_event t in
     return t
   ) (function
@@ -79,33 +180,154 @@ let init ?(mode = Shared_mode) ?(uuid = Uuidm.nil) ?ipv4_config () =
     | Vmnet.Permission_denied -> fail Permission_denied
     | e -> fail e)
 
-let rec read t c =
+let stop ?timeout t =
+  Lwt.catch
+  (fun () ->
+    let p = Vmnet.stop_async t.dev in
+    (* Blocked readers and queued frames fail from now on, and the event
+       loop ends with the error *)
+    Array.iter (fun waiters ->
+        let rec wakeup () =
+          match Lwt_dllist.take_opt_l waiters with
+          | Some u -> Lwt.wakeup_later u (); wakeup ()
+          | None -> ()
+        in wakeup ()) t.waiters;
+    drain_send t;
+    pending ?timeout p
+  ) (function
+    | Vmnet.Error err -> fail (Error err)
+    | e -> fail e)
+
+let rec retry_read ?(queue = 0) t f =
   Lwt.catch
   (fun () ->
-    return (Vmnet.read t.dev c)
+    return (f t.dev)
   )(function
   | Vmnet.Error err -> fail (Error err)
   | Vmnet.No_packets_waiting ->
       let (th, u) : (unit Lwt.t * unit Lwt.u) = Lwt.task () in
-      let node = Lwt_dllist.add_r u t.waiters in
+      let node = Lwt_dllist.add_r u t.waiters.(queue) in
       Lwt.on_cancel th (fun _ -> Lwt_dllist.remove node);
       th >>= fun () ->
-      read t c
+      retry_read ~queue t f
   | e -> fail e)
 
-let write t c =
+let read t c = retry_read t (fun dev -> Vmnet.read dev c)
+
+let read_info ?(queue = 0) t c =
+  retry_read ~queue t (fun dev -> Vmnet.read_info ~queue dev c)
+
+let read_batch ?(queue = 0) t bufs =
+  retry_read ~queue t (fun dev -> Vmnet.read_batch ~queue dev bufs)
+
+let read_batch_info ?(queue = 0) t bufs =
+  retry_read ~queue t (fun dev -> Vmnet.read_batch_info ~queue dev bufs)
+
+let read_vnet ?(queue = 0) t c =
+  retry_read ~queue t (fun dev -> Vmnet.read_vnet ~queue dev c)
+
+let recv_borrow ?(queue = 0) t =
+  retry_read ~queue t (fun dev -> Vmnet.recv_borrow ~queue dev)
+
+let release = Vmnet.release
+
+let set_borrow_checks t enable = Vmnet.set_borrow_checks t.dev enable
+
+let set_gro t enable = Vmnet.set_gro t.dev enable
+
+let rx_buffer_size t = Vmnet.rx_buffer_size t.dev
+
+let set_filter t filter = Vmnet.set_filter t.dev filter
+
+let set_responder t bindings = Vmnet.set_responder t.dev bindings
+
+let set_demux t ?slots ~queues rules = Vmnet.set_demux t.dev ?slots ~queues rules
+
+let set_rss t ?key table = Vmnet.set_rss t.dev ?key table
+
+let stream ?(queue = 0) t =
+  Lwt_stream.from (fun () ->
+      let buf = Cstruct.create (Vmnet.rx_buffer_size t.dev) in
+      read_info ~queue t buf >|= fun (frame, _) -> Some frame)
+
+let stats t = Vmnet.stats t.dev
+
+(* A frame larger than the byte limit is let into an empty queue *)
+let send_full t len =
+  Queue.length t.sendq >= t.send_max_frames
+  || (t.send_bytes > 0 && t.send_bytes + len > t.send_max_bytes)
+
+let rec enqueue_send ?tx_class t frame =
+  if send_full t (Cstruct.len frame) then
+    Lwt_condition.wait t.send_space >>= fun () ->
+    enqueue_send ?tx_class t frame
+  else begin
+    let (th, sent) = Lwt.wait () in
+    Queue.push { frame; tx_class; sent } t.sendq;
+    t.send_bytes <- t.send_bytes + Cstruct.len frame;
+    kick_send t;
+    th
+  end
+
+let write ?tx_class t c =
+  if Queue.is_empty t.sendq then
+    match Vmnet.write ?tx_class t.dev c with
+    | () -> return_unit
+    | exception Vmnet.Error Vmnet.Buffer_exhausted -> enqueue_send ?tx_class t c
+    | exception Vmnet.Error err -> fail (Error err)
+  else
+    enqueue_send ?tx_class t c
+
+let set_send_queue t ?frames ?bytes () =
+  (match frames with
+   | Some n when n < 1 -> invalid_arg "Lwt_vmnet.set_send_queue: frames"
+   | Some n -> t.send_max_frames <- n
+   | None -> ());
+  (match bytes with
+   | Some n when n < 1 -> invalid_arg "Lwt_vmnet.set_send_queue: bytes"
+   | Some n -> t.send_max_bytes <- n
+   | None -> ());
+  Lwt_condition.broadcast t.send_space ()
+
+let send_queue_length t = Queue.length t.sendq
+
+(* The writes below do not queue, but they wait for the send queue to
+   empty so as not to overtake the frames written before them *)
+let rec send_queue_empty t =
+  if Queue.is_empty t.sendq then return_unit
+  else Lwt_condition.wait t.send_space >>= fun () -> send_queue_empty t
+
+let write_direct t f =
+  send_queue_empty t >>= fun () ->
   try
-    Vmnet.write t.dev c;
-    return_unit
+    return (f t.dev)
   with
   | Vmnet.Error err -> fail (Error err)
 
+let write_batch ?tx_class t bufs =
+  write_direct t (fun dev -> Vmnet.write_batch ?tx_class dev bufs)
+
+let write_gso t ~mss c =
+  write_direct t (fun dev -> Vmnet.write_gso dev ~mss c)
+
+let write_vnet ?tx_class t c =
+  write_direct t (fun dev -> Vmnet.write_vnet ?tx_class dev c)
+
+let set_tx_checksum t enable = Vmnet.set_tx_checksum t.dev enable
+
+let set_shaper t ?policy ?depths ?classes ?rules limit =
+  Vmnet.set_shaper t.dev ?policy ?depths ?classes ?rules limit
+
+let set_tx_priority t ?rules depths = Vmnet.set_tx_priority t.dev ?rules depths
+
+let tx_stats t = Vmnet.tx_stats t.dev
+
 let shared_interface_list = Vmnet.shared_interface_list
 
 let get_port_forwarding_rules t =
   Lwt.catch
   (fun () ->
-    return (Vmnet.get_port_forwarding_rules t.dev)
+    pending (Vmnet.get_port_forwarding_rules_async t.dev)
   )(function
   | Vmnet.Error err -> fail (Error err)
   | e -> fail e)
@@ -113,7 +335,7 @@ let get_port_forwarding_rules t =
 let add_port_forwarding_rule t protocol ext_port ip int_port =
   Lwt.catch
   (fun () ->
-    return (Vmnet.add_port_forwarding_rule t.dev protocol ext_port ip int_port)
+    pending (Vmnet.add_port_forwarding_rule_async t.dev protocol ext_port ip int_port)
   )(function
   | Vmnet.Error err -> fail (Error err)
   | Vmnet.Permission_denied -> fail Permission_denied
@@ -122,8 +344,53 @@ let add_port_forwarding_rule t protocol ext_port ip int_port =
 let remove_port_forwarding_rule t protocol ext_port =
   Lwt.catch
   (fun () ->
-    return (Vmnet.remove_port_forwarding_rule t.dev protocol ext_port)
+    pending (Vmnet.remove_port_forwarding_rule_async t.dev protocol ext_port)
   )(function
   | Vmnet.Error err -> fail (Error err)
   | Vmnet.Permission_denied -> fail Permission_denied
-  | e -> fail e)
\ No newline at end of file
+  | e -> fail e)
+
+let add_port_forwarding_rules t rules =
+  Lwt.catch
+  (fun () ->
+    pending (Vmnet.add_port_forwarding_rules_async t.dev rules)
+  )(function
+  | Vmnet.Error err -> fail (Error err)
+  | Vmnet.Permission_denied -> fail Permission_denied
+  | e -> fail e)
+
+let remove_port_forwarding_rules t keys =
+  Lwt.catch
+  (fun () ->
+    pending (Vmnet.remove_port_forwarding_rules_async t.dev keys)
+  )(function
+  | Vmnet.Error err -> fail (Error err)
+  | Vmnet.Permission_denied -> fail Permission_denied
+  | e -> fail e)
+
+let port_forwarding_rules t =
+  match Vmnet.cached_port_forwarding_rules t.dev with
+  | Some rules -> return rules
+  | None ->
+    get_port_forwarding_rules t >>= fun _ ->
+    return (Vmnet.port_forwarding_rules t.dev)
+
+let first_error results =
+  List.fold_left (fun acc ((_, r) : _ * (unit, error) result) ->
+      match acc, r with
+      | None, Error err -> Some err
+      | acc, _ -> acc) None results
+
+let reconcile t rules =
+  port_forwarding_rules t >>= fun installed ->
+  let adds, removes = Vmnet.rule_changes installed rules in
+  (* Rules whose target changed are removed before being added again *)
+  (match removes with
+   | [] -> return []
+   | l -> remove_port_forwarding_rules t l) >>= fun removed ->
+  (match adds with
+   | [] -> return []
+   | l -> add_port_forwarding_rules t l) >>= fun added ->
+  match first_error removed, first_error added with
+  | Some err, _ | None, Some err -> fail (Error err)
+  | None, None -> return_unit
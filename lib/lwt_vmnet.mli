@@ -53,6 +53,21 @@ type ipv4_config = Vmnet.ipv4_config = {
     ipv4_netmask: Ipaddr_sexp.V4.t;
 } [@@deriving sexp]
 
+(** [rule] is a port forwarding rule mapping [external_port] on the host to
+    [internal_address]:[internal_port] on the vmnet interface. *)
+type rule = Vmnet.rule = {
+  protocol: proto;
+  external_port: int;
+  internal_address: Ipaddr_sexp.V4.t;
+  internal_port: int;
+} [@@deriving sexp]
+
+(** [rx_info] describes a received frame, see {!Vmnet.rx_info}. *)
+type rx_info = Vmnet.rx_info = {
+  segments: int;
+  timestamp: int;
+} [@@deriving sexp]
+
 (** [error] represents hard failures from the underlying vmnet functions. *)
 type error = Vmnet.error =
  | Failure
@@ -72,6 +87,10 @@ exception Error of error [@@deriving sexp]
     (or the vmnet capability) *)
 exception Permission_denied
 
+(** [Timeout] is raised when an operation given a [timeout] did not complete
+    in time. *)
+exception Timeout [@@deriving sexp]
+
 (** [t] is the internal state of one vmnet interface, including Lwt-specific
    waiters and threads. *)
 type t [@@deriving sexp_of]
@@ -88,19 +107,143 @@ val mtu : t -> int
     {!write}. *)
 val max_packet_size: t -> int
 
+(** [offload t] is true if vmnet offloads checksums and TCP segmentation,
+    see {!Vmnet.offload}. *)
+val offload : t -> bool
+
 (** [init ?mode] will initialise a fresh vmnet interface, defaulting to
-    {!Shared_mode} for the output. Raises {!Error} if something goes wrong. *)
-val init : ?mode:mode -> ?uuid:Uuidm.t -> ?ipv4_config:ipv4_config -> unit -> t Lwt.t
+    {!Shared_mode} for the output. The promise is resolved from the vmnet
+    completion callback, so many interfaces can be created concurrently
+    without blocking the event loop.  Fails with {!Timeout} if [timeout]
+    seconds elapse first, and with {!Error} if something goes wrong.
+    [offload] is as for {!Vmnet.init}. *)
+val init : ?mode:mode -> ?uuid:Uuidm.t -> ?ipv4_config:ipv4_config -> ?offload:bool -> ?timeout:float -> unit -> t Lwt.t
+
+(** [stop ?timeout t] stops the interface, see {!Vmnet.stop}.  Blocked
+    reads and frames still queued by {!write} fail with
+    [Error Invalid_argument], as does anything done with [t] afterwards.
+    Fails with {!Timeout} if vmnet did not confirm within [timeout] seconds
+    and with {!Error} if vmnet refused. *)
+val stop : ?timeout:float -> t -> unit Lwt.t
 
 (** [read t buf] will read a network packet into the [buf] {!Cstruct.t} and
    return a fresh subview that represents the packet with the correct length
    and offset. It blocks until a packet is available. *)
 val read : t -> Cstruct.t -> Cstruct.t Lwt.t
 
-(** [write t buf] will transmit a network packet contained in [buf].  This will
-   normally not block, but the vmnet interface isnt clear on whether this might
-   happen. *)
-val write : t -> Cstruct.t -> unit Lwt.t
+(** [read_info ?queue t buf] is {!read} from receive queue [queue]
+   (default 0) that also returns the {!rx_info} of the frame.  Readers of
+   different queues wait independently. *)
+val read_info : ?queue:int -> t -> Cstruct.t -> (Cstruct.t * rx_info) Lwt.t
+
+(** [read_batch ?queue t bufs] blocks until at least one packet is
+   available on [queue] and reads up to one packet into each of [bufs],
+   see {!Vmnet.read_batch}. *)
+val read_batch : ?queue:int -> t -> Cstruct.t list -> Cstruct.t list Lwt.t
+
+(** [read_batch_info ?queue t bufs] is {!read_batch} that also returns the
+   {!rx_info} of each frame. *)
+val read_batch_info : ?queue:int -> t -> Cstruct.t list -> (Cstruct.t * rx_info) list Lwt.t
+
+(** [read_vnet ?queue t buf] blocks until a frame is available on [queue]
+   and reads it after a virtio-net header, see {!Vmnet.read_vnet}. *)
+val read_vnet : ?queue:int -> t -> Cstruct.t -> Cstruct.t Lwt.t
+
+(** [recv_borrow ?queue t] blocks until a frame is available on [queue]
+   and lends it without copying, see {!Vmnet.recv_borrow}. *)
+val recv_borrow : ?queue:int -> t -> (Cstruct.t * Vmnet.token) Lwt.t
+
+(** [release token] hands a borrowed frame back, see {!Vmnet.release}. *)
+val release : Vmnet.token -> unit
+
+(** [set_borrow_checks t enabled] controls the debugging checks of
+   borrowed frames, see {!Vmnet.set_borrow_checks}. *)
+val set_borrow_checks : t -> bool -> unit
+
+(** [set_gro t enabled] controls receive coalescing of TCP segments, see
+   {!Vmnet.set_gro}. *)
+val set_gro : t -> bool -> unit
+
+(** [rx_buffer_size t] is the smallest buffer that can hold any frame
+   returned by {!read}. *)
+val rx_buffer_size : t -> int
+
+(** [set_filter t prog] installs a BPF program that drops frames in C
+   before they reach {!read}, see {!Vmnet.set_filter}. *)
+val set_filter : t -> Vmnet.Filter.t option -> unit
+
+(** [set_responder t bindings] answers ARP and ICMP echo requests for
+   [bindings] in C, see {!Vmnet.set_responder}. *)
+val set_responder : t -> (Ipaddr.V4.t * Macaddr.t) list -> unit
+
+(** [set_demux t ?slots ~queues rules] splits received frames over
+   separate bounded queues by EtherType and destination MAC, see
+   {!Vmnet.set_demux}. *)
+val set_demux : t -> ?slots:int -> queues:int -> Vmnet.demux_rule list -> unit
+
+(** [set_rss t ?key table] spreads received flows over the receive queues
+   by Toeplitz hash, see {!Vmnet.set_rss}. *)
+val set_rss : t -> ?key:string -> int array -> unit
+
+(** [stream ?queue t] is the stream of frames received on [queue], each in
+   a freshly allocated buffer of {!rx_buffer_size} bytes. *)
+val stream : ?queue:int -> t -> Cstruct.t Lwt_stream.t
+
+(** [stats t] returns the receive counters of [t]. *)
+val stats : t -> Vmnet.stats
+
+(** [write ?tx_class t buf] will transmit a network packet contained in
+   [buf], and resolves once vmnet has accepted it.  When vmnet is out of
+   buffers, or earlier frames are still waiting, the frame joins a bounded
+   send queue that is flushed in order as vmnet makes room; while that
+   queue is full, [write] waits for space, which gives the caller natural
+   backpressure.  [buf] must not be modified until the promise resolves.
+   Fails with {!Error} if vmnet rejects the frame for another reason.
+   [tx_class] is the transmit class, see {!Vmnet.write}. *)
+val write : ?tx_class:int -> t -> Cstruct.t -> unit Lwt.t
+
+(** [set_send_queue t ?frames ?bytes ()] bounds the send queue of {!write}
+   to [frames] frames (256 by default) and [bytes] bytes (1 MiB by
+   default).  A frame larger than [bytes] is still let into an empty
+   queue. *)
+val set_send_queue : t -> ?frames:int -> ?bytes:int -> unit -> unit
+
+(** [send_queue_length t] is the number of frames waiting in the send
+   queue of {!write}. *)
+val send_queue_length : t -> int
+
+(** [write_batch ?tx_class t bufs] transmits all of [bufs] in as few calls
+   into vmnet as possible and returns how many were accepted, see
+   {!Vmnet.write_batch}.  Like {!write_gso} and {!write_vnet}, it first
+   waits for the send queue of {!write} to empty, so that it does not
+   overtake earlier frames, but does not queue itself: the frames vmnet
+   has no room for are left to the caller, and those functions fail with
+   [Error Buffer_exhausted]. *)
+val write_batch : ?tx_class:int -> t -> Cstruct.t list -> int Lwt.t
+
+(** [write_gso t ~mss buf] splits a large TCP/IPv4 segment into [mss]-sized
+   frames and transmits them as a batch, see {!Vmnet.write_gso}. *)
+val write_gso : t -> mss:int -> Cstruct.t -> int Lwt.t
+
+(** [write_vnet ?tx_class t buf] transmits a frame preceded by a virtio-net
+   header, see {!Vmnet.write_vnet}. *)
+val write_vnet : ?tx_class:int -> t -> Cstruct.t -> int Lwt.t
+
+(** [set_tx_checksum t enabled] controls whether {!write} fills in IPv4, TCP
+   and UDP checksums, see {!Vmnet.set_tx_checksum}. *)
+val set_tx_checksum : t -> bool -> unit
+
+(** [set_shaper t ?policy ?depths ?classes ?rules limit] limits the rate
+   at which frames are transmitted, in C, see {!Vmnet.set_shaper}. *)
+val set_shaper : t -> ?policy:Vmnet.shaping -> ?depths:int array -> ?classes:Vmnet.limit array -> ?rules:Vmnet.tx_rule list -> Vmnet.limit -> unit
+
+(** [set_tx_priority t ?rules depths] sets up strict-priority transmit
+   queues, see {!Vmnet.set_tx_priority}. *)
+val set_tx_priority : t -> ?rules:Vmnet.tx_rule list -> int array -> unit
+
+(** [tx_stats t] returns the shaper counters of each transmit class of
+   [t]. *)
+val tx_stats : t -> Vmnet.tx_stats array
 
 (** [shared_interface_list] will return an array of interface names that support
    bridged mode. *)
@@ -108,15 +251,35 @@ val shared_interface_list : unit -> string array
 
 (** [get_forwarding_rules t] returns an array of existing firewall rules. Each
    rule contains the protocol number, internal port, internal IP address and
-   external port. *)
+   external port.  The promise is resolved from the vmnet completion, so the
+   event loop keeps running while vmnet answers. *)
 val get_port_forwarding_rules : t -> (proto * int * Ipaddr.V4.t * int) array Lwt.t
 
 (** [add_port_forwarding_rule t protocol external_port internal_addr
    internal_port] will create a firewall forwarding rule for the specified
    protocol, mapping the external_port to the internal_addr/internal_port on
-   the vmnet interface. *)
+   the vmnet interface.  Like {!get_port_forwarding_rules} it does not block
+   the event loop. *)
 val add_port_forwarding_rule : t -> proto -> int -> Ipaddr.V4.t -> int -> unit Lwt.t
 
 (** [remove_port_forwarding_rule t protocol external_port] removes an existing
-   firewall rule. *)
-val remove_port_forwarding_rule : t -> proto -> int -> unit Lwt.t
\ No newline at end of file
+   firewall rule without blocking the event loop. *)
+val remove_port_forwarding_rule : t -> proto -> int -> unit Lwt.t
+
+(** [add_port_forwarding_rules t rules] installs all of [rules] at once and
+   resolves with the outcome for each rule once vmnet has answered all of
+   them. *)
+val add_port_forwarding_rules : t -> rule list -> (rule * (unit, error) result) list Lwt.t
+
+(** [remove_port_forwarding_rules t keys] removes the rules identified by
+   each [(protocol, external_port)] in [keys] at once. *)
+val remove_port_forwarding_rules : t -> (proto * int) list -> ((proto * int) * (unit, error) result) list Lwt.t
+
+(** [port_forwarding_rules t] returns the rules installed on [t] from the
+   library's index, see {!Vmnet.port_forwarding_rules}.  The first call
+   reads the index from vmnet without blocking the event loop. *)
+val port_forwarding_rules : t -> rule list Lwt.t
+
+(** [reconcile t rules] makes the rules installed on [t] equal to [rules],
+   applying only the differences in bulk, see {!Vmnet.reconcile}. *)
+val reconcile : t -> rule list -> unit Lwt.t
@@ -0,0 +1,125 @@
+(*
+ * Copyright (c) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (c) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+open Lwt
+
+type t = {
+  mode: Lwt_vmnet.mode;
+  ipv4_config: Lwt_vmnet.ipv4_config option;
+  mutable size: int;
+  warm: Lwt_vmnet.t Queue.t;
+  reserved: (Uuidm.t, Lwt_vmnet.t Lwt.t) Hashtbl.t;
+  mutable filling: int; (* anonymous interfaces still being created *)
+  filled: unit Lwt_condition.t; (* signalled when [filling] goes down *)
+  mutable closed: bool;
+}
+
+let create_interface ?uuid t =
+  Lwt_vmnet.init ~mode:t.mode ?uuid ?ipv4_config:t.ipv4_config ()
+
+(* Errors are of no use to anyone once the pool is shut down *)
+let stop_interface dev =
+  Lwt.catch (fun () -> Lwt_vmnet.stop dev) (fun _ -> return_unit)
+
+let done_filling t =
+  t.filling <- t.filling - 1;
+  Lwt_condition.broadcast t.filled ()
+
+(* Top the warm queue up to [size]. Failures are not retried here so that a
+   broken configuration does not spin; the next [take] tries again. An
+   interface that arrives after [shutdown] is stopped instead. *)
+let replenish t =
+  while not t.closed && Queue.length t.warm + t.filling < t.size do
+    t.filling <- t.filling + 1;
+    Lwt.async (fun () ->
+      Lwt.catch
+        (fun () ->
+          create_interface t >>= fun dev ->
+          if t.closed then
+            stop_interface dev >|= (fun () -> done_filling t)
+          else begin
+            Queue.add dev t.warm;
+            done_filling t;
+            return_unit
+          end)
+        (fun _ ->
+          done_filling t;
+          return_unit))
+  done
+
+let create ?(size = 4) ?(mode = Lwt_vmnet.Shared_mode) ?ipv4_config () =
+  if size < 0 then invalid_arg "Lwt_vmnet_pool.create: negative size";
+  let t = { mode; ipv4_config; size; warm = Queue.create ();
+            reserved = Hashtbl.create 7; filling = 0;
+            filled = Lwt_condition.create (); closed = false } in
+  replenish t;
+  t
+
+let size t = t.size
+
+let resize t size =
+  if size < 0 then invalid_arg "Lwt_vmnet_pool.resize: negative size";
+  t.size <- size;
+  replenish t
+
+let available t = Queue.length t.warm
+
+let reserve t uuid =
+  if t.closed then invalid_arg "Lwt_vmnet_pool.reserve: pool is shut down";
+  if not (Hashtbl.mem t.reserved uuid) then begin
+    let dev = create_interface ~uuid t in
+    (* Keep failures from being reported as unhandled before [take] *)
+    Lwt.on_failure dev (fun _ -> ());
+    Hashtbl.replace t.reserved uuid dev
+  end
+
+let take ?uuid t =
+  if t.closed then Lwt.fail_invalid_arg "Lwt_vmnet_pool.take: pool is shut down"
+  else match uuid with
+  | Some uuid -> begin
+      match Hashtbl.find_opt t.reserved uuid with
+      | Some dev ->
+        Hashtbl.remove t.reserved uuid;
+        dev
+      | None -> create_interface ~uuid t
+    end
+  | None ->
+    if Queue.is_empty t.warm then begin
+      replenish t;
+      create_interface t
+    end else begin
+      let dev = Queue.take t.warm in
+      replenish t;
+      return dev
+    end
+
+let shutdown t =
+  t.closed <- true;
+  let warm = Queue.fold (fun devs dev -> dev :: devs) [] t.warm in
+  Queue.clear t.warm;
+  let reserved = Hashtbl.fold (fun _ dev devs -> dev :: devs) t.reserved [] in
+  Hashtbl.reset t.reserved;
+  let rec settle () =
+    if t.filling = 0 then return_unit
+    else Lwt_condition.wait t.filled >>= settle
+  in
+  Lwt.join
+    (settle ()
+     :: List.map stop_interface warm
+     @ List.map (fun dev ->
+         Lwt.catch (fun () -> dev >>= stop_interface) (fun _ -> return_unit))
+       reserved)
@@ -0,0 +1,63 @@
+(*
+ * Copyright (c) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (c) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** Pools of pre-created vmnet interfaces.
+
+    Creating an interface involves a round-trip to the vmnet service, which
+    can dominate the start-up time of a VM.  A pool keeps a number of
+    interfaces with the same mode and IPv4 configuration ready so that
+    {!take} can usually hand one out immediately, and creates replacements
+    in the background. *)
+
+(** [t] is a pool of interfaces sharing a mode and IPv4 configuration. *)
+type t
+
+(** [create ?size ?mode ?ipv4_config ()] creates a pool and immediately
+    starts creating [size] (default 4) interfaces with random UUIDs. *)
+val create : ?size:int -> ?mode:Lwt_vmnet.mode -> ?ipv4_config:Lwt_vmnet.ipv4_config -> unit -> t
+
+(** [size t] is the number of anonymous interfaces [t] tries to keep ready. *)
+val size : t -> int
+
+(** [resize t n] changes the target number of ready interfaces.  Shrinking
+    the pool does not stop interfaces that are already warm. *)
+val resize : t -> int -> unit
+
+(** [available t] is the number of anonymous interfaces ready to be taken. *)
+val available : t -> int
+
+(** [reserve t uuid] starts creating the interface for [uuid] in the
+    background, so that a later [take ~uuid t] (and its stable MAC address)
+    does not have to wait for vmnet.  Raises [Invalid_argument] once the
+    pool is shut down. *)
+val reserve : t -> Uuidm.t -> unit
+
+(** [take ?uuid t] returns an interface from the pool.  Without [uuid] a
+    warm interface is returned if one is available and a replacement is
+    started in the background; otherwise a fresh one is created.  With
+    [uuid] the interface set up by {!reserve} is returned, or created on
+    demand if it was not reserved.  Fails like {!Lwt_vmnet.init}, and with
+    [Invalid_argument] once the pool is shut down. *)
+val take : ?uuid:Uuidm.t -> t -> Lwt_vmnet.t Lwt.t
+
+(** [shutdown t] stops replenishing [t] and stops every interface it still
+    holds: the warm ones, those reserved but not taken, and those still
+    being created.  Interfaces already handed out by {!take} are left
+    alone.  The promise resolves once all of them are stopped; errors from
+    vmnet are ignored.  {!take} and {!reserve} fail afterwards, and
+    shutting a pool down twice does nothing more. *)
+val shutdown : t -> unit Lwt.t
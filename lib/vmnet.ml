@@ -28,17 +28,52 @@ module Raw = struct
     mtu: int;
     max_packet_size: int;
     uuid : string;
+    offload : bool;
   }
 
-  external init : int -> string -> string -> (string * string * string) option -> t = "caml_init_vmnet"
+  type op
+
+  external init_start : int -> string -> string -> (string * string * string) option -> bool -> op = "caml_init_vmnet_start"
+  external init_result : op -> t = "caml_init_vmnet_result"
+  external op_fd : op -> Unix.file_descr = "caml_vmnet_op_fd"
+  external op_wait : op -> int -> bool = "caml_vmnet_op_wait"
+  external stop_start : interface_ref -> op = "caml_vmnet_stop_start"
+  external stop_result : op -> int = "caml_vmnet_stop_result"
   external set_event_handler : interface_ref -> unit = "caml_set_event_handler"
-  external wait_for_event : interface_ref -> unit = "caml_wait_for_event"
+  external wait_for_event : interface_ref -> int -> int = "caml_wait_for_event"
   external caml_vmnet_read : interface_ref -> buf -> int -> int -> int = "caml_vmnet_read"
-  external caml_vmnet_write : interface_ref -> buf -> int -> int -> int = "caml_vmnet_write"
+  external caml_vmnet_read_info : interface_ref -> int -> buf -> int -> int -> int array -> int = "caml_vmnet_read_info_byte" "caml_vmnet_read_info"
+  external caml_vmnet_read_vnet : interface_ref -> int -> buf -> int -> int -> int = "caml_vmnet_read_vnet"
+  external caml_vmnet_read_batch : interface_ref -> int -> (buf * int * int) array -> int array -> int array -> int = "caml_vmnet_read_batch"
+  external caml_vmnet_now : unit -> int = "caml_vmnet_now" [@@noalloc]
+  external caml_vmnet_borrow : interface_ref -> int -> int array -> buf option = "caml_vmnet_borrow"
+  external caml_vmnet_release : interface_ref -> int -> int -> buf -> unit = "caml_vmnet_release"
+  external caml_vmnet_set_borrow_checks : interface_ref -> bool -> unit = "caml_vmnet_set_borrow_checks"
+  external caml_vmnet_set_gro : interface_ref -> bool -> unit = "caml_vmnet_set_gro"
+  external caml_vmnet_rx_buffer_size : interface_ref -> int = "caml_vmnet_rx_buffer_size"
+  external caml_vmnet_set_filter : interface_ref -> (int * int * int * int) array -> bool = "caml_vmnet_set_filter"
+  external caml_vmnet_set_responder : interface_ref -> (string * string) array -> unit = "caml_vmnet_set_responder"
+  external caml_vmnet_stats : interface_ref -> (int * int * int * int * int * int) = "caml_vmnet_stats"
+  external caml_vmnet_set_demux : interface_ref -> int -> int -> (int * int * string * int) array -> unit = "caml_vmnet_set_demux"
+  external caml_vmnet_ready_queues : interface_ref -> int = "caml_vmnet_ready_queues"
+  external caml_vmnet_set_rss : interface_ref -> string -> int array -> unit = "caml_vmnet_set_rss"
+  external caml_vmnet_rss_hash : string -> buf -> int -> int -> int = "caml_vmnet_rss_hash" [@@noalloc]
+  external caml_vmnet_write : interface_ref -> int -> buf -> int -> int -> int = "caml_vmnet_write"
+  external caml_vmnet_write_batch : interface_ref -> int -> (buf * int * int) array -> int = "caml_vmnet_write_batch"
+  external caml_vmnet_write_gso : interface_ref -> buf -> int -> int -> int -> int = "caml_vmnet_write_gso"
+  external caml_vmnet_write_vnet : interface_ref -> int -> buf -> int -> int -> int = "caml_vmnet_write_vnet"
+  external caml_vmnet_set_tx_checksum : interface_ref -> bool -> unit = "caml_vmnet_set_tx_checksum"
+  external caml_vmnet_set_shaper : interface_ref -> (float * float * float * float) -> (float * float * float * float) array -> (int * int * int) array -> int array -> unit = "caml_vmnet_set_shaper"
+  external caml_vmnet_tx_stats : interface_ref -> (int * int * int * int) array = "caml_vmnet_tx_stats"
+  external caml_vmnet_cross_connect : interface_ref -> interface_ref -> int = "caml_vmnet_cross_connect"
+  external caml_vmnet_cross_disconnect : interface_ref -> unit = "caml_vmnet_cross_disconnect"
+  external caml_vmnet_cross_stats : interface_ref -> (int * int) = "caml_vmnet_cross_stats"
   external caml_shared_interface_list : unit -> string array = "caml_shared_interface_list"
-  external caml_vmnet_interface_add_port_forwarding_rule : interface_ref -> int -> int -> string -> int -> int = "caml_vmnet_interface_add_port_forwarding_rule"
-  external caml_vmnet_interface_remove_port_forwarding_rule : interface_ref -> int -> int -> int = "caml_vmnet_interface_remove_port_forwarding_rule"
-  external caml_interface_get_port_forwarding_rules : interface_ref -> (int * int * string * int) array = "caml_interface_get_port_forwarding_rules"
+  external caml_vmnet_interface_add_port_forwarding_rules : interface_ref -> (int * int * int * int) array -> op = "caml_vmnet_interface_add_port_forwarding_rules"
+  external caml_vmnet_interface_remove_port_forwarding_rules : interface_ref -> (int * int) array -> op = "caml_vmnet_interface_remove_port_forwarding_rules"
+  external op_statuses : op -> int array = "caml_vmnet_op_statuses"
+  external caml_interface_get_port_forwarding_rules_start : interface_ref -> op = "caml_interface_get_port_forwarding_rules_start"
+  external caml_interface_get_port_forwarding_rules_result : op -> (int * int * string * int) array = "caml_interface_get_port_forwarding_rules_result"
 
   exception Return_code of int
   exception API_not_supported
@@ -57,10 +92,6 @@ type error =
  | Too_many_packets
  | Unknown of int [@@deriving sexp]
 
-exception Error of error [@@deriving sexp]
-exception Permission_denied
-exception No_packets_waiting [@@deriving sexp]
-
 (* Possible values of vmnet_return_t *)
 let error_of_int =
   function
@@ -74,6 +105,21 @@ let error_of_int =
   | 1008 -> Too_many_packets
   | err  -> Unknown err
 
+let result_of_int : int -> (unit, error) result =
+  function
+  | 1000 -> Ok () (* VMNET_SUCCESS *)
+  | err  -> Error (error_of_int err)
+
+let error_of_result : (unit, error) result -> error option =
+  function
+  | Ok () -> None
+  | Error err -> Some err
+
+exception Error of error [@@deriving sexp]
+exception Permission_denied
+exception No_packets_waiting [@@deriving sexp]
+exception Timeout [@@deriving sexp]
+
 type ipv4_config = {
     ipv4_start_address: Ipaddr_sexp.V4.t;
     ipv4_end_address: Ipaddr_sexp.V4.t;
@@ -91,6 +137,13 @@ type proto =
   | ICMP
   | Other of int [@@deriving sexp]
 
+type rule = {
+  protocol: proto;
+  external_port: int;
+  internal_address: Ipaddr_sexp.V4.t;
+  internal_port: int;
+} [@@deriving sexp]
+
 let int_of_proto =
   function
   | TCP     -> 6
@@ -105,23 +158,56 @@ let proto_of_int =
   | 1  -> ICMP
   | x  -> Other x
 
+(* Library-side view of the port forwarding rules installed on an
+   interface, keyed by (protocol, external port).  It is kept up to date by
+   the add/remove functions below and only read back from vmnet once. *)
+type rule_index = {
+  lock: Mutex.t;
+  mutable loaded: bool;
+  installed: (int * int, rule) Hashtbl.t;
+}
+
 type t = {
   iface: interface_ref sexp_opaque;
   name: string;
   mtu: int;
   mac: Macaddr_sexp.t;
   max_packet_size: int;
+  offload: bool;
   uuid: Uuidm.t sexp_opaque;
+  rules: rule_index sexp_opaque;
 } [@@deriving sexp_of]
 
 let mac {mac; _} = mac
 let mtu {mtu; _} = mtu
 let max_packet_size {max_packet_size; _} = max_packet_size
+let offload {offload; _} = offload
 let uuid {uuid; _} = uuid
 
 let iface_num = ref 0
 
-let init ?(mode = Shared_mode) ?(uuid = Uuidm.nil) ?ipv4_config () =
+module Pending = struct
+  type 'a t = {
+    op: Raw.op;
+    finish: Raw.op -> 'a;
+  }
+
+  let fd {op; _} = Raw.op_fd op
+
+  let timeout_ms = function
+    | None -> -1
+    | Some s -> max 0 (int_of_float (ceil (s *. 1000.)))
+
+  let wait ?timeout {op; _} =
+    if not (Raw.op_wait op (timeout_ms timeout)) then raise Timeout
+
+  let result ({op; finish} as p) =
+    wait p;
+    finish op
+end
+
+let init_async ?(mode = Shared_mode) ?(uuid = Uuidm.nil) ?ipv4_config
+    ?(offload = false) () =
   let mode, iface =
     match mode with
     | Host_mode -> (1000, "")
@@ -136,28 +222,55 @@ let init ?(mode = Shared_mode) ?(uuid = Uuidm.nil) ?ipv4_config () =
                       (ip_to_str x.ipv4_netmask))
     | None -> None
   in
-  try
-    let t = Raw.init mode iface (Uuidm.to_bytes uuid) ipv4_config_str
-    in
-    let name = Printf.sprintf "vmnet%d" !iface_num in
-    incr iface_num;
-    let mac = Macaddr.of_octets_exn t.Raw.mac in
-    let mtu = t.Raw.mtu in
-    let max_packet_size = t.Raw.max_packet_size in
-    let uuid = (match Uuidm.of_bytes t.uuid with
-      | None -> Uuidm.nil (* TODO: This shouldn't happen and could raise an error *)
-      | Some x -> x) in
-    { iface=t.Raw.iface; mac; mtu; max_packet_size; name; uuid }
-  with
-    | Raw.Return_code r -> if r = 1001 && Unix.geteuid() <> 0
-			   then raise Permission_denied
-			   else raise (Error (error_of_int r))
+  let finish op =
+    try
+      let t = Raw.init_result op in
+      let name = Printf.sprintf "vmnet%d" !iface_num in
+      incr iface_num;
+      let mac = Macaddr.of_octets_exn t.Raw.mac in
+      let mtu = t.Raw.mtu in
+      let max_packet_size = t.Raw.max_packet_size in
+      let uuid = (match Uuidm.of_bytes t.uuid with
+        | None -> Uuidm.nil (* TODO: This shouldn't happen and could raise an error *)
+        | Some x -> x) in
+      let rules = { lock = Mutex.create (); loaded = false;
+                    installed = Hashtbl.create 16 } in
+      let offload = t.Raw.offload in
+      { iface=t.Raw.iface; mac; mtu; max_packet_size; offload; name; uuid; rules }
+    with
+      | Raw.Return_code r -> if r = 1001 && Unix.geteuid() <> 0
+			     then raise Permission_denied
+			     else raise (Error (error_of_int r))
+  in
+  { Pending.op = Raw.init_start mode iface (Uuidm.to_bytes uuid) ipv4_config_str offload;
+    finish }
+
+let init ?mode ?uuid ?ipv4_config ?offload ?timeout () =
+  let p = init_async ?mode ?uuid ?ipv4_config ?offload () in
+  Pending.wait ?timeout p;
+  Pending.result p
+
+let stop_async {iface; _} =
+  let finish op =
+    match result_of_int (Raw.stop_result op) with
+    | Ok () -> ()
+    | Error err -> raise (Error err)
+  in
+  { Pending.op = Raw.stop_start iface; finish }
+
+let stop ?timeout t =
+  let p = stop_async t in
+  Pending.wait ?timeout p;
+  Pending.result p
 
 let set_event_handler {iface; _} =
   Raw.set_event_handler iface
 
-let wait_for_event {iface; _} =
-  Raw.wait_for_event iface
+let wait_for_event ?timeout {iface; _} =
+  match Raw.wait_for_event iface (Pending.timeout_ms timeout) with
+  | 0 -> raise Timeout
+  | n when n > 0 -> ()
+  | err -> raise (Error (error_of_int (err * (-1))))
 
 let read {iface;_} c =
   let r = Raw.caml_vmnet_read iface c.Cstruct.buffer c.Cstruct.off c.Cstruct.len in
@@ -166,29 +279,739 @@ let read {iface;_} c =
   | len when len > 0 -> Cstruct.sub c 0 len
   | err -> raise (Error (error_of_int (err * (-1))))
 
-let write {iface;_} c =
-  Raw.caml_vmnet_write iface c.Cstruct.buffer c.Cstruct.off c.Cstruct.len
+type rx_info = {
+  segments: int;
+  timestamp: int;
+} [@@deriving sexp]
+
+let now = Raw.caml_vmnet_now
+
+let read_info ?(queue = 0) {iface;_} c =
+  let info = [| 1; 0 |] in
+  let r = Raw.caml_vmnet_read_info iface queue c.Cstruct.buffer c.Cstruct.off c.Cstruct.len info in
+  match r with
+  | 0 -> raise No_packets_waiting
+  | len when len > 0 ->
+    Cstruct.sub c 0 len, { segments = info.(0); timestamp = info.(1) }
+  | err -> raise (Error (error_of_int (err * (-1))))
+
+let read_batch_raw ~with_info queue iface bufs =
+  let raw c = (c.Cstruct.buffer, c.Cstruct.off, c.Cstruct.len) in
+  let bufs = Array.of_list bufs in
+  let lens = Array.make (Array.length bufs) 0 in
+  let info = Array.make (if with_info then 2 * Array.length bufs else 0) 0 in
+  match Raw.caml_vmnet_read_batch iface queue (Array.map raw bufs) lens info with
+  | 0 when Array.length bufs = 0 -> [||], lens, info
+  | 0 -> raise No_packets_waiting
+  | n when n > 0 -> Array.sub bufs 0 n, lens, info
+  | err -> raise (Error (error_of_int (err * (-1))))
+
+let read_batch ?(queue = 0) {iface;_} bufs =
+  let bufs, lens, _ = read_batch_raw ~with_info:false queue iface bufs in
+  Array.to_list (Array.mapi (fun i c -> Cstruct.sub c 0 lens.(i)) bufs)
+
+let read_batch_info ?(queue = 0) {iface;_} bufs =
+  let bufs, lens, info = read_batch_raw ~with_info:true queue iface bufs in
+  Array.to_list (Array.mapi (fun i c ->
+      Cstruct.sub c 0 lens.(i),
+      { segments = info.(2 * i); timestamp = info.(2 * i + 1) }) bufs)
+
+type token = {
+  b_iface: interface_ref;
+  b_queue: int;
+  b_slot: int;
+  b_buf: Raw.buf;
+  b_info: rx_info;
+  mutable b_live: bool;
+}
+
+let leaked tok =
+  if tok.b_live then
+    Printf.eprintf "Vmnet: frame borrowed from queue %d was never released\n%!"
+      tok.b_queue
+
+let recv_borrow ?(queue = 0) {iface;_} =
+  let info = [| 0; 0; 0; 0; 0 |] in
+  match Raw.caml_vmnet_borrow iface queue info with
+  | None when info.(0) = 0 -> raise No_packets_waiting
+  | None -> raise (Error (error_of_int (info.(0) * (-1))))
+  | Some buf ->
+    let tok = {
+      b_iface = iface; b_queue = queue; b_slot = info.(1); b_buf = buf;
+      b_info = { segments = info.(2); timestamp = info.(3) }; b_live = true;
+    } in
+    if info.(4) = 1 then Gc.finalise leaked tok;
+    Cstruct.of_bigarray buf, tok
+
+let borrowed_info tok = tok.b_info
+
+let release tok =
+  if not tok.b_live then invalid_arg "Vmnet.release: frame already released";
+  tok.b_live <- false;
+  Raw.caml_vmnet_release tok.b_iface tok.b_queue tok.b_slot tok.b_buf
+
+let set_borrow_checks {iface;_} enable =
+  Raw.caml_vmnet_set_borrow_checks iface enable
+
+let set_gro {iface;_} enable =
+  Raw.caml_vmnet_set_gro iface enable
+
+let rx_buffer_size {iface;_} =
+  Raw.caml_vmnet_rx_buffer_size iface
+
+module Filter = struct
+  type insn = {
+    code: int;
+    jt: int;
+    jf: int;
+    k: int;
+  } [@@deriving sexp]
+
+  type t = insn array [@@deriving sexp]
+
+  let insn code ?(jt = 0) ?(jf = 0) k = { code; jt; jf; k }
+
+  (* tcpdump -ddd: the instruction count, then "code jt jf k" per line *)
+  let of_string s =
+    let fail () = invalid_arg "Vmnet.Filter.of_string" in
+    let lines =
+      String.split_on_char '\n' s
+      |> List.map String.trim
+      |> List.filter (fun l -> l <> "") in
+    match lines with
+    | [] -> fail ()
+    | count :: lines ->
+      let words l =
+        String.map (function '\t' -> ' ' | c -> c) l
+        |> String.split_on_char ' '
+        |> List.filter (fun w -> w <> "") in
+      let decode l =
+        match words l with
+        | [ code; jt; jf; k ] ->
+          (try { code = int_of_string code; jt = int_of_string jt;
+                 jf = int_of_string jf; k = int_of_string k }
+           with _ -> fail ())
+        | _ -> fail ()
+      in
+      let prog = Array.of_list (List.map decode lines) in
+      let n = try int_of_string count with _ -> fail () in
+      if n <> Array.length prog then fail ();
+      prog
+
+  let ld_w k = insn 0x20 k
+  let ld_h k = insn 0x28 k
+  let ld_b k = insn 0x30 k
+  let jeq ~jt ~jf k = insn 0x15 ~jt ~jf k
+  let jset ~jt ~jf k = insn 0x45 ~jt ~jf k
+  let ret k = insn 0x06 k
+
+  let accept = ret 0xffffffff
+  let reject = ret 0
+
+  (* Each block of tests ends with [accept] and skips over it on failure *)
+  let for_mac ?(broadcast = true) ?(multicast = false) mac =
+    let b = Macaddr.to_octets mac in
+    let byte i = Char.code b.[i] in
+    let hi = (byte 0 lsl 8) lor byte 1 in
+    let lo = (byte 2 lsl 24) lor (byte 3 lsl 16) lor (byte 4 lsl 8) lor byte 5 in
+    let unicast =
+      [ ld_w 2; jeq ~jt:0 ~jf:3 lo; ld_h 0; jeq ~jt:0 ~jf:1 hi; accept ] in
+    let group =
+      if multicast then
+        [ ld_b 0; jset ~jt:0 ~jf:1 1; accept ]
+      else if broadcast then
+        [ ld_w 2; jeq ~jt:0 ~jf:3 0xffffffff; ld_h 0; jeq ~jt:0 ~jf:1 0xffff; accept ]
+      else []
+    in
+    Array.of_list (unicast @ group @ [ reject ])
+end
+
+let set_filter {iface;_} filter =
+  let raw { Filter.code; jt; jf; k } = (code, jt, jf, k) in
+  let prog = match filter with None -> [||] | Some p -> Array.map raw p in
+  if not (Raw.caml_vmnet_set_filter iface prog) then
+    invalid_arg "Vmnet.set_filter: invalid BPF program"
+
+let set_responder {iface;_} bindings =
+  let raw (ip, mac) = (Ipaddr.V4.to_octets ip, Macaddr.to_octets mac) in
+  Raw.caml_vmnet_set_responder iface (Array.of_list (List.map raw bindings))
+
+type destination =
+  | Any_destination
+  | Destination of Macaddr_sexp.t
+  | Broadcast
+  | Multicast [@@deriving sexp]
+
+type demux_rule = {
+  ethertype: int option;
+  destination: destination;
+  queue: int;
+} [@@deriving sexp]
+
+let max_queues = 16
+
+let set_demux {iface;_} ?(slots = 0) ~queues rules =
+  let raw { ethertype; destination; queue } =
+    let ethertype = match ethertype with None -> -1 | Some e -> e in
+    let dst, mac = match destination with
+      | Any_destination -> 0, ""
+      | Destination mac -> 1, Macaddr.to_octets mac
+      | Broadcast -> 2, ""
+      | Multicast -> 3, "" in
+    (ethertype, dst, mac, queue)
+  in
+  if queues < 1 || queues > max_queues then
+    invalid_arg "Vmnet.set_demux: queues";
+  Raw.caml_vmnet_set_demux iface queues slots (Array.of_list (List.map raw rules))
+
+(* The key of the RSS verification suite, used by most NICs by default *)
+let default_rss_key =
+  "\x6d\x5a\x56\xda\x25\x5b\x0e\xc2\x41\x67\x25\x3d\x43\xa3\x8f\xb0\
+   \xd0\xca\x2b\xcb\xae\x7b\x30\xb4\x77\xcb\x2d\xa3\x80\x30\xf2\x0c\
+   \x6a\x42\xb7\x3b\xbe\xac\x01\xfa"
+
+let check_rss_key fn key =
+  if String.length key <> String.length default_rss_key then
+    invalid_arg (fn ^ ": the key must be 40 bytes")
+
+let set_rss {iface;_} ?(key = default_rss_key) table =
+  check_rss_key "Vmnet.set_rss" key;
+  Raw.caml_vmnet_set_rss iface key table
+
+let rss_hash ?(key = default_rss_key) c =
+  check_rss_key "Vmnet.rss_hash" key;
+  Raw.caml_vmnet_rss_hash key c.Cstruct.buffer c.Cstruct.off c.Cstruct.len
+
+let ready_queues {iface;_} =
+  let mask = Raw.caml_vmnet_ready_queues iface in
+  let rec bits q acc =
+    if q < 0 then acc
+    else bits (q - 1) (if mask land (1 lsl q) <> 0 then q :: acc else acc) in
+  bits (max_queues - 1) []
+
+type stats = {
+  rx_frames: int;
+  rx_filter_accepted: int;
+  rx_filter_dropped: int;
+  rx_gro_merged: int;
+  rx_queue_dropped: int;
+  rx_answered: int;
+} [@@deriving sexp]
+
+let stats {iface;_} =
+  let (rx_frames, rx_filter_accepted, rx_filter_dropped, rx_gro_merged,
+       rx_queue_dropped, rx_answered) = Raw.caml_vmnet_stats iface in
+  { rx_frames; rx_filter_accepted; rx_filter_dropped; rx_gro_merged;
+    rx_queue_dropped; rx_answered }
+
+let raw_class = function
+  | None -> -1
+  | Some c when c >= 0 -> c
+  | Some _ -> invalid_arg "Vmnet: negative transmit class"
+
+let write ?tx_class {iface;_} c =
+  Raw.caml_vmnet_write iface (raw_class tx_class) c.Cstruct.buffer c.Cstruct.off c.Cstruct.len
   |> function
   | len when len > 0 -> ()
   | err -> raise (Error (error_of_int (err * (-1))))
 
+let write_batch ?tx_class {iface;_} bufs =
+  let raw c = (c.Cstruct.buffer, c.Cstruct.off, c.Cstruct.len) in
+  Raw.caml_vmnet_write_batch iface (raw_class tx_class) (Array.of_list (List.map raw bufs))
+  |> function
+  | n when n >= 0 -> n
+  | err -> raise (Error (error_of_int (err * (-1))))
+
+let write_gso {iface;_} ~mss c =
+  if mss <= 0 then invalid_arg "Vmnet.write_gso: mss must be positive";
+  Raw.caml_vmnet_write_gso iface c.Cstruct.buffer c.Cstruct.off c.Cstruct.len mss
+  |> function
+  | n when n >= 0 -> n
+  | err -> raise (Error (error_of_int (err * (-1))))
+
+module Vnet_hdr = struct
+  type gso = Gso_none | Gso_tcpv4 | Gso_udp | Gso_tcpv6 [@@deriving sexp]
+
+  type t = {
+    needs_csum: bool;
+    data_valid: bool;
+    gso: gso;
+    gso_ecn: bool;
+    hdr_len: int;
+    gso_size: int;
+    csum_start: int;
+    csum_offset: int;
+  } [@@deriving sexp]
+
+  let len = 10
+
+  let none = {
+    needs_csum = false; data_valid = false; gso = Gso_none; gso_ecn = false;
+    hdr_len = 0; gso_size = 0; csum_start = 0; csum_offset = 0;
+  }
+
+  let decode c =
+    let flags = Cstruct.get_uint8 c 0 and gso_type = Cstruct.get_uint8 c 1 in
+    let gso = match gso_type land 0x7f with
+      | 0 -> Gso_none
+      | 1 -> Gso_tcpv4
+      | 3 -> Gso_udp
+      | 4 -> Gso_tcpv6
+      | _ -> invalid_arg "Vmnet.Vnet_hdr.decode: unknown GSO type" in
+    { needs_csum = flags land 1 <> 0; data_valid = flags land 2 <> 0; gso;
+      gso_ecn = gso_type land 0x80 <> 0;
+      hdr_len = Cstruct.LE.get_uint16 c 2; gso_size = Cstruct.LE.get_uint16 c 4;
+      csum_start = Cstruct.LE.get_uint16 c 6;
+      csum_offset = Cstruct.LE.get_uint16 c 8 }
+
+  let encode h c =
+    let gso = match h.gso with
+      | Gso_none -> 0 | Gso_tcpv4 -> 1 | Gso_udp -> 3 | Gso_tcpv6 -> 4 in
+    Cstruct.set_uint8 c 0
+      ((if h.needs_csum then 1 else 0) lor (if h.data_valid then 2 else 0));
+    Cstruct.set_uint8 c 1 (gso lor (if h.gso_ecn then 0x80 else 0));
+    Cstruct.LE.set_uint16 c 2 h.hdr_len;
+    Cstruct.LE.set_uint16 c 4 h.gso_size;
+    Cstruct.LE.set_uint16 c 6 h.csum_start;
+    Cstruct.LE.set_uint16 c 8 h.csum_offset
+end
+
+let read_vnet ?(queue = 0) {iface;_} c =
+  match Raw.caml_vmnet_read_vnet iface queue c.Cstruct.buffer c.Cstruct.off c.Cstruct.len with
+  | 0 -> raise No_packets_waiting
+  | len when len > 0 -> Cstruct.sub c 0 len
+  | err -> raise (Error (error_of_int (err * (-1))))
+
+let write_vnet ?tx_class {iface;_} c =
+  Raw.caml_vmnet_write_vnet iface (raw_class tx_class) c.Cstruct.buffer c.Cstruct.off c.Cstruct.len
+  |> function
+  | n when n > 0 -> n
+  | err -> raise (Error (error_of_int (err * (-1))))
+
+let set_tx_checksum {iface;_} enable =
+  Raw.caml_vmnet_set_tx_checksum iface enable
+
+type limit = {
+  bytes_per_second: float;
+  packets_per_second: float;
+  burst_bytes: int;
+  burst_packets: int;
+} [@@deriving sexp]
+
+let unlimited =
+  { bytes_per_second = 0.; packets_per_second = 0.; burst_bytes = 0;
+    burst_packets = 0 }
+
+type tx_rule = {
+  tx_ethertype: int option;
+  tx_dscp: int option;
+  tx_class: int;
+} [@@deriving sexp]
+
+type shaping =
+  | Drop
+  | Queue of int [@@deriving sexp]
+
+let max_tx_classes = 8
+
+let set_shaper {iface;_} ?(policy = Drop) ?depths ?(classes = [| unlimited |]) ?(rules = []) limit =
+  let raw_limit l =
+    (l.bytes_per_second, l.packets_per_second, float_of_int l.burst_bytes,
+     float_of_int l.burst_packets) in
+  let raw_rule r =
+    let opt = function None -> -1 | Some x -> x in
+    (opt r.tx_ethertype, opt r.tx_dscp, r.tx_class) in
+  let n = Array.length classes in
+  if n < 1 || n > max_tx_classes then
+    invalid_arg "Vmnet.set_shaper: classes";
+  let depths = match policy, depths with
+    | Drop, _ -> Array.make n 0
+    | Queue _, Some d when Array.length d <> n ->
+      invalid_arg "Vmnet.set_shaper: depths"
+    | Queue _, Some d -> d
+    | Queue s, None when s > 0 -> Array.make n s
+    | Queue _, None -> invalid_arg "Vmnet.set_shaper: queue size" in
+  Raw.caml_vmnet_set_shaper iface (raw_limit limit) (Array.map raw_limit classes)
+    (Array.of_list (List.map raw_rule rules)) depths
+
+let set_tx_priority t ?rules depths =
+  let classes = Array.map (fun _ -> unlimited) depths in
+  set_shaper t ~policy:(Queue 1) ~depths ~classes ?rules unlimited
+
+type tx_stats = {
+  tx_sent: int;
+  tx_shaped: int;
+  tx_dropped: int;
+  tx_queued: int;
+} [@@deriving sexp]
+
+let tx_stats {iface;_} =
+  Array.map (fun (tx_sent, tx_shaped, tx_dropped, tx_queued) ->
+      { tx_sent; tx_shaped; tx_dropped; tx_queued })
+    (Raw.caml_vmnet_tx_stats iface)
+
+let cross_connect a b =
+  match Raw.caml_vmnet_cross_connect a.iface b.iface with
+  | -1 -> invalid_arg "Vmnet.cross_connect: same interface"
+  | -2 -> invalid_arg "Vmnet.cross_connect: already attached or cross-connected"
+  | _ -> ()
+
+let cross_disconnect {iface;_} = Raw.caml_vmnet_cross_disconnect iface
+
+let cross_stats {iface;_} = Raw.caml_vmnet_cross_stats iface
+
+module Switch = struct
+  type vmnet = t
+  type t
+  type port = int
+
+  external create_raw : int -> int -> t = "caml_vmnet_switch_create"
+  external attach_raw : t -> interface_ref -> int = "caml_vmnet_switch_attach"
+  external add_local_raw : t -> int -> int -> int = "caml_vmnet_switch_add_local"
+  external remove_port : t -> port -> unit = "caml_vmnet_switch_remove_port"
+  external inject_raw : t -> port -> (Raw.buf * int * int) array -> unit = "caml_vmnet_switch_inject"
+  external read_raw : t -> port -> Raw.buf -> int -> int -> int = "caml_vmnet_switch_read"
+  external stats_raw : t -> (int * int * int * int * int) = "caml_vmnet_switch_stats"
+  external port_stats_raw : t -> port -> (int * int) = "caml_vmnet_switch_port_stats"
+  external add_vhost_raw : t -> Unix.file_descr -> int = "caml_vmnet_switch_add_vhost"
+  external add_stream_raw : t -> Unix.file_descr -> int -> int -> string -> int = "caml_vmnet_switch_add_stream"
+  external add_dgram_raw : t -> Unix.file_descr -> string -> int = "caml_vmnet_switch_add_dgram"
+
+  let create ?(table_size = 1024) ?(aging = 300.) () =
+    create_raw table_size (int_of_float (aging *. 1000.))
+
+  let check_port fn = function
+    | -1 -> failwith (fn ^ ": all ports are in use")
+    | port -> port
+
+  let attach sw ({iface;_} : vmnet) =
+    match attach_raw sw iface with
+    | -2 -> invalid_arg "Vmnet.Switch.attach: already attached or cross-connected"
+    | port -> check_port "Vmnet.Switch.attach" port
+
+  let add_local_port ?(slots = 256) ?(slot_size = 1518) sw =
+    check_port "Vmnet.Switch.add_local_port" (add_local_raw sw slots slot_size)
+
+  (* Serve [path] with [add], which takes over the listening socket *)
+  let listen_unix fn path add =
+    let fd = Unix.socket Unix.PF_UNIX Unix.SOCK_STREAM 0 in
+    match
+      (try Unix.unlink path with Unix.Unix_error (Unix.ENOENT, _, _) -> ());
+      Unix.bind fd (Unix.ADDR_UNIX path);
+      Unix.listen fd 1;
+      add fd
+    with
+    | -1 -> Unix.close fd; check_port fn (-1)
+    | port -> port
+    | exception e -> Unix.close fd; raise e
+
+  let add_vhost_port sw path =
+    listen_unix "Vmnet.Switch.add_vhost_port" path (add_vhost_raw sw)
+
+  (* Framings of add_stream_raw, as in vmnet_stream.c *)
+  let stream_vpnkit = 0
+  let stream_qemu = 1
+
+  let add_vpnkit_port ?(mtu = 1500) ~mac sw path =
+    listen_unix "Vmnet.Switch.add_vpnkit_port" path (fun fd ->
+      add_stream_raw sw fd stream_vpnkit mtu (Macaddr.to_octets mac))
+
+  let add_qemu_stream_port sw path =
+    listen_unix "Vmnet.Switch.add_qemu_stream_port" path (fun fd ->
+      add_stream_raw sw fd stream_qemu 1500 (Macaddr.to_octets Macaddr.broadcast))
+
+  let add_qemu_dgram_port sw ~local ~remote =
+    let fd = Unix.socket Unix.PF_UNIX Unix.SOCK_DGRAM 0 in
+    match
+      (try Unix.unlink local with Unix.Unix_error (Unix.ENOENT, _, _) -> ());
+      Unix.bind fd (Unix.ADDR_UNIX local);
+      add_dgram_raw sw fd remote
+    with
+    | -1 -> Unix.close fd; check_port "Vmnet.Switch.add_qemu_dgram_port" (-1)
+    | port -> port
+    | exception e -> Unix.close fd; raise e
+
+  let inject sw port bufs =
+    let raw c = (c.Cstruct.buffer, c.Cstruct.off, c.Cstruct.len) in
+    inject_raw sw port (Array.of_list (List.map raw bufs))
+
+  let read sw port c =
+    match read_raw sw port c.Cstruct.buffer c.Cstruct.off c.Cstruct.len with
+    | 0 -> raise No_packets_waiting
+    | len when len > 0 -> Cstruct.sub c 0 len
+    | _ -> raise (Error Packet_too_big)
+
+  type stats = {
+    forwarded: int;
+    flooded: int;
+    dropped: int;
+    learned: int;
+    entries: int;
+  } [@@deriving sexp]
+
+  let stats sw =
+    let (forwarded, flooded, dropped, learned, entries) = stats_raw sw in
+    { forwarded; flooded; dropped; learned; entries }
+
+  let port_stats = port_stats_raw
+end
+
+module Fanout = struct
+  type vmnet = t
+
+  external set_raw : interface_ref -> Unix.file_descr option -> int -> int -> bool -> unit = "caml_vmnet_set_fanout"
+  external map_raw : Unix.file_descr -> int -> Raw.buf = "caml_vmnet_fanout_map"
+  external head_raw : Raw.buf -> int = "caml_vmnet_fanout_head" [@@noalloc]
+  external next_raw : Raw.buf -> int array -> int = "caml_vmnet_fanout_next" [@@noalloc]
+  external intact_raw : Raw.buf -> int -> bool = "caml_vmnet_fanout_intact" [@@noalloc]
+
+  let publish ?(tx = false) ?(slots = 4096) ?(slot_size = 1518) ({iface;_} : vmnet) path =
+    (* Consumers may still map the old file: replace it rather than
+       truncating it under them *)
+    (try Unix.unlink path with Unix.Unix_error (Unix.ENOENT, _, _) -> ());
+    let fd = Unix.openfile path Unix.[O_RDWR; O_CREAT; O_EXCL; O_CLOEXEC] 0o644 in
+    match set_raw iface (Some fd) slots slot_size tx with
+    | () -> Unix.close fd
+    | exception e -> Unix.close fd; raise e
+
+  let stop ({iface;_} : vmnet) = set_raw iface None 0 0 false
+
+  (* info is the cursor, then the frame returned last: its number, offset,
+     length, captured length, direction and timestamp *)
+  type reader = {
+    buf: Raw.buf;
+    info: int array;
+  }
+
+  type dir = Rx | Tx
+
+  type event =
+    | Frame of { dir: dir; timestamp: int; len: int; data: Cstruct.t }
+    | Lost of int
+    | Empty
+
+  let attach path =
+    let fd = Unix.openfile path Unix.[O_RDONLY; O_CLOEXEC] 0 in
+    match map_raw fd (Unix.fstat fd).Unix.st_size with
+    | buf ->
+      (* The mapping goes with the last bigarray sharing it, see
+         vmnet_fanout.c *)
+      Unix.close fd;
+      let info = Array.make 7 0 in
+      info.(0) <- head_raw buf;
+      { buf; info }
+    | exception e -> Unix.close fd; raise e
+
+  let next r =
+    match next_raw r.buf r.info with
+    | 0 -> Empty
+    | -1 ->
+      let dir = if r.info.(5) = 0 then Rx else Tx in
+      let data = Cstruct.of_bigarray r.buf ~off:r.info.(2) ~len:r.info.(4) in
+      Frame { dir; timestamp = r.info.(6); len = r.info.(3); data }
+    | n -> Lost n
+
+  let intact r = intact_raw r.buf r.info.(1)
+end
+
+module Checksum = struct
+  external partial : Raw.buf -> int -> int -> int = "caml_vmnet_checksum_partial" [@@noalloc]
+  external fill_raw : Raw.buf -> int -> int -> int = "caml_vmnet_checksum_fill" [@@noalloc]
+  external verify_raw : Raw.buf -> int -> int -> bool = "caml_vmnet_checksum_verify" [@@noalloc]
+
+  let fold x =
+    let x = (x land 0xffff) + (x lsr 16) in
+    (x land 0xffff) + (x lsr 16)
+
+  let swap16 x = ((x land 0xff) lsl 8) lor (x lsr 8)
+
+  let ones_complement c =
+    lnot (partial c.Cstruct.buffer c.Cstruct.off c.Cstruct.len) land 0xffff
+
+  (* A buffer starting at an odd offset of the whole contributes its bytes
+     to the opposite halves of each word, which is a byte swap of its sum. *)
+  let ones_complement_list l =
+    let sum, _ = List.fold_left (fun (sum, odd) c ->
+        let p = partial c.Cstruct.buffer c.Cstruct.off c.Cstruct.len in
+        let p = if odd then swap16 p else p in
+        (fold (sum + p), odd <> (c.Cstruct.len land 1 = 1))) (0, false) l in
+    lnot sum land 0xffff
+
+  let update csum ~old ~new_ =
+    lnot (fold ((lnot csum land 0xffff) + (lnot old land 0xffff) + new_)) land 0xffff
+
+  let fill c = fill_raw c.Cstruct.buffer c.Cstruct.off c.Cstruct.len
+  let verify c = verify_raw c.Cstruct.buffer c.Cstruct.off c.Cstruct.len
+end
+
 let shared_interface_list =
   Raw.caml_shared_interface_list
 
-let get_port_forwarding_rules {iface;_} =
+let rule_key protocol ext_port = (int_of_proto protocol, ext_port)
+
+(* [Other 6] is [TCP]: rules are kept and compared as vmnet reports them *)
+let canonical_rule r = { r with protocol = proto_of_int (int_of_proto r.protocol) }
+
+let with_rules {rules; _} f =
+  Mutex.lock rules.lock;
+  match f rules with
+  | r -> Mutex.unlock rules.lock; r
+  | exception e -> Mutex.unlock rules.lock; raise e
+
+let load_rules rules r =
+  Hashtbl.reset rules.installed;
+  Array.iter (fun (protocol, external_port, internal_address, internal_port) ->
+      Hashtbl.replace rules.installed (rule_key protocol external_port)
+        { protocol; external_port; internal_address; internal_port }) r;
+  rules.loaded <- true
+
+let decode_rules op =
   let f (proto, ext_port, int_addr, int_port) =
     (proto_of_int proto, ext_port, Ipaddr.V4.of_string_exn int_addr, int_port)
   in
-  Array.map f (Raw.caml_interface_get_port_forwarding_rules iface)
+  match Raw.caml_interface_get_port_forwarding_rules_result op with
+  | r -> Array.map f r
+  | exception Raw.Return_code r -> raise (Error (error_of_int r))
 
-let add_port_forwarding_rule {iface;_} protocol ext_port ip int_port =
-  Raw.caml_vmnet_interface_add_port_forwarding_rule iface (int_of_proto protocol) ext_port (Ipaddr.V4.to_string ip) int_port
-  |> function
-  | 1000 -> () (* VMNET_SUCCESS *)
-  | err -> raise (Error (error_of_int err))
+(* Read the index from vmnet unless it has been already.  The round-trip
+   is made without the lock, which is only taken to install the result,
+   and only if no other thread has loaded the index meanwhile. *)
+let ensure_rules_loaded ({iface;_} as t) =
+  if not (with_rules t (fun rules -> rules.loaded)) then begin
+    let op = Raw.caml_interface_get_port_forwarding_rules_start iface in
+    let r = Pending.result { Pending.op; finish = decode_rules } in
+    with_rules t (fun rules -> if not rules.loaded then load_rules rules r)
+  end
 
-let remove_port_forwarding_rule {iface;_} protocol ext_port =
-  Raw.caml_vmnet_interface_remove_port_forwarding_rule iface (int_of_proto protocol) ext_port
-  |> function
-  | 1000 -> () (* VMNET_SUCCESS *)
-  | err -> raise (Error (error_of_int err))
+let get_port_forwarding_rules_async ({iface;_} as t) =
+  let finish op =
+    let r = decode_rules op in
+    with_rules t (fun rules -> load_rules rules r);
+    r
+  in
+  { Pending.op = Raw.caml_interface_get_port_forwarding_rules_start iface;
+    finish }
+
+let get_port_forwarding_rules t =
+  Pending.result (get_port_forwarding_rules_async t)
+
+let int_of_ipv4 ip =
+  Int32.to_int (Ipaddr.V4.to_int32 ip) land 0xffffffff
+
+let add_port_forwarding_rules_async ({iface;_} as t) rules =
+  let raw r =
+    (int_of_proto r.protocol, r.external_port, int_of_ipv4 r.internal_address,
+     r.internal_port) in
+  let op = Raw.caml_vmnet_interface_add_port_forwarding_rules iface
+      (Array.of_list (List.map raw rules)) in
+  let finish op =
+    let results =
+      List.combine rules (Array.to_list (Array.map result_of_int (Raw.op_statuses op))) in
+    with_rules t (fun index ->
+        List.iter (function
+            | r, Ok () ->
+              Hashtbl.replace index.installed (rule_key r.protocol r.external_port)
+                (canonical_rule r)
+            | _ -> ()) results);
+    results
+  in
+  { Pending.op; finish }
+
+let add_port_forwarding_rules t rules =
+  Pending.result (add_port_forwarding_rules_async t rules)
+
+let remove_port_forwarding_rules_async ({iface;_} as t) rules =
+  let raw (protocol, ext_port) = (int_of_proto protocol, ext_port) in
+  let op = Raw.caml_vmnet_interface_remove_port_forwarding_rules iface
+      (Array.of_list (List.map raw rules)) in
+  let finish op =
+    let results =
+      List.combine rules (Array.to_list (Array.map result_of_int (Raw.op_statuses op))) in
+    with_rules t (fun index ->
+        List.iter (function
+            | (protocol, ext_port), Ok () ->
+              Hashtbl.remove index.installed (rule_key protocol ext_port)
+            | _ -> ()) results);
+    results
+  in
+  { Pending.op; finish }
+
+let remove_port_forwarding_rules t rules =
+  Pending.result (remove_port_forwarding_rules_async t rules)
+
+(* A single rule is a bulk operation of one that raises on failure *)
+let single p =
+  let finish op =
+    match p.Pending.finish op with
+    | [ (_, r) ] -> begin
+        match error_of_result r with
+        | None -> ()
+        | Some err -> raise (Error err)
+      end
+    | _ -> assert false
+  in
+  { p with Pending.finish }
+
+let add_port_forwarding_rule_async t protocol ext_port ip int_port =
+  single (add_port_forwarding_rules_async t
+            [ { protocol; external_port = ext_port; internal_address = ip;
+                internal_port = int_port } ])
+
+let add_port_forwarding_rule t protocol ext_port ip int_port =
+  Pending.result (add_port_forwarding_rule_async t protocol ext_port ip int_port)
+
+let remove_port_forwarding_rule_async t protocol ext_port =
+  single (remove_port_forwarding_rules_async t [ (protocol, ext_port) ])
+
+let remove_port_forwarding_rule t protocol ext_port =
+  Pending.result (remove_port_forwarding_rule_async t protocol ext_port)
+
+let cached_port_forwarding_rules t =
+  with_rules t (fun rules ->
+      if rules.loaded then
+        Some (Hashtbl.fold (fun _ r acc -> r :: acc) rules.installed [])
+      else None)
+
+let port_forwarding_rules t =
+  ensure_rules_loaded t;
+  match cached_port_forwarding_rules t with
+  | Some rules -> rules
+  | None -> assert false
+
+let rule_changes installed desired =
+  let index l =
+    let h = Hashtbl.create (List.length l) in
+    List.iter (fun r ->
+        let r = canonical_rule r in
+        Hashtbl.replace h (rule_key r.protocol r.external_port) r) l;
+    h
+  in
+  let installed = index installed and wanted = index desired in
+  let removes = Hashtbl.fold (fun key r acc ->
+      match Hashtbl.find_opt wanted key with
+      | Some w when w = r -> acc
+      | _ -> (r.protocol, r.external_port) :: acc) installed [] in
+  let adds = Hashtbl.fold (fun key w acc ->
+      match Hashtbl.find_opt installed key with
+      | Some r when r = w -> acc
+      | _ -> w :: acc) wanted [] in
+  adds, removes
+
+let first_error results =
+  List.fold_left (fun acc (_, r) ->
+      match acc with
+      | None -> error_of_result r
+      | acc -> acc) None results
+
+let reconcile t desired =
+  let adds, removes = rule_changes (port_forwarding_rules t) desired in
+  (* Rules whose target changed are removed before being added again *)
+  let removed = match removes with
+    | [] -> []
+    | l -> remove_port_forwarding_rules t l in
+  let added = match adds with
+    | [] -> []
+    | l -> add_port_forwarding_rules t l in
+  match first_error removed, first_error added with
+  | Some err, _ | None, Some err -> raise (Error err)
+  | None, None -> ()
@@ -56,6 +56,15 @@ type proto =
   | ICMP
   | Other of int [@@deriving sexp]
 
+(** [rule] is a port forwarding rule mapping [external_port] on the host to
+    [internal_address]:[internal_port] on the vmnet interface. *)
+type rule = {
+  protocol: proto;
+  external_port: int;
+  internal_address: Ipaddr_sexp.V4.t;
+  internal_port: int;
+} [@@deriving sexp]
+
 (** [error] represents hard failures from the underlying vmnet functions. *)
 type error =
  | Failure
@@ -80,6 +89,30 @@ exception Permission_denied
    until packets do arrive. *)
 exception No_packets_waiting [@@deriving sexp]
 
+(** [Timeout] is raised when an operation given a [timeout] did not complete
+    in time. *)
+exception Timeout [@@deriving sexp]
+
+(** Operations that complete asynchronously on a vmnet dispatch queue. *)
+module Pending : sig
+  (** ['a t] is an in-flight operation that will produce an ['a]. *)
+  type 'a t
+
+  (** [fd p] is a descriptor that becomes readable once [p] has completed.
+      It is owned by [p] and must not be read from or closed; it is intended
+      to be registered with an event loop. *)
+  val fd : 'a t -> Unix.file_descr
+
+  (** [wait ?timeout p] blocks the current thread until [p] has completed,
+      without holding the OCaml runtime lock.  Raises {!Timeout} if it did
+      not complete within [timeout] seconds. *)
+  val wait : ?timeout:float -> 'a t -> unit
+
+  (** [result p] waits for [p] to complete and returns its result, raising
+      the same exceptions as the equivalent synchronous call. *)
+  val result : 'a t -> 'a
+end
+
 (** [init ?mode ?uuid ?ipv4_config] will initialise a vmnet interface,
     defaulting to {!Shared_mode} for the output. UUID is randomly generated if
     not specified. Subsequent calls to [init] with the same UUID will provide
@@ -91,8 +124,38 @@ exception No_packets_waiting [@@deriving sexp]
     matching the netmask outside the start/end range can be used for static
     allocation. Only IP-addresses in the private range (RFC 1918) are accepted.
 
+    The OCaml runtime lock is released while waiting for vmnet, so several
+    threads can create interfaces concurrently.  If [timeout] (in seconds) is
+    given and the interface is not ready in time, {!Timeout} is raised and
+    the interface is stopped once vmnet eventually creates it.
+
+    If [offload] is true (default false) and vmnet supports it (macOS 12
+    and later), vmnet is asked to compute checksums and segment TCP itself,
+    see {!offload} and {!read_vnet}.
+
     Raises {!Error} if something goes wrong. *)
-val init : ?mode:mode -> ?uuid:Uuidm.t -> ?ipv4_config:ipv4_config -> unit -> t
+val init : ?mode:mode -> ?uuid:Uuidm.t -> ?ipv4_config:ipv4_config -> ?offload:bool -> ?timeout:float -> unit -> t
+
+(** [init_async ?mode ?uuid ?ipv4_config ()] starts creating an interface as
+    {!init} does, but returns immediately.  Many interfaces can be started
+    back to back and collected later with {!Pending.result}. *)
+val init_async : ?mode:mode -> ?uuid:Uuidm.t -> ?ipv4_config:ipv4_config -> ?offload:bool -> unit -> t Pending.t
+
+(** [stop ?timeout t] stops the interface and gives it back to vmnet.
+    Threads blocked in {!wait_for_event} return with an error, and later
+    reads, writes and port forwarding changes raise
+    [Error Invalid_argument]; frames already queued by the receive pipeline
+    can still be read.  Stopping an interface twice does nothing.  [t]
+    must first be detached from any switch and cross-connect, or
+    [Invalid_argument] is raised, and must not be used concurrently from
+    another thread.  Raises {!Timeout} if vmnet did not confirm within
+    [timeout] seconds (the interface is stopped regardless) and {!Error} if
+    vmnet refused. *)
+val stop : ?timeout:float -> t -> unit
+
+(** [stop_async t] starts stopping [t] as {!stop} does, but returns
+    immediately. *)
+val stop_async : t -> unit Pending.t
 
 (** [mac t] will return the MAC address bound to the guest network interface. *)
 val mac : t -> Macaddr.t
@@ -110,24 +173,590 @@ val uuid : t -> Uuidm.t
     {!read}. *)
 val max_packet_size: t -> int
 
+(** [offload t] is true if vmnet computes checksums and segments TCP for
+   [t].  Frames of up to 64 KiB may then be read and written, and
+   {!max_packet_size} is raised accordingly. *)
+val offload : t -> bool
+
 (** [set_event_handler t] will initalise the internal thread state in the library
     that listen for event notifications from the library.  The {!wait_for_event}
     function should not be called until this {!set_event_handler} been called once. *)
 val set_event_handler : t -> unit
 
-(** [wait_for_event t] will block the current OCaml thread until an event
-    notification has been received on the [t] vmnet interface. *)
-val wait_for_event : t -> unit
+(** [wait_for_event ?timeout t] will block the current OCaml thread until an
+    event notification has been received on the [t] vmnet interface.
+    Raises {!Timeout} if none was within [timeout] seconds, and
+    [Error Invalid_argument] once [t] is stopped. *)
+val wait_for_event : ?timeout:float -> t -> unit
 
 (** [read t buf] will read a network packet into the [buf] {!Cstruct.t} and
    return a fresh subview that represents the packet with the correct length
    and offset.  It will raise {!No_packets_waiting} if there is nothing to read. *)
 val read : t -> Cstruct.t -> Cstruct.t
 
-(** [write t buf] will transmit a network packet contained in [buf].  This will
+(** [rx_info] describes a frame returned by {!read_info}.  [segments] is
+   the number of received frames that were coalesced into it, 1 unless
+   {!set_gro} is enabled.  [timestamp] is when the frame was received, on
+   the clock of {!now}: when the event handler fired for the batch it
+   arrived in if the receive pipeline is on and the handler is installed,
+   and otherwise when it was read from vmnet. *)
+type rx_info = {
+  segments: int;
+  timestamp: int;
+} [@@deriving sexp]
+
+(** [now ()] is the monotonic clock used for receive timestamps, in
+   nanoseconds. *)
+val now : unit -> int
+
+(** [read_info ?queue t buf] is {!read} from receive queue [queue]
+   (default 0, see {!set_demux}) that also returns the {!rx_info} of the
+   frame. *)
+val read_info : ?queue:int -> t -> Cstruct.t -> Cstruct.t * rx_info
+
+(** [read_batch ?queue t bufs] reads up to one packet from [queue] into
+   each of [bufs] with as few calls into vmnet as possible, and returns the
+   filled subviews in order.  It raises {!No_packets_waiting} if there is
+   nothing to read. *)
+val read_batch : ?queue:int -> t -> Cstruct.t list -> Cstruct.t list
+
+(** [read_batch_info ?queue t bufs] is {!read_batch} that also returns the
+   {!rx_info} of each frame. *)
+val read_batch_info : ?queue:int -> t -> Cstruct.t list -> (Cstruct.t * rx_info) list
+
+(** [token] stands for a frame lent by {!recv_borrow}. *)
+type token
+
+(** [recv_borrow ?queue t] is the next frame of receive queue [queue]
+   (default 0), as a view of the receive queue itself rather than a copy,
+   together with the token to {!release} it with.  The slot holding the
+   frame is not reused until then, so frames should be released promptly:
+   the queue fills up with frames that are neither read nor released.
+   Frames may be released in any order.  The view and any sub-view of it
+   must not be used after the release.  This enables the receive queues
+   like {!set_demux}, which then raises [Invalid_argument] while frames are
+   borrowed, as does {!set_gro} when it has to enlarge the queues.  Raises
+   {!No_packets_waiting} if there is nothing to read. *)
+val recv_borrow : ?queue:int -> t -> Cstruct.t * token
+
+(** [borrowed_info token] is the {!rx_info} of the frame lent as [token]. *)
+val borrowed_info : token -> rx_info
+
+(** [release token] hands the frame back.  Raises [Invalid_argument] if it
+   was already released. *)
+val release : token -> unit
+
+(** [set_borrow_checks t enabled] turns on checks meant for debugging users
+   of {!recv_borrow}: released views are redirected to a poisoned buffer,
+   so reading them gives [0xdb] bytes rather than a later frame, writing
+   them makes the next {!recv_borrow} or {!release} raise [Failure], and
+   tokens of frames borrowed while checks are on that are garbage
+   collected without being released are reported on stderr. *)
+val set_borrow_checks : t -> bool -> unit
+
+(** [set_gro t enabled] controls receive coalescing.  When enabled, frames
+   are read from vmnet in batches (from the event handler thread if
+   {!set_event_handler} was called) and in-order TCP/IPv4 segments of the
+   same connection are merged into a single frame of up to 64KB, with the
+   IPv4 and TCP headers and checksums rewritten to match.  A connection's
+   frame is handed over when a segment carries PSH, when a segment does
+   not follow on from it, or at the end of the batch, so no data is held
+   back waiting for more.  Reads must then use buffers of at least
+   {!rx_buffer_size} bytes; a frame that does not fit raises
+   [Error Packet_too_big] and is kept for the next read.  Disabled by
+   default. *)
+val set_gro : t -> bool -> unit
+
+(** [rx_buffer_size t] is the smallest buffer that can hold any frame
+   returned by {!read}: {!max_packet_size} unless {!set_gro} was enabled. *)
+val rx_buffer_size : t -> int
+
+(** Classic BPF programs, as produced by [tcpdump -ddd]. *)
+module Filter : sig
+  (** [insn] is one BPF instruction. *)
+  type insn = {
+    code: int;
+    jt: int;
+    jf: int;
+    k: int;
+  } [@@deriving sexp]
+
+  (** [t] is a BPF program.  It returns the number of bytes of the frame
+      to keep, with 0 dropping it. *)
+  type t = insn array [@@deriving sexp]
+
+  (** [of_string s] decodes the output of [tcpdump -ddd], for instance
+      [tcpdump -ddd 'arp or ip host 192.168.64.2'].  Raises
+      [Invalid_argument] if [s] is malformed. *)
+  val of_string : string -> t
+
+  (** [for_mac ?broadcast ?multicast mac] accepts frames whose destination
+      is [mac], plus broadcast frames if [broadcast] (the default) and all
+      multicast frames if [multicast] (off by default). *)
+  val for_mac : ?broadcast:bool -> ?multicast:bool -> Macaddr.t -> t
+end
+
+(** [set_filter t prog] installs the BPF program [prog] on the receive
+   path of [t], or removes the current one with [None].  Frames are read
+   from vmnet in batches and filtered in C, so rejected frames neither
+   wake the event handler nor reach {!read}; a program returning less than
+   a frame's length truncates it.  The program is interpreted after being
+   checked once.  Raises [Invalid_argument] if it uses unknown
+   instructions, jumps out of bounds or does not end with a return. *)
+val set_filter : t -> Filter.t option -> unit
+
+(** [set_responder t bindings] answers, in C, ARP requests for the IPv4
+   addresses of [bindings] with the MAC paired with them, and ICMP echo
+   requests sent to one of those addresses and its MAC.  Replies are
+   written back to [t] as soon as the batch of frames they arrived in has
+   been read, and the requests are consumed without reaching {!read}, so
+   health checks are answered even while OCaml is busy.  The responder
+   runs ahead of {!set_filter}.  An empty list turns it off. *)
+val set_responder : t -> (Ipaddr.V4.t * Macaddr.t) list -> unit
+
+(** [destination] matches the destination MAC address of a frame.
+   {!Multicast} does not include broadcast. *)
+type destination =
+  | Any_destination
+  | Destination of Macaddr_sexp.t
+  | Broadcast
+  | Multicast [@@deriving sexp]
+
+(** [demux_rule] sends frames whose EtherType (after at most one VLAN tag)
+   is [ethertype], or any if [None], and whose destination matches
+   [destination] to receive queue [queue]. *)
+type demux_rule = {
+  ethertype: int option;
+  destination: destination;
+  queue: int;
+} [@@deriving sexp]
+
+(** [max_queues] is the largest number of receive queues an interface can
+   have. *)
+val max_queues : int
+
+(** [set_demux t ?slots ~queues rules] splits received frames over
+   [queues] separate receive queues of [slots] frames each.  Frames are
+   classified in C as they are read from vmnet: the first of [rules] that
+   matches decides the queue, and frames matching none go to queue 0,
+   which is the one {!read} uses, or are spread by {!set_rss}.  Each
+   queue is bounded and a frame for a full queue is dropped (see {!stats})
+   rather than holding up the others, so that for instance ARP can be kept
+   away from a bulk data backlog.  Frames already queued are kept.  Raises
+   [Invalid_argument] if [queues] is not between 1 and {!max_queues} or a
+   rule names a queue that does not exist. *)
+val set_demux : t -> ?slots:int -> queues:int -> demux_rule list -> unit
+
+(** [set_rss t ?key table] spreads the frames that match no {!set_demux}
+   rule over the receive queues by flow: each frame goes to queue
+   [table.(h mod Array.length table)], where [h] is {!rss_hash} of the
+   frame.  All frames of a TCP or UDP flow land in the same queue and stay
+   in order, and flows can be moved between queues by changing [table]
+   alone, e.g. starting from [Array.init 128 (fun i -> i mod queues)].
+   The queues must first be created with {!set_demux}.  An empty [table]
+   turns steering off.  Raises [Invalid_argument] if the length of [table]
+   is not a power of two up to 128 or an entry is not a queue. *)
+val set_rss : t -> ?key:string -> int array -> unit
+
+(** [default_rss_key] is the 40-byte Toeplitz key used unless another one
+   is given, the one of the Microsoft RSS verification suite. *)
+val default_rss_key : string
+
+(** [rss_hash ?key frame] is the Toeplitz hash that {!set_rss} computes
+   for the Ethernet [frame]: over the IPv4 or IPv6 source and destination
+   addresses, followed by the ports for unfragmented TCP and UDP.  It is 0
+   for frames that are not IP. *)
+val rss_hash : ?key:string -> Cstruct.t -> int
+
+(** [ready_queues t] lists the receive queues that have frames waiting,
+   as of the last batch read from vmnet.  It is empty unless the receive
+   pipeline is on (see {!set_gro}, {!set_filter} and {!set_demux}). *)
+val ready_queues : t -> int list
+
+(** [stats] are counters for the receive path of an interface.
+   [rx_frames] counts frames read from vmnet, [rx_filter_accepted] and
+   [rx_filter_dropped] the verdicts of the {!set_filter} program,
+   [rx_gro_merged] the segments {!set_gro} appended to an earlier frame,
+   [rx_queue_dropped] the frames lost because their receive queue was
+   full, and [rx_answered] the requests answered by {!set_responder}. *)
+type stats = {
+  rx_frames: int;
+  rx_filter_accepted: int;
+  rx_filter_dropped: int;
+  rx_gro_merged: int;
+  rx_queue_dropped: int;
+  rx_answered: int;
+} [@@deriving sexp]
+
+(** [stats t] returns the current counters of [t]. *)
+val stats : t -> stats
+
+(** [write ?tx_class t buf] will transmit a network packet contained in [buf].  This will
    normally not block, but the vmnet interface isnt clear on whether this might
-   happen. *)
-val write : t -> Cstruct.t -> unit
+   happen.  [tx_class] overrides the {!tx_rule}s when the shaper or
+   {!set_tx_priority} is in use. *)
+val write : ?tx_class:int -> t -> Cstruct.t -> unit
+
+(** [write_batch ?tx_class t bufs] transmits every packet in [bufs] with as few calls
+   into vmnet as possible, and returns how many of them were accepted (in
+   order).  Raises {!Error} if none could be written. *)
+val write_batch : ?tx_class:int -> t -> Cstruct.t list -> int
+
+(** [write_gso t ~mss buf] transmits a TCP/IPv4 segment whose payload may be
+   larger than the MTU.  It is split into frames carrying at most [mss]
+   payload bytes each, with the IPv4 and TCP headers (length, identification,
+   sequence number, flags and checksums) adjusted per frame, and written as a
+   batch.  Other frames are written unchanged.  Returns the number of frames
+   accepted by vmnet and raises {!Error} if none could be written. *)
+val write_gso : t -> mss:int -> Cstruct.t -> int
+
+(** Virtio-net headers, the offload metadata that virtio guests and Linux
+   TAP devices opened with [IFF_VNET_HDR] put in front of each frame. *)
+module Vnet_hdr : sig
+  type gso = Gso_none | Gso_tcpv4 | Gso_udp | Gso_tcpv6 [@@deriving sexp]
+
+  (** [t] is a decoded header.  With [needs_csum], the checksum at
+     [csum_start + csum_offset] only holds the sum of the pseudo header and
+     must be completed over the data from [csum_start].  [data_valid] means
+     the checksums were verified.  A [gso] frame is to be split into
+     segments of [gso_size] payload bytes after [hdr_len] bytes of
+     headers. *)
+  type t = {
+    needs_csum: bool;
+    data_valid: bool;
+    gso: gso;
+    gso_ecn: bool;
+    hdr_len: int;
+    gso_size: int;
+    csum_start: int;
+    csum_offset: int;
+  } [@@deriving sexp]
+
+  (** [len] is the size of an encoded header, 10 bytes. *)
+  val len : int
+
+  (** [none] describes a frame with complete checksums and no GSO. *)
+  val none : t
+
+  (** [decode buf] reads the header at the start of [buf]. *)
+  val decode : Cstruct.t -> t
+
+  (** [encode h buf] writes [h] at the start of [buf]. *)
+  val encode : t -> Cstruct.t -> unit
+end
+
+(** [read_vnet ?queue t buf] is {!read_info} that stores the frame after a
+   {!Vnet_hdr} describing it, and returns the view of both.  Frames
+   coalesced by {!set_gro} are GSO frames with [data_valid] checksums.  If
+   {!offload} is set, TCP and UDP checksums are [needs_csum] and TCP frames
+   larger than the MTU are GSO frames. *)
+val read_vnet : ?queue:int -> t -> Cstruct.t -> Cstruct.t
+
+(** [write_vnet ?tx_class t buf] transmits the frame that follows the
+   {!Vnet_hdr} at the start of [buf].  If {!offload} is set, the frame is
+   handed to vmnet as it is.  Otherwise [needs_csum] checksums are
+   completed in [buf] and [Gso_tcpv4] frames are split as by {!write_gso};
+   other GSO frames fail with [Error Invalid_argument].  Returns the number
+   of frames accepted by vmnet and raises {!Error} if none could be
+   written. *)
+val write_vnet : ?tx_class:int -> t -> Cstruct.t -> int
+
+(** [set_tx_checksum t enabled] controls whether {!write} computes the IPv4
+   header checksum and the TCP or UDP checksum of each outgoing frame before
+   handing it to vmnet.  The checksums are written into the caller's buffer.
+   Disabled by default. *)
+val set_tx_checksum : t -> bool -> unit
+
+(** [limit] is a pair of token buckets: frames may be sent on average at
+   [bytes_per_second] and [packets_per_second], in bursts of up to
+   [burst_bytes] and [burst_packets].  A rate of 0 is not limited. *)
+type limit = {
+  bytes_per_second: float;
+  packets_per_second: float;
+  burst_bytes: int;
+  burst_packets: int;
+} [@@deriving sexp]
+
+(** [unlimited] does not limit anything. *)
+val unlimited : limit
+
+(** [tx_rule] puts frames whose EtherType (after at most one VLAN tag) is
+   [tx_ethertype] and whose IPv4 or IPv6 DSCP is [tx_dscp], [None] matching
+   anything, in transmit class [tx_class]. *)
+type tx_rule = {
+  tx_ethertype: int option;
+  tx_dscp: int option;
+  tx_class: int;
+} [@@deriving sexp]
+
+(** [shaping] says what happens to a frame that exceeds its limits:
+   [Drop] it, or [Queue slots] it in C, with up to [slots] frames per
+   class, until the buckets have refilled.  A frame for a full queue is
+   dropped. *)
+type shaping =
+  | Drop
+  | Queue of int [@@deriving sexp]
+
+(** [max_tx_classes] is the largest number of transmit classes. *)
+val max_tx_classes : int
+
+(** [set_shaper t ?policy ?depths ?classes ?rules limit] limits the frames
+   written to [t] by {!write}, {!write_batch} and {!write_gso}.  Each frame
+   is put in a class by the first of [rules] that matches it, or in class
+   0, and must conform to both [limit] and [classes.(c)] of its class [c].
+   The buckets are refilled from the clock once per call, and queued
+   frames are sent from a timer in C; frames that are dropped or queued
+   still count as written.  [classes] defaults to a single unlimited class
+   and [policy] to [Drop].
+
+   When queueing, class [c] holds up to [depths.(c)] frames (by default the
+   size given to [Queue]) and frames that vmnet refuses with
+   [Buffer_exhausted] are queued as well instead of being returned to the
+   caller, so writes never fail with it and the send queue of
+   [Lwt_vmnet.write] never fills: the depths are the only backpressure.
+   Frames vmnet refuses for other reasons are dropped and counted in
+   [tx_dropped].  Queues are served in strict priority order, highest class
+   first, and a frame is only written straight away if its class and all
+   higher ones have nothing queued.  Frames already queued are kept if
+   [policy] still queues.  When nothing is limited or queued the shaper is
+   bypassed entirely.  Raises [Invalid_argument] if there are more than
+   {!max_tx_classes} classes or a rule names a class that does not
+   exist. *)
+val set_shaper : t -> ?policy:shaping -> ?depths:int array -> ?classes:limit array -> ?rules:tx_rule list -> limit -> unit
+
+(** [set_tx_priority t ?rules depths] sets up [Array.length depths]
+   strict-priority transmit classes without any rate limit, class [c]
+   queueing up to [depths.(c)] frames while vmnet is backed up.  Control
+   traffic can be given a higher class than bulk data with [rules], e.g.
+   by EtherType for ARP or by DSCP, or with the [tx_class] argument of
+   {!write}.  It is {!set_shaper} with {!unlimited} limits. *)
+val set_tx_priority : t -> ?rules:tx_rule list -> int array -> unit
+
+(** [tx_stats] counts, for a transmit class, the frames [tx_sent] through
+   the shaper, those [tx_shaped] because they exceeded a limit when they
+   were written, and of these the ones [tx_dropped]; [tx_queued] frames
+   are waiting to be sent.  Frames are only counted while the shaper is
+   enabled. *)
+type tx_stats = {
+  tx_sent: int;
+  tx_shaped: int;
+  tx_dropped: int;
+  tx_queued: int;
+} [@@deriving sexp]
+
+(** [tx_stats t] returns the counters of each transmit class of [t]. *)
+val tx_stats : t -> tx_stats array
+
+(** [cross_connect a b] wires [a] and [b] together: from then on each
+    interface's event callback reads the frames it receives in batches
+    and writes the same buffers to the other, in C, without copying them
+    or involving OCaml.  Reads on [a] and [b] see nothing while they are
+    connected.  To wire an interface to a socket peer, use a {!Switch}
+    with the interface and a socket port instead.  Raises
+    [Invalid_argument] if [a] and [b] are the same interface, or if
+    either is attached to a switch or cross-connected already. *)
+val cross_connect : t -> t -> unit
+
+(** [cross_disconnect t] undoes the cross-connect of [t], on both ends.
+    It does nothing if [t] is not cross-connected. *)
+val cross_disconnect : t -> unit
+
+(** [cross_stats t] is [(forwarded, dropped)]: the frames [t] received
+    since it was last cross-connected and passed on to its peer, and
+    those the peer refused. *)
+val cross_stats : t -> int * int
+
+(** A learning Ethernet switch between vmnet interfaces and local ports.
+    Frames are switched in C: each interface is read in batches from its
+    event callback, source addresses are learned into a hash table, and
+    frames for unknown, broadcast or multicast destinations are flooded to
+    every other port.  Frames never cross into OCaml unless they are sent
+    to a local port. *)
+module Switch : sig
+  type vmnet = t
+
+  (** [t] is a switch.  It is destroyed, and its interfaces detached, when
+      it is garbage collected. *)
+  type t
+
+  (** [port] numbers a port of a switch, from 0 to 63. *)
+  type port = int
+
+  (** [create ?table_size ?aging ()] is a switch with no ports.  The MAC
+      table starts with room for [table_size] addresses (1024 by default)
+      and grows as needed; addresses that have not been seen as a source
+      for [aging] seconds (300 by default) are forgotten. *)
+  val create : ?table_size:int -> ?aging:float -> unit -> t
+
+  (** [attach sw vmnet] adds [vmnet] as a port of [sw].  From then on the
+      frames it receives are switched and no longer returned by {!read};
+      the event handler is installed if it was not already.  Raises
+      [Invalid_argument] if [vmnet] is attached to a switch or
+      cross-connected already, and [Failure] if [sw] has no free port. *)
+  val attach : t -> vmnet -> port
+
+  (** [add_local_port ?slots ?slot_size sw] adds a port whose traffic is
+      sent and received from OCaml with {!inject} and {!read}.  Up to
+      [slots] frames (256 by default) of at most [slot_size] bytes are
+      queued for it; [slots = 0] discards them, which is useful for
+      benchmarks.  Raises [Failure] if [sw] has no free port. *)
+  val add_local_port : ?slots:int -> ?slot_size:int -> t -> port
+
+  (** [add_vhost_port sw path] adds a port served as a vhost-user network
+      device on the Unix socket [path], replacing any file there.  A
+      hypervisor such as QEMU connects to it and shares the guest's
+      virtqueues, and frames then move between them and the other ports
+      of [sw] in C, without going through OCaml.  One front-end is served
+      at a time, with a single queue pair of split virtqueues.
+      {!remove_port} closes the socket and removes [path].  Raises
+      [Unix.Unix_error] if the socket cannot be created and [Failure] if
+      [sw] has no free port. *)
+  val add_vhost_port : t -> string -> port
+
+  (** [add_vpnkit_port ?mtu ~mac sw path] adds a port served on the Unix
+      socket [path] with the Ethernet-over-socket protocol of vpnkit, so
+      that hyperkit and other virtual machine monitors that speak it can
+      be connected to [sw] and to any vmnet interface attached to it.
+      Clients are told to use [mtu] (1500 by default) and [mac]; each
+      frame is then sent prefixed with its 16-bit little-endian length.
+      Frames are read and written many per system call, in C.  One client
+      is served at a time.  {!remove_port} closes the socket and removes
+      [path].  Raises [Invalid_argument] if [mtu] is out of range,
+      [Unix.Unix_error] if the socket cannot be created and [Failure] if
+      [sw] has no free port. *)
+  val add_vpnkit_port : ?mtu:int -> mac:Macaddr.t -> t -> string -> port
+
+  (** [add_qemu_stream_port sw path] adds a port served on the Unix socket
+      [path] with the framing of QEMU's [-netdev stream]: each frame is
+      prefixed with its 32-bit big-endian length.  Connect a guest with
+      [-netdev stream,id=n,server=off,addr.type=unix,addr.path=path].
+      Like {!add_vpnkit_port}, frames move many per system call, in C, and
+      one client is served at a time. *)
+  val add_qemu_stream_port : t -> string -> port
+
+  (** [add_qemu_dgram_port sw ~local ~remote] adds a port exchanging one
+      frame per datagram between the Unix datagram socket bound to [local]
+      and the peer at [remote], as QEMU's [-netdev dgram] does: run the
+      guest with [-netdev dgram,id=n,local.type=unix,local.path=remote,]
+      [remote.type=unix,remote.path=local].  Datagrams are received into
+      pooled buffers and sent many per [recvmmsg] and [sendmmsg] where
+      those exist; frames the peer cannot take are dropped.
+      {!remove_port} closes the socket and removes [local].  Raises
+      [Invalid_argument] if [remote] is too long for a socket address. *)
+  val add_qemu_dgram_port : t -> local:string -> remote:string -> port
+
+  (** [remove_port sw port] removes [port], detaching its interface if it
+      has one, and forgets the addresses learned on it. *)
+  val remove_port : t -> port -> unit
+
+  (** [inject sw port frames] switches [frames] as if they were received
+      on [port]. *)
+  val inject : t -> port -> Cstruct.t list -> unit
+
+  (** [read sw port buf] takes the oldest frame queued on the local port
+      [port].  Raises {!No_packets_waiting} if there is none, and
+      [Error Packet_too_big] if it does not fit in [buf]. *)
+  val read : t -> port -> Cstruct.t -> Cstruct.t
+
+  (** [stats] counts frames [forwarded] to a single learned port, frames
+      [flooded], frames [dropped] because they were too short or were
+      destined to the port they came from, and addresses [learned]; there
+      are [entries] live addresses in the table. *)
+  type stats = {
+    forwarded: int;
+    flooded: int;
+    dropped: int;
+    learned: int;
+    entries: int;
+  } [@@deriving sexp]
+
+  val stats : t -> stats
+
+  (** [port_stats sw port] is [(sent, dropped)]: the number of frames sent
+      out of [port], and of those dropped because its queue was full. *)
+  val port_stats : t -> port -> int * int
+end
+
+(** Fan-out of an interface's traffic to other processes through a
+    memory-mapped file.  The owner of the interface copies each frame it
+    receives, and optionally each frame it transmits, into the next slot
+    of a ring in the file, overwriting the oldest frame.  It never waits
+    for consumers.  Consumers map the file read-only and follow the ring at
+    their own pace, each with its own cursor.  A consumer that falls more
+    than a ring behind is told how many frames it missed.  The layout is
+    described in [vmnet_fanout.h] for consumers written in C. *)
+module Fanout : sig
+  type vmnet = t
+
+  (** [publish ?tx ?slots ?slot_size t path] publishes the frames [t]
+      receives, and those it transmits if [tx] (false by default), in a
+      ring of [slots] slots (4096 by default, a power of two) at [path].
+      At most [slot_size] bytes of each frame are kept (1518 by default).
+      Any existing file at [path] is replaced, so consumers of the old one
+      see no new frames and must attach again.  Any previous ring of [t]
+      is dropped.  Raises [Invalid_argument] if [slots] is not a power of
+      two or [slot_size] is out of range, and [Unix.Unix_error] if the
+      file cannot be created. *)
+  val publish : ?tx:bool -> ?slots:int -> ?slot_size:int -> vmnet -> string -> unit
+
+  (** [stop t] stops publishing.  The file is left as it is. *)
+  val stop : vmnet -> unit
+
+  (** [reader] follows a ring published by another process or this one. *)
+  type reader
+
+  type dir = Rx | Tx
+
+  (** [Frame] is the next frame: [len] is its length, [data] its first
+      bytes (at most the slot size) as a view into the ring, not a copy.
+      [timestamp] is in nanoseconds on the clock of {!now}.  [Lost n]
+      means the [n] frames after the previous one were overwritten before
+      they could be read.  [Empty] means there is no frame yet. *)
+  type event =
+    | Frame of { dir: dir; timestamp: int; len: int; data: Cstruct.t }
+    | Lost of int
+    | Empty
+
+  (** [attach path] maps the ring at [path] read-only.  Reading starts
+      with the next frame published.  The ring stays mapped as long as the
+      reader or any view into it, including bigarrays taken from a frame
+      with [Cstruct.to_bigarray], is reachable.  Raises [Failure] if
+      [path] is not a ring, and [Unix.Unix_error] if it cannot be
+      opened. *)
+  val attach : string -> reader
+
+  (** [next r] is the next event of [r].  It never blocks. *)
+  val next : reader -> event
+
+  (** [intact r] is whether the frame [next] returned last is still in
+      its slot.  The publisher may overwrite the slot at any time, so
+      check this after using the frame and before trusting the result. *)
+  val intact : reader -> bool
+end
+
+(** Internet checksums (RFC 1071) computed in C, using SSE2, AVX2 or NEON
+    where available. *)
+module Checksum : sig
+  (** [ones_complement buf] is the Internet checksum of [buf]. *)
+  val ones_complement : Cstruct.t -> int
+
+  (** [ones_complement_list bufs] is the Internet checksum of the
+      concatenation of [bufs], such as a pseudo header and a segment. *)
+  val ones_complement_list : Cstruct.t list -> int
+
+  (** [update csum ~old ~new_] is [csum] adjusted for a 16-bit field of
+      the checksummed data changing from [old] to [new_] (RFC 1624). *)
+  val update : int -> old:int -> new_:int -> int
+
+  (** [fill frame] computes and stores the IPv4 header checksum and the TCP
+      or UDP checksum of the Ethernet [frame], and returns how many
+      checksums were written.  Other frames are left untouched. *)
+  val fill : Cstruct.t -> int
+
+  (** [verify frame] is [true] if the checksums {!fill} would write are
+      correct in the Ethernet [frame]. *)
+  val verify : Cstruct.t -> bool
+end
 
 (** [shared_interface_list] will return an array of interface names that support
    bridged mode. *)
@@ -138,12 +767,66 @@ val shared_interface_list : unit -> string array
    external port. *)
 val get_port_forwarding_rules : t -> (proto * int * Ipaddr.V4.t * int) array
 
+(** [get_port_forwarding_rules_async t] is {!get_port_forwarding_rules}
+   without waiting for vmnet to answer. *)
+val get_port_forwarding_rules_async : t -> (proto * int * Ipaddr.V4.t * int) array Pending.t
+
 (** [add_port_forwarding_rule t protocol external_port internal_addr
    internal_port] will create a firewall forwarding rule for the specified
    protocol, mapping the external_port to the internal_addr/internal_port on
    the vmnet interface. *)
 val add_port_forwarding_rule : t -> proto -> int -> Ipaddr.V4.t -> int -> unit
 
+(** [add_port_forwarding_rule_async] is {!add_port_forwarding_rule} without
+   waiting for vmnet to answer. *)
+val add_port_forwarding_rule_async : t -> proto -> int -> Ipaddr.V4.t -> int -> unit Pending.t
+
 (** [remove_port_forwarding_rule t protocol external_port] removes an existing
    firewall rule. *)
 val remove_port_forwarding_rule : t -> proto -> int -> unit
+
+(** [remove_port_forwarding_rule_async] is {!remove_port_forwarding_rule}
+   without waiting for vmnet to answer. *)
+val remove_port_forwarding_rule_async : t -> proto -> int -> unit Pending.t
+
+(** [port_forwarding_rules t] returns the rules installed on [t] from the
+   library's own index.  The index is read from vmnet the first time it is
+   needed (or whenever {!get_port_forwarding_rules} is called) and is then
+   kept up to date by the functions in this module, so rules changed by
+   other processes are not reflected. *)
+val port_forwarding_rules : t -> rule list
+
+(** [cached_port_forwarding_rules t] is [Some (port_forwarding_rules t)]
+   if the index has already been read from vmnet, and [None] otherwise. *)
+val cached_port_forwarding_rules : t -> rule list option
+
+(** [rule_changes installed rules] is [(adds, removes)], the rules to add
+   and the keys of the rules to remove to go from [installed] to [rules],
+   as {!reconcile} computes them. *)
+val rule_changes : rule list -> rule list -> rule list * (proto * int) list
+
+(** [reconcile t rules] makes the rules installed on [t] equal to [rules],
+   removing and adding only the rules that differ from the index, in bulk.
+   Rules are identified by protocol and external port; a rule whose target
+   changed is removed and added again.  All changes are attempted and
+   {!Error} is raised for the first failure, if any. *)
+val reconcile : t -> rule list -> unit
+
+(** [add_port_forwarding_rules t rules] installs all of [rules], queueing
+   every request with vmnet before waiting for any of them, and returns the
+   outcome for each rule in order.  The runtime lock is released while the
+   requests are issued and answered. *)
+val add_port_forwarding_rules : t -> rule list -> (rule * (unit, error) result) list
+
+(** [add_port_forwarding_rules_async t rules] is {!add_port_forwarding_rules}
+   without waiting for the completions. *)
+val add_port_forwarding_rules_async : t -> rule list -> (rule * (unit, error) result) list Pending.t
+
+(** [remove_port_forwarding_rules t keys] removes the rules identified by
+   each [(protocol, external_port)] in [keys] in the same way as
+   {!add_port_forwarding_rules}. *)
+val remove_port_forwarding_rules : t -> (proto * int) list -> ((proto * int) * (unit, error) result) list
+
+(** [remove_port_forwarding_rules_async t keys] is
+   {!remove_port_forwarding_rules} without waiting for the completions. *)
+val remove_port_forwarding_rules_async : t -> (proto * int) list -> ((proto * int) * (unit, error) result) list Pending.t
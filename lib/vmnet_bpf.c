@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (C) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Classic BPF, as used by tcpdump and the BSD packet filter.  Programs are
+   checked once by vmnet_bpf_validate so that vmnet_bpf_run only has to
+   guard packet accesses. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "vmnet_packet.h"
+
+#define BPF_CLASS(code) ((code) & 0x07)
+#define BPF_LD    0x00
+#define BPF_LDX   0x01
+#define BPF_ST    0x02
+#define BPF_STX   0x03
+#define BPF_ALU   0x04
+#define BPF_JMP   0x05
+#define BPF_RET   0x06
+#define BPF_MISC  0x07
+
+#define BPF_SIZE(code) ((code) & 0x18)
+#define BPF_W     0x00
+#define BPF_H     0x08
+#define BPF_B     0x10
+
+#define BPF_MODE(code) ((code) & 0xe0)
+#define BPF_IMM   0x00
+#define BPF_ABS   0x20
+#define BPF_IND   0x40
+#define BPF_MEM   0x60
+#define BPF_LEN   0x80
+#define BPF_MSH   0xa0
+
+#define BPF_OP(code) ((code) & 0xf0)
+#define BPF_ADD   0x00
+#define BPF_SUB   0x10
+#define BPF_MUL   0x20
+#define BPF_DIV   0x30
+#define BPF_OR    0x40
+#define BPF_AND   0x50
+#define BPF_LSH   0x60
+#define BPF_RSH   0x70
+#define BPF_NEG   0x80
+#define BPF_MOD   0x90
+#define BPF_XOR   0xa0
+
+#define BPF_JA    0x00
+#define BPF_JEQ   0x10
+#define BPF_JGT   0x20
+#define BPF_JGE   0x30
+#define BPF_JSET  0x40
+
+#define BPF_SRC(code) ((code) & 0x08)
+#define BPF_K     0x00
+#define BPF_X     0x08
+
+#define BPF_RVAL(code) ((code) & 0x18)
+#define BPF_A     0x10
+
+#define BPF_MISCOP(code) ((code) & 0xf8)
+#define BPF_TAX   0x00
+#define BPF_TXA   0x80
+
+static int
+valid_load(uint16_t code, uint32_t k)
+{
+  switch (BPF_MODE(code)) {
+  case BPF_IMM:
+  case BPF_LEN:
+    return 1;
+  case BPF_MEM:
+    return k < VMNET_BPF_MEMWORDS;
+  case BPF_ABS:
+  case BPF_IND:
+    return BPF_CLASS(code) == BPF_LD && BPF_SIZE(code) != 0x18;
+  case BPF_MSH:
+    return BPF_CLASS(code) == BPF_LDX && BPF_SIZE(code) == BPF_B;
+  default:
+    return 0;
+  }
+}
+
+int
+vmnet_bpf_validate(const struct vmnet_bpf_insn *prog, size_t n)
+{
+  if (n == 0 || n > VMNET_BPF_MAXINSNS)
+    return 0;
+  for (size_t i = 0; i < n; i++) {
+    const struct vmnet_bpf_insn *p = &prog[i];
+    size_t left = n - i - 1;  /* instructions after this one */
+    switch (BPF_CLASS(p->code)) {
+    case BPF_LD:
+    case BPF_LDX:
+      if (!valid_load(p->code, p->k))
+        return 0;
+      break;
+    case BPF_ST:
+    case BPF_STX:
+      if (p->k >= VMNET_BPF_MEMWORDS)
+        return 0;
+      break;
+    case BPF_ALU:
+      switch (BPF_OP(p->code)) {
+      case BPF_DIV:
+      case BPF_MOD:
+        if (BPF_SRC(p->code) == BPF_K && p->k == 0)
+          return 0;
+        break;
+      case BPF_ADD: case BPF_SUB: case BPF_MUL: case BPF_OR: case BPF_AND:
+      case BPF_LSH: case BPF_RSH: case BPF_NEG: case BPF_XOR:
+        break;
+      default:
+        return 0;
+      }
+      break;
+    case BPF_JMP:
+      switch (BPF_OP(p->code)) {
+      case BPF_JA:
+        if (p->k >= left)
+          return 0;
+        break;
+      case BPF_JEQ: case BPF_JGT: case BPF_JGE: case BPF_JSET:
+        if (p->jt >= left || p->jf >= left)
+          return 0;
+        break;
+      default:
+        return 0;
+      }
+      break;
+    case BPF_RET:
+      if (BPF_RVAL(p->code) == 0x18)
+        return 0;
+      break;
+    case BPF_MISC:
+      if (BPF_MISCOP(p->code) != BPF_TAX && BPF_MISCOP(p->code) != BPF_TXA)
+        return 0;
+      break;
+    }
+  }
+  return BPF_CLASS(prog[n - 1].code) == BPF_RET;
+}
+
+/* Load [size] bytes at [off], failing if they are not all in the packet */
+static int
+load(const uint8_t *pkt, size_t len, uint64_t off, uint16_t size, uint32_t *v)
+{
+  size_t width = size == BPF_W ? 4 : size == BPF_H ? 2 : 1;
+  if (off > len || len - off < width)
+    return 0;
+  pkt += off;
+  *v = width == 4 ? vmnet_get_be32(pkt) : width == 2 ? vmnet_get_be16(pkt) : pkt[0];
+  return 1;
+}
+
+uint32_t
+vmnet_bpf_run(const struct vmnet_bpf_insn *prog, const uint8_t *pkt, size_t len)
+{
+  uint32_t A = 0, X = 0, v;
+  uint32_t mem[VMNET_BPF_MEMWORDS];
+  memset(mem, 0, sizeof(mem));
+
+  for (const struct vmnet_bpf_insn *p = prog; ; p++) {
+    uint32_t k = p->k;
+    switch (BPF_CLASS(p->code)) {
+    case BPF_LD:
+      switch (BPF_MODE(p->code)) {
+      case BPF_IMM: A = k; break;
+      case BPF_LEN: A = (uint32_t)len; break;
+      case BPF_MEM: A = mem[k]; break;
+      case BPF_ABS:
+        if (!load(pkt, len, k, BPF_SIZE(p->code), &A))
+          return 0;
+        break;
+      case BPF_IND:
+        if (!load(pkt, len, (uint64_t)X + k, BPF_SIZE(p->code), &A))
+          return 0;
+        break;
+      }
+      break;
+    case BPF_LDX:
+      switch (BPF_MODE(p->code)) {
+      case BPF_IMM: X = k; break;
+      case BPF_LEN: X = (uint32_t)len; break;
+      case BPF_MEM: X = mem[k]; break;
+      case BPF_MSH:
+        /* IPv4 header length: 4 * (P[k] & 0xf) */
+        if (!load(pkt, len, k, BPF_B, &v))
+          return 0;
+        X = (v & 0x0f) << 2;
+        break;
+      }
+      break;
+    case BPF_ST:
+      mem[k] = A;
+      break;
+    case BPF_STX:
+      mem[k] = X;
+      break;
+    case BPF_ALU:
+      v = BPF_SRC(p->code) == BPF_X ? X : k;
+      switch (BPF_OP(p->code)) {
+      case BPF_ADD: A += v; break;
+      case BPF_SUB: A -= v; break;
+      case BPF_MUL: A *= v; break;
+      case BPF_DIV:
+        if (v == 0)
+          return 0;
+        A /= v;
+        break;
+      case BPF_MOD:
+        if (v == 0)
+          return 0;
+        A %= v;
+        break;
+      case BPF_OR:  A |= v; break;
+      case BPF_AND: A &= v; break;
+      case BPF_LSH: A = v < 32 ? A << v : 0; break;
+      case BPF_RSH: A = v < 32 ? A >> v : 0; break;
+      case BPF_NEG: A = -A; break;
+      case BPF_XOR: A ^= v; break;
+      }
+      break;
+    case BPF_JMP:
+      v = BPF_SRC(p->code) == BPF_X ? X : k;
+      switch (BPF_OP(p->code)) {
+      case BPF_JA:   p += k; break;
+      case BPF_JEQ:  p += A == v ? p->jt : p->jf; break;
+      case BPF_JGT:  p += A > v ? p->jt : p->jf; break;
+      case BPF_JGE:  p += A >= v ? p->jt : p->jf; break;
+      case BPF_JSET: p += (A & v) ? p->jt : p->jf; break;
+      }
+      break;
+    case BPF_RET:
+      switch (BPF_RVAL(p->code)) {
+      case BPF_K: return k;
+      case BPF_X: return X;
+      default:    return A;
+      }
+    case BPF_MISC:
+      if (BPF_MISCOP(p->code) == BPF_TAX)
+        X = A;
+      else
+        A = X;
+      break;
+    }
+  }
+}
@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (C) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <arpa/inet.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <caml/mlvalues.h>
+#include <caml/bigarray.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "vmnet_packet.h"
+
+/* The vector loops add 16-bit words into 32-bit lanes, each lane growing by
+   at most 2 * 0xffff per iteration, so they are flushed into the 64-bit
+   accumulator at least every 16384 iterations. */
+#define VMNET_CSUM_MAX_BLOCKS 16384
+
+static uint64_t
+csum_scalar(const uint8_t *buf, size_t len, uint64_t acc)
+{
+  uint32_t w32;
+  uint16_t w16;
+  while (len >= 4) {
+    memcpy(&w32, buf, 4);
+    acc += w32;
+    buf += 4;
+    len -= 4;
+  }
+  if (len >= 2) {
+    memcpy(&w16, buf, 2);
+    acc += w16;
+    buf += 2;
+    len -= 2;
+  }
+  if (len) {
+    /* The trailing byte is padded with a zero in memory order */
+    w16 = 0;
+    memcpy(&w16, buf, 1);
+    acc += w16;
+  }
+  return acc;
+}
+
+#if defined(__SSE2__)
+static uint64_t
+csum_sse2(const uint8_t *buf, size_t len, uint64_t acc)
+{
+  const __m128i zero = _mm_setzero_si128();
+  while (len >= 16) {
+    size_t blocks = len / 16;
+    if (blocks > VMNET_CSUM_MAX_BLOCKS)
+      blocks = VMNET_CSUM_MAX_BLOCKS;
+    __m128i acc32 = zero;
+    for (size_t i = 0; i < blocks; i++) {
+      __m128i v = _mm_loadu_si128((const __m128i *)buf);
+      acc32 = _mm_add_epi32(acc32, _mm_add_epi32(_mm_unpacklo_epi16(v, zero),
+                                                 _mm_unpackhi_epi16(v, zero)));
+      buf += 16;
+    }
+    len -= blocks * 16;
+    __m128i s64 = _mm_add_epi64(_mm_unpacklo_epi32(acc32, zero),
+                                _mm_unpackhi_epi32(acc32, zero));
+    uint64_t parts[2];
+    _mm_storeu_si128((__m128i *)parts, s64);
+    acc += parts[0] + parts[1];
+  }
+  return csum_scalar(buf, len, acc);
+}
+#endif
+
+#if defined(__x86_64__) && (defined(__clang__) || defined(__GNUC__))
+#define VMNET_CSUM_AVX2 1
+__attribute__((target("avx2")))
+static uint64_t
+csum_avx2(const uint8_t *buf, size_t len, uint64_t acc)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  while (len >= 32) {
+    size_t blocks = len / 32;
+    if (blocks > VMNET_CSUM_MAX_BLOCKS)
+      blocks = VMNET_CSUM_MAX_BLOCKS;
+    __m256i acc32 = zero;
+    for (size_t i = 0; i < blocks; i++) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)buf);
+      acc32 = _mm256_add_epi32(acc32,
+                               _mm256_add_epi32(_mm256_unpacklo_epi16(v, zero),
+                                                _mm256_unpackhi_epi16(v, zero)));
+      buf += 32;
+    }
+    len -= blocks * 32;
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc32);
+    for (int i = 0; i < 8; i++)
+      acc += lanes[i];
+  }
+  return csum_sse2(buf, len, acc);
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+static uint64_t
+csum_neon(const uint8_t *buf, size_t len, uint64_t acc)
+{
+  while (len >= 16) {
+    size_t blocks = len / 16;
+    if (blocks > VMNET_CSUM_MAX_BLOCKS)
+      blocks = VMNET_CSUM_MAX_BLOCKS;
+    uint32x4_t acc32 = vdupq_n_u32(0);
+    for (size_t i = 0; i < blocks; i++) {
+      acc32 = vpadalq_u16(acc32, vreinterpretq_u16_u8(vld1q_u8(buf)));
+      buf += 16;
+    }
+    len -= blocks * 16;
+    acc += vaddlvq_u32(acc32);
+  }
+  return csum_scalar(buf, len, acc);
+}
+#endif
+
+typedef uint64_t (*csum_fn)(const uint8_t *, size_t, uint64_t);
+
+static csum_fn
+csum_select(void)
+{
+#if defined(VMNET_CSUM_AVX2)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return csum_avx2;
+#endif
+#if defined(__SSE2__)
+  return csum_sse2;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  return csum_neon;
+#else
+  return csum_scalar;
+#endif
+}
+
+/* Small buffers such as IP headers are not worth the vector setup */
+#define VMNET_CSUM_VECTOR_MIN 64
+
+uint32_t
+vmnet_csum_partial(const uint8_t *buf, size_t len, uint32_t sum)
+{
+  static csum_fn csum_vector = NULL;
+  uint64_t acc;
+  if (len < VMNET_CSUM_VECTOR_MIN) {
+    acc = csum_scalar(buf, len, sum);
+  } else {
+    /* Racing initialisations all store the same pointer */
+    if (csum_vector == NULL)
+      csum_vector = csum_select();
+    acc = csum_vector(buf, len, sum);
+  }
+  while (acc >> 32)
+    acc = (acc & 0xffffffff) + (acc >> 32);
+  return (uint32_t)acc;
+}
+
+uint32_t
+vmnet_csum_pseudo(const uint8_t *frame, const struct vmnet_pkt *p, size_t l4_len)
+{
+  const uint8_t *ip = frame + p->l3_off;
+  uint32_t sum;
+  if (p->ip_version == 4)
+    sum = vmnet_csum_fold(vmnet_csum_partial(ip + 12, 8, 0));
+  else
+    sum = vmnet_csum_fold(vmnet_csum_partial(ip + 8, 32, 0));
+  sum += htons(p->l4_proto);
+  sum += htons((uint16_t)(l4_len >> 16));
+  sum += htons((uint16_t)(l4_len & 0xffff));
+  return sum;
+}
+
+/* Offset of the checksum field in the transport header, or 0 if the
+   protocol carries no checksum we know about. */
+static size_t
+l4_csum_offset(const struct vmnet_pkt *p)
+{
+  if (p->fragment)
+    return 0;
+  switch (p->l4_proto) {
+  case VMNET_PROTO_TCP:
+    return p->l4_len >= 20 ? 16 : 0;
+  case VMNET_PROTO_UDP:
+    return p->l4_len >= 8 ? 6 : 0;
+  default:
+    return 0;
+  }
+}
+
+int
+vmnet_csum_fill(uint8_t *frame, size_t len)
+{
+  struct vmnet_pkt p;
+  uint16_t csum;
+  int n = 0;
+  if (!vmnet_pkt_parse(frame, len, &p) || p.ip_version == 0)
+    return 0;
+  if (p.ip_version == 4) {
+    uint8_t *ip = frame + p.l3_off;
+    size_t ihl = p.l4_off - p.l3_off;
+    memset(ip + 10, 0, 2);
+    csum = ~vmnet_csum_fold(vmnet_csum_partial(ip, ihl, 0));
+    memcpy(ip + 10, &csum, 2);
+    n++;
+  }
+  size_t off = l4_csum_offset(&p);
+  if (off == 0)
+    return n;
+  uint8_t *l4 = frame + p.l4_off;
+  memset(l4 + off, 0, 2);
+  uint32_t sum = vmnet_csum_pseudo(frame, &p, p.l4_len);
+  csum = ~vmnet_csum_fold(vmnet_csum_partial(l4, p.l4_len, sum));
+  if (csum == 0 && p.l4_proto == VMNET_PROTO_UDP)
+    csum = 0xffff;
+  memcpy(l4 + off, &csum, 2);
+  return n + 1;
+}
+
+int
+vmnet_csum_verify(const uint8_t *frame, size_t len)
+{
+  struct vmnet_pkt p;
+  if (!vmnet_pkt_parse(frame, len, &p))
+    return 0;
+  if (p.ip_version == 0)
+    return 1;
+  if (p.ip_version == 4) {
+    const uint8_t *ip = frame + p.l3_off;
+    if (vmnet_csum_fold(vmnet_csum_partial(ip, p.l4_off - p.l3_off, 0)) != 0xffff)
+      return 0;
+  }
+  size_t off = l4_csum_offset(&p);
+  if (off == 0)
+    return 1;
+  const uint8_t *l4 = frame + p.l4_off;
+  /* A zero UDP checksum over IPv4 means none was computed */
+  if (p.l4_proto == VMNET_PROTO_UDP && p.ip_version == 4 &&
+      l4[off] == 0 && l4[off + 1] == 0)
+    return 1;
+  uint32_t sum = vmnet_csum_pseudo(frame, &p, p.l4_len);
+  return vmnet_csum_fold(vmnet_csum_partial(l4, p.l4_len, sum)) == 0xffff;
+}
+
+/* The stubs below do not allocate and are declared [@@noalloc]. */
+
+CAMLprim value
+caml_vmnet_checksum_partial(value v_ba, value v_off, value v_len)
+{
+  const uint8_t *buf = (uint8_t *)Caml_ba_data_val(v_ba) + Long_val(v_off);
+  uint16_t sum = vmnet_csum_fold(vmnet_csum_partial(buf, Long_val(v_len), 0));
+  return Val_int(ntohs(sum));
+}
+
+CAMLprim value
+caml_vmnet_checksum_fill(value v_ba, value v_off, value v_len)
+{
+  uint8_t *buf = (uint8_t *)Caml_ba_data_val(v_ba) + Long_val(v_off);
+  return Val_int(vmnet_csum_fill(buf, Long_val(v_len)));
+}
+
+CAMLprim value
+caml_vmnet_checksum_verify(value v_ba, value v_off, value v_len)
+{
+  const uint8_t *buf = (uint8_t *)Caml_ba_data_val(v_ba) + Long_val(v_off);
+  return Val_bool(vmnet_csum_verify(buf, Long_val(v_len)));
+}
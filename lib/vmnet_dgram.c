@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (C) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A switch port exchanging one frame per datagram on a Unix datagram
+   socket, as QEMU's -netdev dgram does.  Frames are received into a pool
+   of preallocated buffers, a batch per recvmmsg, and switched from there;
+   frames switched to the port go out with one sendmmsg per batch.  Where
+   those calls do not exist, they are emulated one datagram at a time.
+   Datagrams the peer cannot take are dropped, as a link would.  None of
+   this depends on vmnet.framework. */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/custom.h>
+#include <caml/fail.h>
+
+#include "vmnet_switch.h"
+
+#define DGRAM_FRAME_MAX 65535
+#define DGRAM_SOCKBUF   (4 << 20)
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#if !defined(__linux__)
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+#endif
+
+struct vmnet_dgram {
+  struct vmnet_switch *sw;
+  struct vmnet_sw_port *port;
+  int port_no;
+  int stopping;        /* the port was removed */
+  int fd;
+  int wake[2];         /* written to stop the thread */
+  struct sockaddr_un remote;
+  socklen_t remote_len;
+  uint8_t *pool;       /* VMNET_SWITCH_BATCH buffers of DGRAM_FRAME_MAX */
+  struct iovec rx_iov[VMNET_SWITCH_BATCH];
+  struct mmsghdr rx_msg[VMNET_SWITCH_BATCH];
+};
+
+static int
+dgram_recv_batch(int fd, struct mmsghdr *msgs, unsigned n)
+{
+#if defined(__linux__)
+  return recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+#else
+  unsigned i;
+  for (i = 0; i < n; i++) {
+    ssize_t r = recvmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT);
+    if (r < 0)
+      return i > 0 ? (int)i : -1;
+    msgs[i].msg_len = r;
+  }
+  return i;
+#endif
+}
+
+static int
+dgram_send_batch(int fd, struct mmsghdr *msgs, unsigned n)
+{
+#if defined(__linux__)
+  return sendmmsg(fd, msgs, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+#else
+  unsigned i;
+  for (i = 0; i < n; i++) {
+    ssize_t r = sendmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (r < 0)
+      return i > 0 ? (int)i : -1;
+    msgs[i].msg_len = r;
+  }
+  return i;
+#endif
+}
+
+/* Switch output, called with the switch locked: send the frames to the
+   peer.  Those it refuses, because it is not there or is backed up, are
+   dropped. */
+static void
+dgram_output(void *ctx, const struct vmnet_sw_frame *frames, int n)
+{
+  struct vmnet_dgram *dg = ctx;
+  struct iovec iov[VMNET_SWITCH_BATCH];
+  struct mmsghdr msgs[VMNET_SWITCH_BATCH];
+  memset(msgs, 0, n * sizeof(struct mmsghdr));
+  for (int i = 0; i < n; i++) {
+    iov[i].iov_base = (void *)frames[i].data;
+    iov[i].iov_len = frames[i].len;
+    msgs[i].msg_hdr.msg_name = &dg->remote;
+    msgs[i].msg_hdr.msg_namelen = dg->remote_len;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  int sent = 0;
+  while (sent < n) {
+    int r = dgram_send_batch(dg->fd, msgs + sent, n - sent);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+    sent += r;
+  }
+  dg->port->dropped += n - sent;
+}
+
+/* The thread receiving datagrams.  It runs unlocked and takes the switch
+   lock for each batch; it frees everything once the port has been
+   removed. */
+static void *
+dgram_thread(void *arg)
+{
+  struct vmnet_dgram *dg = arg;
+  struct vmnet_switch *sw = dg->sw;
+  struct vmnet_sw_frame frames[VMNET_SWITCH_BATCH];
+  for (;;) {
+    struct pollfd pfd[2];
+    pfd[0].fd = dg->wake[0];
+    pfd[0].events = POLLIN;
+    pfd[1].fd = dg->fd;
+    pfd[1].events = POLLIN;
+    if (poll(pfd, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (pfd[0].revents)
+      break;
+    int n;
+    do {
+      for (int i = 0; i < VMNET_SWITCH_BATCH; i++)
+        dg->rx_msg[i].msg_hdr.msg_flags = 0;
+      n = dgram_recv_batch(dg->fd, dg->rx_msg, VMNET_SWITCH_BATCH);
+      if (n <= 0)
+        break;
+      int k = 0;
+      for (int i = 0; i < n; i++) {
+        if (dg->rx_msg[i].msg_hdr.msg_flags & MSG_TRUNC)
+          continue;
+        frames[k].data = dg->rx_iov[i].iov_base;
+        frames[k++].len = dg->rx_msg[i].msg_len;
+      }
+      pthread_mutex_lock(&sw->lock);
+      if (!dg->stopping && k > 0)
+        vmnet_switch_input(sw, dg->port_no, frames, k, vmnet_switch_now());
+      pthread_mutex_unlock(&sw->lock);
+    } while (n == VMNET_SWITCH_BATCH);
+  }
+  vmnet_switch_unlink(dg->fd);
+  close(dg->fd);
+  close(dg->wake[0]);
+  close(dg->wake[1]);
+  free(dg->pool);
+  free(dg);
+  vmnet_switch_release(sw);
+  return NULL;
+}
+
+/* Called with the switch locked when the port is removed: the thread
+   notices and cleans up */
+static void
+dgram_detach(void *ctx)
+{
+  struct vmnet_dgram *dg = ctx;
+  char c = 0;
+  dg->stopping = 1;
+  while (write(dg->wake[1], &c, 1) < 0 && errno == EINTR);
+}
+
+/* Exchange frames on the bound datagram socket [v_fd], which is taken
+   over, with the peer at [v_remote], as a new port of [v_sw].  Returns the
+   port number, or -1 if the switch is full. */
+CAMLprim value
+caml_vmnet_switch_add_dgram(value v_sw, value v_fd, value v_remote)
+{
+  CAMLparam3(v_sw, v_fd, v_remote);
+  struct vmnet_switch *sw = Vmnet_switch_val(v_sw);
+  struct vmnet_dgram *dg;
+  if (caml_string_length(v_remote) >= sizeof(dg->remote.sun_path))
+    caml_invalid_argument("Vmnet.Switch.add_dgram_port");
+  dg = calloc(1, sizeof(struct vmnet_dgram));
+  uint8_t *pool = malloc((size_t)VMNET_SWITCH_BATCH * DGRAM_FRAME_MAX);
+  if (!dg || !pool) {
+    free(dg);
+    free(pool);
+    caml_raise_out_of_memory();
+  }
+  if (pipe(dg->wake) < 0) {
+    free(dg);
+    free(pool);
+    caml_failwith("pipe failed unexpectedly");
+  }
+  dg->sw = sw;
+  dg->fd = Int_val(v_fd);
+  dg->remote.sun_family = AF_UNIX;
+  memcpy(dg->remote.sun_path, String_val(v_remote), caml_string_length(v_remote));
+  dg->remote_len = sizeof(dg->remote);
+  dg->pool = pool;
+  for (int i = 0; i < VMNET_SWITCH_BATCH; i++) {
+    dg->rx_iov[i].iov_base = pool + (size_t)i * DGRAM_FRAME_MAX;
+    dg->rx_iov[i].iov_len = DGRAM_FRAME_MAX;
+    dg->rx_msg[i].msg_hdr.msg_iov = &dg->rx_iov[i];
+    dg->rx_msg[i].msg_hdr.msg_iovlen = 1;
+  }
+  int size = DGRAM_SOCKBUF;
+  setsockopt(dg->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  setsockopt(dg->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  pthread_mutex_lock(&sw->lock);
+  int port = vmnet_switch_add_port(sw, dgram_output, dg);
+  if (port >= 0) {
+    dg->port = &sw->ports[port];
+    dg->port_no = port;
+    dg->port->detach = dgram_detach;
+  }
+  pthread_mutex_unlock(&sw->lock);
+  pthread_t thread;
+  if (port >= 0) {
+    vmnet_switch_retain(sw);
+    if (pthread_create(&thread, NULL, dgram_thread, dg) == 0) {
+      pthread_detach(thread);
+      CAMLreturn(Val_int(port));
+    }
+    vmnet_switch_release(sw);
+    pthread_mutex_lock(&sw->lock);
+    dg->port->detach = NULL;
+    vmnet_switch_remove_port(sw, port);
+    pthread_mutex_unlock(&sw->lock);
+  }
+  close(dg->wake[0]);
+  close(dg->wake[1]);
+  free(pool);
+  free(dg);
+  if (port >= 0)
+    caml_failwith("Vmnet.Switch.add_dgram_port: cannot start thread");
+  CAMLreturn(Val_int(-1));
+}
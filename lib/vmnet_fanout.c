@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (C) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/fail.h>
+#include <caml/custom.h>
+#include <caml/bigarray.h>
+
+#include "vmnet_fanout.h"
+
+unsigned
+vmnet_fanout_stride(unsigned slot_size)
+{
+  size_t n = sizeof(struct vmnet_fanout_slot) + slot_size;
+  return (n + VMNET_FANOUT_ALIGN - 1) & ~(size_t)(VMNET_FANOUT_ALIGN - 1);
+}
+
+size_t
+vmnet_fanout_size(unsigned slots, unsigned slot_size)
+{
+  return VMNET_FANOUT_HDR + (size_t)slots * vmnet_fanout_stride(slot_size);
+}
+
+static struct vmnet_fanout_slot *
+slot_at(void *mem, const struct vmnet_fanout_hdr *h, uint64_t n)
+{
+  return (struct vmnet_fanout_slot *)
+    ((uint8_t *)mem + VMNET_FANOUT_HDR + (n & (h->slots - 1)) * h->stride);
+}
+
+void
+vmnet_fanout_init(void *mem, unsigned slots, unsigned slot_size, int tx)
+{
+  struct vmnet_fanout_hdr *h = mem;
+  memset(mem, 0, vmnet_fanout_size(slots, slot_size));
+  h->slots = slots;
+  h->slot_size = slot_size;
+  h->stride = vmnet_fanout_stride(slot_size);
+  h->flags = tx ? VMNET_FANOUT_F_TX : 0;
+  /* Consumers check the magic last */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(h->magic, VMNET_FANOUT_MAGIC, sizeof(h->magic));
+}
+
+void
+vmnet_fanout_publish(void *mem, const uint8_t *frame, size_t len, int dir,
+                     uint64_t ts)
+{
+  struct vmnet_fanout_hdr *h = mem;
+  uint64_t n = h->head;
+  struct vmnet_fanout_slot *s = slot_at(mem, h, n);
+  size_t caplen = len < h->slot_size ? len : h->slot_size;
+  __atomic_store_n(&s->seq, 2 * n + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  s->ts = ts;
+  s->len = len;
+  s->caplen = caplen;
+  s->dir = dir;
+  memcpy(s + 1, frame, caplen);
+  __atomic_store_n(&s->seq, 2 * n + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&h->head, n + 1, __ATOMIC_RELEASE);
+}
+
+/* Consumers.  The ring is mapped read-only and handed to OCaml as a
+   mapped-file bigarray.  Sub-arrays of it, such as Cstruct.to_bigarray
+   makes, share a reference-counted proxy with it, and whichever of them
+   goes last unmaps the ring. */
+
+static void
+fanout_finalize(value v)
+{
+  struct caml_ba_array *b = Caml_ba_array_val(v);
+  if (b->proxy == NULL) {
+    munmap(b->data, b->dim[0]);
+  } else if (--b->proxy->refcount == 0) {
+    munmap(b->proxy->data, b->proxy->size);
+    free(b->proxy);
+  }
+}
+
+static struct custom_operations fanout_ops = {
+  "org.openmirage.vmnet.fanout",
+  fanout_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static int
+fanout_valid(const uint8_t *mem, size_t size)
+{
+  const struct vmnet_fanout_hdr *h = (const struct vmnet_fanout_hdr *)mem;
+  if (size < VMNET_FANOUT_HDR ||
+      memcmp(h->magic, VMNET_FANOUT_MAGIC, sizeof(h->magic)) != 0)
+    return 0;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return h->slots > 0 && (h->slots & (h->slots - 1)) == 0 &&
+         h->stride == vmnet_fanout_stride(h->slot_size) &&
+         vmnet_fanout_size(h->slots, h->slot_size) <= size;
+}
+
+CAMLprim value
+caml_vmnet_fanout_map(value v_fd, value v_size)
+{
+  CAMLparam2(v_fd, v_size);
+  size_t size = Long_val(v_size);
+  void *mem = size > 0 ? mmap(NULL, size, PROT_READ, MAP_SHARED, Int_val(v_fd), 0)
+                       : MAP_FAILED;
+  if (mem == MAP_FAILED)
+    caml_failwith("Vmnet.Fanout.attach: cannot map the file");
+  if (!fanout_valid(mem, size)) {
+    munmap(mem, size);
+    caml_failwith("Vmnet.Fanout.attach: not a fan-out file");
+  }
+  CAMLlocal1(v_ba);
+  v_ba = caml_ba_alloc_dims(CAML_BA_CHAR | CAML_BA_C_LAYOUT |
+                            CAML_BA_MAPPED_FILE, 1, mem, size);
+  Custom_ops_val(v_ba) = &fanout_ops;
+  CAMLreturn(v_ba);
+}
+
+CAMLprim value
+caml_vmnet_fanout_head(value v_ba)
+{
+  const struct vmnet_fanout_hdr *h = Caml_ba_data_val(v_ba);
+  return Val_long(__atomic_load_n(&h->head, __ATOMIC_ACQUIRE));
+}
+
+/* Look at the frame under the cursor v_info.(0) and advance it.  Returns
+   -1 with the frame described in v_info: its number, the offset of its
+   bytes, len, caplen, direction and timestamp; 0 if there is none yet; or
+   the number of frames lost to overruns, which the cursor skips. */
+CAMLprim value
+caml_vmnet_fanout_next(value v_ba, value v_info)
+{
+  void *mem = Caml_ba_data_val(v_ba);
+  const struct vmnet_fanout_hdr *h = mem;
+  uint64_t c = Long_val(Field(v_info, 0));
+  uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+  if (c >= head) {
+    /* The ring was recreated under us: start again from its head */
+    if (c > head)
+      Field(v_info, 0) = Val_long(head);
+    return Val_int(0);
+  }
+  if (head - c > h->slots) {
+    Field(v_info, 0) = Val_long(head - h->slots);
+    return Val_long(head - h->slots - c);
+  }
+  const struct vmnet_fanout_slot *s = slot_at(mem, h, c);
+  uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+  uint64_t ts = s->ts;
+  uint32_t len = s->len;
+  uint32_t caplen = s->caplen;
+  uint32_t dir = s->dir;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  Field(v_info, 0) = Val_long(c + 1);
+  if (seq != 2 * c + 2 || __atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq ||
+      caplen > h->slot_size)
+    return Val_int(1);
+  Field(v_info, 1) = Val_long(c);
+  Field(v_info, 2) = Val_long((const uint8_t *)(s + 1) - (const uint8_t *)mem);
+  Field(v_info, 3) = Val_long(len);
+  Field(v_info, 4) = Val_long(caplen);
+  Field(v_info, 5) = Val_int(dir);
+  Field(v_info, 6) = Val_long(ts);
+  return Val_int(-1);
+}
+
+/* Whether frame [v_n] is still in its slot */
+CAMLprim value
+caml_vmnet_fanout_intact(value v_ba, value v_n)
+{
+  void *mem = Caml_ba_data_val(v_ba);
+  const struct vmnet_fanout_hdr *h = mem;
+  uint64_t n = Long_val(v_n);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return Val_bool(__atomic_load_n(&slot_at(mem, h, n)->seq, __ATOMIC_RELAXED) ==
+                  2 * n + 2);
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (C) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Fan-out of an interface's traffic through a memory-mapped file.  The
+   process owning the interface copies each frame into the next slot of a
+   ring in the file, overwriting the oldest, and never waits for anyone.
+   Any number of consumers map the file read-only and follow the ring with
+   cursors of their own.  Each slot carries a sequence number, odd while
+   the slot is being written, so that a consumer can tell that a frame was
+   overwritten before or while it looked at it; a consumer that falls
+   more than a ring behind learns how many frames it lost. */
+
+#ifndef VMNET_FANOUT_H
+#define VMNET_FANOUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define VMNET_FANOUT_MAGIC   "VMNETFO1"
+#define VMNET_FANOUT_HDR     4096   /* the ring starts one page in */
+#define VMNET_FANOUT_ALIGN   64
+
+#define VMNET_FANOUT_RX      0
+#define VMNET_FANOUT_TX      1
+
+/* The start of the file.  Integers are in host byte order. */
+struct vmnet_fanout_hdr {
+  char magic[8];
+  uint32_t slots;        /* a power of two */
+  uint32_t slot_size;    /* bytes of frame kept per slot */
+  uint32_t stride;       /* bytes from one slot to the next */
+  uint32_t flags;        /* VMNET_FANOUT_F_TX: transmitted frames too */
+  uint64_t head;         /* frames published so far */
+};
+
+#define VMNET_FANOUT_F_TX    1
+
+/* Each slot: this, then [slot_size] bytes.  Frame [n] is in slot
+   [n % slots]; [seq] is 2n + 1 while it is written and 2n + 2 after. */
+struct vmnet_fanout_slot {
+  uint64_t seq;
+  uint64_t ts;           /* monotonic, in nanoseconds */
+  uint32_t len;          /* of the frame */
+  uint32_t caplen;       /* bytes kept: at most slot_size */
+  uint32_t dir;          /* VMNET_FANOUT_RX or VMNET_FANOUT_TX */
+  uint32_t pad;
+};
+
+/* Bytes of a file with [slots] slots of [slot_size], and the stride */
+size_t vmnet_fanout_size(unsigned slots, unsigned slot_size);
+unsigned vmnet_fanout_stride(unsigned slot_size);
+
+/* Lay out an empty ring in the [size] bytes at [mem] */
+void vmnet_fanout_init(void *mem, unsigned slots, unsigned slot_size,
+                       int tx);
+
+/* Publish a frame in the ring at [mem].  Only one thread may publish at a
+   time. */
+void vmnet_fanout_publish(void *mem, const uint8_t *frame, size_t len,
+                          int dir, uint64_t ts);
+
+#endif /* VMNET_FANOUT_H */
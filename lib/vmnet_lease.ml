@@ -0,0 +1,305 @@
+(*
+ * Copyright (c) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+open Sexplib.Conv
+
+type lease = {
+  address: Ipaddr_sexp.V4.t;
+  netmask: Ipaddr_sexp.V4.t;
+  router: Ipaddr_sexp.V4.t option;
+  server: Ipaddr_sexp.V4.t;
+  expires: float;
+} [@@deriving sexp]
+
+(* The file is a 16-byte header followed by 64-byte slots:
+     0  UUID, all zeros if the slot is free
+    16  address
+    20  netmask
+    24  router, 0.0.0.0 if none
+    28  server
+    32  expiry, in seconds since the epoch (int64)
+   The rest of a slot is reserved. *)
+let magic = "VMNETLC1"
+let header_size = 16
+let slot_size = 64
+let initial_slots = 16
+
+type t = {
+  fd: Unix.file_descr;
+  mutable map: Cstruct.t;
+}
+
+let map fd size =
+  let ba = Unix.map_file fd Bigarray.char Bigarray.c_layout true [| size |] in
+  Cstruct.of_bigarray (Bigarray.array1_of_genarray ba)
+
+let slots t = (Cstruct.len t.map - header_size) / slot_size
+
+let slot t i = Cstruct.sub t.map (header_size + i * slot_size) slot_size
+
+let openfile path =
+  let fd = Unix.openfile path Unix.[O_RDWR; O_CREAT; O_CLOEXEC] 0o600 in
+  let size = (Unix.fstat fd).Unix.st_size in
+  if size = 0 then begin
+    let map = map fd (header_size + initial_slots * slot_size) in
+    Cstruct.blit_from_string magic 0 map 0 (String.length magic);
+    { fd; map }
+  end else if size < header_size || (size - header_size) mod slot_size <> 0 then begin
+    Unix.close fd;
+    failwith ("Vmnet_lease.openfile: " ^ path ^ " is not a lease cache")
+  end else begin
+    let map = map fd size in
+    if Cstruct.to_string (Cstruct.sub map 0 (String.length magic)) <> magic then begin
+      Unix.close fd;
+      failwith ("Vmnet_lease.openfile: " ^ path ^ " is not a lease cache")
+    end;
+    { fd; map }
+  end
+
+(* The mapping itself goes away when it is collected *)
+let close t =
+  t.map <- Cstruct.create 0;
+  Unix.close t.fd
+
+let get_ip s off = Ipaddr.V4.of_int32 (Cstruct.BE.get_uint32 s off)
+let set_ip s off ip = Cstruct.BE.set_uint32 s off (Ipaddr.V4.to_int32 ip)
+
+let key uuid = Uuidm.to_bytes uuid
+
+let lookup t k =
+  let rec loop i =
+    if i >= slots t then None
+    else if Cstruct.to_string (Cstruct.sub (slot t i) 0 16) = k then Some i
+    else loop (i + 1) in
+  loop 0
+
+let find ?(margin = 60.) t uuid =
+  match lookup t (key uuid) with
+  | None -> None
+  | Some i ->
+    let s = slot t i in
+    let router = get_ip s 24 in
+    let lease = {
+      address = get_ip s 16;
+      netmask = get_ip s 20;
+      router = if router = Ipaddr.V4.any then None else Some router;
+      server = get_ip s 28;
+      expires = Int64.to_float (Cstruct.BE.get_uint64 s 32);
+    } in
+    if lease.expires > Unix.gettimeofday () +. margin then Some lease else None
+
+let free = String.make 16 '\000'
+
+(* Double the file and map it again.  Returns the first new slot. *)
+let grow t =
+  let n = slots t in
+  let size = header_size + max initial_slots (2 * n) * slot_size in
+  Unix.ftruncate t.fd size;
+  t.map <- map t.fd size;
+  n
+
+let add t uuid lease =
+  if Uuidm.equal uuid Uuidm.nil then
+    invalid_arg "Vmnet_lease.add: nil UUID";
+  let k = key uuid in
+  let i = match lookup t k with
+    | Some i -> i
+    | None -> match lookup t free with Some i -> i | None -> grow t in
+  let s = slot t i in
+  set_ip s 16 lease.address;
+  set_ip s 20 lease.netmask;
+  set_ip s 24 (match lease.router with None -> Ipaddr.V4.any | Some r -> r);
+  set_ip s 28 lease.server;
+  Cstruct.BE.set_uint64 s 32 (Int64.of_float lease.expires);
+  Cstruct.blit_from_string k 0 s 0 16
+
+let remove t uuid =
+  match lookup t (key uuid) with
+  | None -> ()
+  | Some i -> Cstruct.memset (slot t i) 0
+
+(* DHCP over Ethernet/IPv4/UDP without IP options.  Offsets of the BOOTP
+   fields are relative to the start of the DHCP message. *)
+let eth_len = 14
+let ip_len = 20
+let udp_len = 8
+let dhcp_off = eth_len + ip_len + udp_len
+let cookie = 0x63825363l
+let options_off = 240
+let min_dhcp_len = 300
+
+let dhcp_request = 3
+let dhcp_ack = 5
+let dhcp_nak = 6
+
+let request ~xid ~mac lease =
+  let mac_s = Macaddr.to_octets mac in
+  let options = [
+    53, String.make 1 (Char.chr dhcp_request);
+    50, Ipaddr.V4.to_octets lease.address;
+    61, "\001" ^ mac_s;
+    55, "\001\003\006\051";    (* mask, router, DNS, lease time *)
+  ] in
+  let opts_len =
+    List.fold_left (fun n (_, v) -> n + 2 + String.length v) 1 options in
+  let dhcp_len = max min_dhcp_len (options_off + opts_len) in
+  let frame = Cstruct.create (dhcp_off + dhcp_len) in
+  (* Ethernet *)
+  Cstruct.blit_from_string (Macaddr.to_octets Macaddr.broadcast) 0 frame 0 6;
+  Cstruct.blit_from_string mac_s 0 frame 6 6;
+  Cstruct.BE.set_uint16 frame 12 0x0800;
+  (* IPv4, from 0.0.0.0 to the broadcast address *)
+  let ip = Cstruct.shift frame eth_len in
+  Cstruct.set_uint8 ip 0 0x45;
+  Cstruct.BE.set_uint16 ip 2 (ip_len + udp_len + dhcp_len);
+  Cstruct.set_uint8 ip 8 64;
+  Cstruct.set_uint8 ip 9 17;
+  set_ip ip 16 Ipaddr.V4.broadcast;
+  (* UDP *)
+  let udp = Cstruct.shift ip ip_len in
+  Cstruct.BE.set_uint16 udp 0 68;
+  Cstruct.BE.set_uint16 udp 2 67;
+  Cstruct.BE.set_uint16 udp 4 (udp_len + dhcp_len);
+  (* BOOTP *)
+  let dhcp = Cstruct.shift udp udp_len in
+  Cstruct.set_uint8 dhcp 0 1;
+  Cstruct.set_uint8 dhcp 1 1;
+  Cstruct.set_uint8 dhcp 2 6;
+  Cstruct.BE.set_uint32 dhcp 4 xid;
+  Cstruct.blit_from_string mac_s 0 dhcp 28 6;
+  Cstruct.BE.set_uint32 dhcp 236 cookie;
+  let off = List.fold_left (fun off (code, v) ->
+      Cstruct.set_uint8 dhcp off code;
+      Cstruct.set_uint8 dhcp (off + 1) (String.length v);
+      Cstruct.blit_from_string v 0 dhcp (off + 2) (String.length v);
+      off + 2 + String.length v) options_off options in
+  Cstruct.set_uint8 dhcp off 255;
+  ignore (Vmnet.Checksum.fill frame);
+  frame
+
+let garp ~mac address =
+  let frame = Cstruct.create (eth_len + 28) in
+  let mac_s = Macaddr.to_octets mac in
+  Cstruct.blit_from_string (Macaddr.to_octets Macaddr.broadcast) 0 frame 0 6;
+  Cstruct.blit_from_string mac_s 0 frame 6 6;
+  Cstruct.BE.set_uint16 frame 12 0x0806;
+  let arp = Cstruct.shift frame eth_len in
+  Cstruct.BE.set_uint16 arp 0 1;
+  Cstruct.BE.set_uint16 arp 2 0x0800;
+  Cstruct.set_uint8 arp 4 6;
+  Cstruct.set_uint8 arp 5 4;
+  Cstruct.BE.set_uint16 arp 6 1;
+  Cstruct.blit_from_string mac_s 0 arp 8 6;
+  set_ip arp 14 address;
+  set_ip arp 24 address;
+  frame
+
+(* The DHCP message of [frame] if it is a BOOTP reply *)
+let dhcp_reply frame =
+  let len = Cstruct.len frame in
+  if len < eth_len + ip_len || Cstruct.BE.get_uint16 frame 12 <> 0x0800 then None
+  else
+    let ip = Cstruct.shift frame eth_len in
+    let ihl = (Cstruct.get_uint8 ip 0 land 0x0f) * 4 in
+    if Cstruct.get_uint8 ip 9 <> 17 || ihl < ip_len
+       || len < eth_len + ihl + udp_len + options_off then None
+    else
+      let udp = Cstruct.shift ip ihl in
+      let dhcp = Cstruct.shift udp udp_len in
+      if Cstruct.BE.get_uint16 udp 2 <> 68 || Cstruct.get_uint8 dhcp 0 <> 2
+         || Cstruct.BE.get_uint32 dhcp 236 <> cookie then None
+      else Some dhcp
+
+(* The options of a DHCP message, first occurrence first *)
+let options dhcp =
+  let len = Cstruct.len dhcp in
+  let rec loop off acc =
+    if off >= len then List.rev acc
+    else match Cstruct.get_uint8 dhcp off with
+      | 255 -> List.rev acc
+      | 0 -> loop (off + 1) acc
+      | code ->
+        if off + 1 >= len then List.rev acc
+        else
+          let n = Cstruct.get_uint8 dhcp (off + 1) in
+          if off + 2 + n > len then List.rev acc
+          else loop (off + 2 + n) ((code, Cstruct.sub dhcp (off + 2) n) :: acc) in
+  loop options_off []
+
+let opt_ip opts code =
+  match List.assoc_opt code opts with
+  | Some v when Cstruct.len v >= 4 -> Some (get_ip v 0)
+  | _ -> None
+
+let message_type opts =
+  match List.assoc_opt 53 opts with
+  | Some v when Cstruct.len v = 1 -> Cstruct.get_uint8 v 0
+  | _ -> 0
+
+(* The lease granted by an ACK, defaulting to the fields of [prev] *)
+let lease_of_ack ?prev dhcp opts =
+  let or_prev f = match prev with Some p -> Some (f p) | None -> None in
+  let server = match opt_ip opts 54 with
+    | Some s -> Some s
+    | None -> or_prev (fun p -> p.server) in
+  let netmask = match opt_ip opts 1 with
+    | Some m -> Some m
+    | None -> or_prev (fun p -> p.netmask) in
+  let expires = match List.assoc_opt 51 opts with
+    | Some v when Cstruct.len v = 4 ->
+      Some (Unix.gettimeofday ()
+            +. Int64.to_float (Int64.logand (Int64.of_int32 (Cstruct.BE.get_uint32 v 0)) 0xffffffffL))
+    | _ -> or_prev (fun p -> p.expires) in
+  match server, netmask, expires with
+  | Some server, Some netmask, Some expires ->
+    let router = match opt_ip opts 3 with
+      | Some r -> Some r
+      | None -> (match prev with Some p -> p.router | None -> None) in
+    Some { address = get_ip dhcp 16; netmask; router; server; expires }
+  | _ -> None
+
+let of_ack frame =
+  match dhcp_reply frame with
+  | None -> None
+  | Some dhcp ->
+    let opts = options dhcp in
+    if message_type opts <> dhcp_ack then None else lease_of_ack dhcp opts
+
+let input ~xid ~mac lease frame =
+  match dhcp_reply frame with
+  | None -> `Noop
+  | Some dhcp ->
+    if Cstruct.BE.get_uint32 dhcp 4 <> xid
+    || Cstruct.to_string (Cstruct.sub dhcp 28 6) <> Macaddr.to_octets mac then `Noop
+    else
+      let opts = options dhcp in
+      match message_type opts with
+      | t when t = dhcp_nak -> `Nak
+      | t when t = dhcp_ack ->
+        (match lease_of_ack ~prev:lease dhcp opts with
+         | Some l -> `Ack l
+         | None -> `Noop)
+      | _ -> `Noop
+
+(* Seeded on first use, not taken from the global generator, which is the
+   same in every process unless the program calls [Random.self_init] *)
+let xid_state = lazy (Random.State.make_self_init ())
+
+let reboot t lease =
+  let xid = Random.State.int32 (Lazy.force xid_state) Int32.max_int in
+  let mac = Vmnet.mac t in
+  Vmnet.write t (request ~xid ~mac lease);
+  xid
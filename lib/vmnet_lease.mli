@@ -0,0 +1,79 @@
+(*
+ * Copyright (c) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** Persistent cache of DHCP leases, keyed by interface UUID.
+
+    An interface created with a given UUID always gets the same MAC address,
+    so the DHCP server will usually hand it the same lease again.  Caching
+    the lease across restarts lets a client skip the DISCOVER/OFFER round
+    trip: {!reboot} sends a single DHCPREQUEST for the cached address (the
+    INIT-REBOOT state of RFC 2131), and the client only falls back to a full
+    exchange if the server answers with a NAK or not at all.  The address
+    should only be announced, e.g. with {!garp}, once it has been ACKed. *)
+
+(** [lease] is an IPv4 lease.  [expires] is a Unix time. *)
+type lease = {
+  address: Ipaddr_sexp.V4.t;
+  netmask: Ipaddr_sexp.V4.t;
+  router: Ipaddr_sexp.V4.t option;
+  server: Ipaddr_sexp.V4.t;
+  expires: float;
+} [@@deriving sexp]
+
+(** [t] is a lease cache backed by a memory-mapped file. *)
+type t
+
+(** [openfile path] opens the cache stored in [path], creating it if it does
+    not exist.  Raises [Failure] if [path] is not a lease cache.  The cache
+    is not locked: it must not be written by two processes at once. *)
+val openfile : string -> t
+
+(** [close t] unmaps and closes the cache.  It must not be used afterwards. *)
+val close : t -> unit
+
+(** [find ?margin t uuid] is the lease cached for [uuid], provided it is
+    still valid [margin] seconds (default 60) from now. *)
+val find : ?margin:float -> t -> Uuidm.t -> lease option
+
+(** [add t uuid lease] caches [lease] for [uuid], replacing any previous
+    one.  The file grows as needed.  Raises [Invalid_argument] if [uuid] is
+    {!Uuidm.nil}. *)
+val add : t -> Uuidm.t -> lease -> unit
+
+(** [remove t uuid] forgets the lease of [uuid], e.g. after a NAK. *)
+val remove : t -> Uuidm.t -> unit
+
+(** [request ~xid ~mac lease] is a broadcast DHCPREQUEST frame from [mac]
+    asking for the address of [lease] again. *)
+val request : xid:int32 -> mac:Macaddr.t -> lease -> Cstruct.t
+
+(** [garp ~mac address] is a gratuitous ARP frame announcing that [address]
+    is at [mac]. *)
+val garp : mac:Macaddr.t -> Ipaddr.V4.t -> Cstruct.t
+
+(** [of_ack frame] is the lease granted by [frame] if it is a DHCPACK. *)
+val of_ack : Cstruct.t -> lease option
+
+(** [input ~xid ~mac lease frame] checks whether [frame] answers the
+    DHCPREQUEST [xid] sent by [mac] for [lease]: [`Ack l] with the renewed
+    lease, [`Nak] if the server refused it, [`Noop] for other frames. *)
+val input : xid:int32 -> mac:Macaddr.t -> lease -> Cstruct.t ->
+  [ `Ack of lease | `Nak | `Noop ]
+
+(** [reboot t lease] writes a DHCPREQUEST for [lease] on [t] and returns
+    the transaction id to pass to {!input}.  Raises {!Vmnet.Error} like
+    {!Vmnet.write} if the request could not be written. *)
+val reboot : Vmnet.t -> lease -> int32
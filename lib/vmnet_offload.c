@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (C) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "vmnet_packet.h"
+#include "vmnet_ring.h"
+
+int
+vmnet_gso_prepare(const uint8_t *frame, size_t len, size_t mss,
+                  struct vmnet_gso *g)
+{
+  memset(g, 0, sizeof(*g));
+  if (mss == 0 || !vmnet_pkt_parse(frame, len, &g->pkt))
+    return 0;
+  if (g->pkt.ip_version != 4 || g->pkt.l4_proto != VMNET_PROTO_TCP ||
+      g->pkt.fragment || g->pkt.l4_len < 20)
+    return 0;
+  size_t thl = (frame[g->pkt.l4_off + 12] >> 4) * 4;
+  if (thl < 20 || thl > g->pkt.l4_len)
+    return 0;
+  g->hdr_len = g->pkt.l4_off + thl;
+  g->payload_len = g->pkt.l4_len - thl;
+  g->mss = mss;
+  g->nsegs = g->payload_len ? (int)((g->payload_len + mss - 1) / mss) : 1;
+  return 1;
+}
+
+size_t
+vmnet_gso_segment(const struct vmnet_gso *g, const uint8_t *frame, int i,
+                  uint8_t *out)
+{
+  size_t start = (size_t)i * g->mss;
+  size_t chunk = g->payload_len - start;
+  if (chunk > g->mss)
+    chunk = g->mss;
+
+  memcpy(out, frame, g->hdr_len);
+  memcpy(out + g->hdr_len, frame + g->hdr_len + start, chunk);
+
+  uint8_t *ip = out + g->pkt.l3_off;
+  uint8_t *tcp = out + g->pkt.l4_off;
+  size_t ip_len = g->hdr_len - g->pkt.l3_off + chunk;
+  vmnet_set_be16(ip + 2, (uint16_t)ip_len);
+  vmnet_set_be16(ip + 4, (uint16_t)(vmnet_get_be16(ip + 4) + i));
+  vmnet_set_be32(tcp + 4, vmnet_get_be32(tcp + 4) + (uint32_t)start);
+
+  /* FIN and PSH belong to the last segment only, CWR to the first */
+  if (i != g->nsegs - 1)
+    tcp[13] &= ~(VMNET_TCP_FIN | VMNET_TCP_PSH);
+  if (i != 0)
+    tcp[13] &= ~VMNET_TCP_CWR;
+
+  size_t len = g->hdr_len + chunk;
+  vmnet_csum_fill(out, len);
+  return len;
+}
+
+/* Segments that may be merged: TCP/IPv4 without IP options or fragments,
+   carrying data, and with no flags beyond ACK and PSH. */
+static int
+gro_candidate(const uint8_t *frame, size_t len, struct vmnet_pkt *p,
+              size_t *thl)
+{
+  if (!vmnet_pkt_parse(frame, len, p) || p->ip_version != 4 ||
+      p->l4_proto != VMNET_PROTO_TCP || p->fragment ||
+      p->l4_off - p->l3_off != 20 || p->l4_len < 20)
+    return 0;
+  const uint8_t *tcp = frame + p->l4_off;
+  *thl = (tcp[12] >> 4) * 4;
+  if (*thl < 20 || *thl >= p->l4_len)
+    return 0;
+  return (tcp[13] & ~(VMNET_TCP_ACK | VMNET_TCP_PSH)) == 0 &&
+         (tcp[13] & VMNET_TCP_ACK);
+}
+
+static struct vmnet_gro_flow *
+gro_lookup(struct vmnet_gro *g, const uint8_t *frame, const struct vmnet_pkt *p)
+{
+  for (int i = 0; i < VMNET_GRO_FLOWS; i++) {
+    struct vmnet_gro_flow *f = &g->flows[i];
+    if (f->active && f->l3_off == p->l3_off &&
+        memcmp(f->addrs, frame + p->l3_off + 12, 8) == 0 &&
+        memcmp(f->ports, frame + p->l4_off, 4) == 0)
+      return f;
+  }
+  return NULL;
+}
+
+static void
+gro_close(struct vmnet_ring *r, struct vmnet_gro_flow *f)
+{
+  struct vmnet_ring_meta *m = vmnet_ring_meta(r, f->slot);
+  if (m->segs > 1)
+    vmnet_csum_fill(vmnet_ring_slot(r, f->slot), m->len);
+  f->active = 0;
+}
+
+static void
+gro_open(struct vmnet_gro *g, struct vmnet_ring *r, const uint8_t *frame,
+         const struct vmnet_pkt *p, size_t thl)
+{
+  struct vmnet_gro_flow *f = NULL;
+  for (int i = 0; i < VMNET_GRO_FLOWS && !f; i++)
+    if (!g->flows[i].active)
+      f = &g->flows[i];
+  if (!f) {
+    f = &g->flows[g->victim];
+    g->victim = (g->victim + 1) % VMNET_GRO_FLOWS;
+    gro_close(r, f);
+  }
+  const uint8_t *tcp = frame + p->l4_off;
+  f->active = 1;
+  f->slot = r->fill - 1;
+  memcpy(f->addrs, frame + p->l3_off + 12, 8);
+  memcpy(f->ports, tcp, 4);
+  f->next_seq = vmnet_get_be32(tcp + 4) + (uint32_t)(p->l4_len - thl);
+  f->ack = vmnet_get_be32(tcp + 8);
+  f->l3_off = p->l3_off;
+  f->l4_off = p->l4_off;
+  f->hdr_len = p->l4_off + thl;
+  /* Drop any Ethernet padding so that payload can be appended */
+  vmnet_ring_meta(r, f->slot)->len = (uint32_t)(p->l4_off + p->l4_len);
+  vmnet_ring_meta(r, f->slot)->mss = (uint32_t)(p->l4_len - thl);
+}
+
+/* Append the payload of [frame] to [f] if it continues the flow. */
+static int
+gro_merge(struct vmnet_gro *g, struct vmnet_ring *r, struct vmnet_gro_flow *f,
+          const uint8_t *frame, const struct vmnet_pkt *p, size_t thl)
+{
+  const uint8_t *tcp = frame + p->l4_off;
+  uint8_t *out = vmnet_ring_slot(r, f->slot);
+  struct vmnet_ring_meta *m = vmnet_ring_meta(r, f->slot);
+  uint8_t *ip = out + f->l3_off;
+  uint8_t *otcp = out + f->l4_off;
+  size_t payload = p->l4_len - thl;
+
+  if (p->l4_off + thl != f->hdr_len ||
+      frame[p->l3_off + 1] != ip[1] || frame[p->l3_off + 8] != ip[8] ||
+      vmnet_get_be32(tcp + 4) != f->next_seq ||
+      vmnet_get_be32(tcp + 8) != f->ack ||
+      memcmp(tcp + 20, otcp + 20, thl - 20) != 0 ||
+      vmnet_get_be16(ip + 2) + payload > VMNET_GRO_MAX_IP ||
+      m->len + payload > r->slot_size)
+    return 0;
+
+  memcpy(out + m->len, tcp + thl, payload);
+  m->len += (uint32_t)payload;
+  m->segs++;
+  if (payload > m->mss)
+    m->mss = (uint32_t)payload;
+  vmnet_set_be16(ip + 2, (uint16_t)(vmnet_get_be16(ip + 2) + payload));
+  /* The merged segment advertises the latest window */
+  memcpy(otcp + 14, tcp + 14, 2);
+  otcp[13] |= tcp[13] & VMNET_TCP_PSH;
+  f->next_seq += (uint32_t)payload;
+  g->merged++;
+  return 1;
+}
+
+int
+vmnet_gro_input(struct vmnet_gro *g, struct vmnet_ring *r,
+                const uint8_t *frame, size_t len)
+{
+  struct vmnet_pkt p;
+  size_t thl = 0;
+  int candidate = gro_candidate(frame, len, &p, &thl);
+  int tcp4 = candidate || (p.ip_version == 4 && p.l4_proto == VMNET_PROTO_TCP &&
+                           p.l4_len >= 4);
+  struct vmnet_gro_flow *f = tcp4 ? gro_lookup(g, frame, &p) : NULL;
+
+  if (f && candidate && gro_merge(g, r, f, frame, &p, thl)) {
+    if (frame[p.l4_off + 13] & VMNET_TCP_PSH)
+      gro_close(r, f);
+    return 1;
+  }
+  /* Anything else of the flow ends it, so that its order is kept */
+  if (f)
+    gro_close(r, f);
+  if (!vmnet_ring_push(r, frame, len))
+    return 0;
+  if (candidate && !(frame[p.l4_off + 13] & VMNET_TCP_PSH))
+    gro_open(g, r, frame, &p, thl);
+  return 1;
+}
+
+void
+vmnet_gro_flush(struct vmnet_gro *g, struct vmnet_ring *r)
+{
+  for (int i = 0; i < VMNET_GRO_FLOWS; i++)
+    if (g->flows[i].active)
+      gro_close(r, &g->flows[i]);
+}
+
+static uint16_t
+get_le16(const uint8_t *p)
+{
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static void
+set_le16(uint8_t *p, uint16_t v)
+{
+  p[0] = v & 0xff;
+  p[1] = v >> 8;
+}
+
+void
+vmnet_vnet_hdr_get(const uint8_t *p, struct vmnet_vnet_hdr *h)
+{
+  h->flags = p[0];
+  h->gso_type = p[1];
+  h->hdr_len = get_le16(p + 2);
+  h->gso_size = get_le16(p + 4);
+  h->csum_start = get_le16(p + 6);
+  h->csum_offset = get_le16(p + 8);
+}
+
+void
+vmnet_vnet_hdr_put(uint8_t *p, const struct vmnet_vnet_hdr *h)
+{
+  p[0] = h->flags;
+  p[1] = h->gso_type;
+  set_le16(p + 2, h->hdr_len);
+  set_le16(p + 4, h->gso_size);
+  set_le16(p + 6, h->csum_start);
+  set_le16(p + 8, h->csum_offset);
+}
+
+int
+vmnet_vnet_csum(uint8_t *frame, size_t len, const struct vmnet_vnet_hdr *h)
+{
+  size_t field = (size_t)h->csum_start + h->csum_offset;
+  if (field + 2 > len)
+    return 0;
+  uint16_t csum = (uint16_t)~vmnet_csum_fold(
+    vmnet_csum_partial(frame + h->csum_start, len - h->csum_start, 0));
+  /* As Linux does, never send a checksum of 0, which means none for UDP */
+  if (csum == 0)
+    csum = 0xffff;
+  memcpy(frame + field, &csum, 2);
+  return 1;
+}
+
+void
+vmnet_vnet_rx(uint8_t *frame, size_t len, uint32_t segs, uint32_t mss,
+              size_t offload_mtu, struct vmnet_vnet_hdr *h)
+{
+  struct vmnet_pkt p;
+  size_t thl = 0;
+  memset(h, 0, sizeof(*h));
+  if (!vmnet_pkt_parse(frame, len, &p) || p.ip_version == 0 || p.fragment)
+    return;
+  if (p.l4_proto == VMNET_PROTO_TCP && p.l4_len >= 20)
+    thl = (frame[p.l4_off + 12] >> 4) * 4;
+  if (thl > 0 && segs > 1 && mss > 0) {
+    h->gso_size = (uint16_t)mss;
+  } else if (thl > 0 && offload_mtu > 0 &&
+             p.l4_off - p.l3_off + p.l4_len > offload_mtu) {
+    h->gso_size = (uint16_t)(offload_mtu - (p.l4_off - p.l3_off) - thl);
+  }
+  if (h->gso_size > 0) {
+    h->gso_type = p.ip_version == 4 ? VMNET_VNET_GSO_TCPV4 : VMNET_VNET_GSO_TCPV6;
+    h->hdr_len = (uint16_t)(p.l4_off + thl);
+  }
+  size_t field = thl > 0 ? 16 :
+    (p.l4_proto == VMNET_PROTO_UDP && p.l4_len >= 8 ? 6 : 0);
+  if (offload_mtu > 0 && field > 0) {
+    uint16_t pseudo = vmnet_csum_fold(vmnet_csum_pseudo(frame, &p, p.l4_len));
+    memcpy(frame + p.l4_off + field, &pseudo, 2);
+    h->flags = VMNET_VNET_F_NEEDS_CSUM;
+    h->csum_start = (uint16_t)p.l4_off;
+    h->csum_offset = (uint16_t)field;
+  } else if (segs > 1) {
+    h->flags = VMNET_VNET_F_DATA_VALID;
+  }
+}
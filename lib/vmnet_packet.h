@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (C) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Ethernet frame parsing and checksum helpers shared by the C stubs.  None
+   of this depends on vmnet.framework. */
+
+#ifndef VMNET_PACKET_H
+#define VMNET_PACKET_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define VMNET_ETH_HLEN        14
+#define VMNET_ETHERTYPE_IPV4  0x0800
+#define VMNET_ETHERTYPE_ARP   0x0806
+#define VMNET_ETHERTYPE_VLAN  0x8100
+#define VMNET_ETHERTYPE_IPV6  0x86dd
+
+#define VMNET_PROTO_ICMP  1
+#define VMNET_PROTO_TCP   6
+#define VMNET_PROTO_UDP   17
+
+#define VMNET_TCP_FIN  0x01
+#define VMNET_TCP_SYN  0x02
+#define VMNET_TCP_RST  0x04
+#define VMNET_TCP_PSH  0x08
+#define VMNET_TCP_ACK  0x10
+#define VMNET_TCP_URG  0x20
+#define VMNET_TCP_ECE  0x40
+#define VMNET_TCP_CWR  0x80
+
+static inline uint16_t
+vmnet_get_be16(const uint8_t *p)
+{
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t
+vmnet_get_be32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void
+vmnet_set_be16(uint8_t *p, uint16_t v)
+{
+  p[0] = v >> 8;
+  p[1] = v & 0xff;
+}
+
+static inline void
+vmnet_set_be32(uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = (v >> 16) & 0xff;
+  p[2] = (v >> 8) & 0xff;
+  p[3] = v & 0xff;
+}
+
+/* Offsets of the headers of one frame, filled in by vmnet_pkt_parse. */
+struct vmnet_pkt {
+  uint16_t ethertype;  /* after at most one VLAN tag */
+  size_t l3_off;       /* start of the network header */
+  int ip_version;      /* 4, 6, or 0 if not IP */
+  size_t l4_off;       /* start of the transport header */
+  size_t l4_len;       /* transport header + payload, from the IP header */
+  uint8_t l4_proto;
+  int fragment;        /* part of a fragmented datagram */
+};
+
+/* Parse the Ethernet and IP headers of [frame].  Returns 0 if the frame is
+   too short or its IP header is inconsistent, 1 otherwise; for non-IP frames
+   only [ethertype] and [l3_off] are meaningful. */
+static inline int
+vmnet_pkt_parse(const uint8_t *frame, size_t len, struct vmnet_pkt *p)
+{
+  memset(p, 0, sizeof(*p));
+  if (len < VMNET_ETH_HLEN)
+    return 0;
+  p->ethertype = vmnet_get_be16(frame + 12);
+  p->l3_off = VMNET_ETH_HLEN;
+  if (p->ethertype == VMNET_ETHERTYPE_VLAN) {
+    if (len < VMNET_ETH_HLEN + 4)
+      return 0;
+    p->ethertype = vmnet_get_be16(frame + 16);
+    p->l3_off += 4;
+  }
+  const uint8_t *ip = frame + p->l3_off;
+  size_t avail = len - p->l3_off;
+  if (p->ethertype == VMNET_ETHERTYPE_IPV4) {
+    if (avail < 20 || (ip[0] >> 4) != 4)
+      return 0;
+    size_t ihl = (ip[0] & 0x0f) * 4;
+    size_t total = vmnet_get_be16(ip + 2);
+    if (ihl < 20 || total < ihl || total > avail)
+      return 0;
+    p->ip_version = 4;
+    p->l4_proto = ip[9];
+    p->l4_off = p->l3_off + ihl;
+    p->l4_len = total - ihl;
+    p->fragment = (vmnet_get_be16(ip + 6) & 0x3fff) != 0;
+  } else if (p->ethertype == VMNET_ETHERTYPE_IPV6) {
+    if (avail < 40 || (ip[0] >> 4) != 6)
+      return 0;
+    size_t payload = vmnet_get_be16(ip + 4);
+    if (40 + payload > avail)
+      return 0;
+    /* Extension headers are not followed */
+    p->ip_version = 6;
+    p->l4_proto = ip[6];
+    p->l4_off = p->l3_off + 40;
+    p->l4_len = payload;
+  }
+  return 1;
+}
+
+/* One's complement arithmetic (RFC 1071).  Partial sums are kept in host
+   byte order as produced by vmnet_csum_partial; fold and complement the
+   final sum, and store it with memcpy rather than as a big-endian value. */
+uint32_t vmnet_csum_partial(const uint8_t *buf, size_t len, uint32_t sum);
+
+static inline uint16_t
+vmnet_csum_fold(uint32_t sum)
+{
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return (uint16_t)sum;
+}
+
+/* Partial sum of the TCP/UDP pseudo header of a parsed IP packet. */
+uint32_t vmnet_csum_pseudo(const uint8_t *frame, const struct vmnet_pkt *p,
+                           size_t l4_len);
+
+/* RFC 1624 update of the big-endian checksum [csum] after a 16-bit field
+   changed from [old] to [new]; all values are in host order. */
+static inline uint16_t
+vmnet_csum_update16(uint16_t csum, uint16_t old, uint16_t new)
+{
+  uint32_t sum = (uint16_t)~csum + (uint16_t)~old + new;
+  return (uint16_t)~vmnet_csum_fold(sum);
+}
+
+/* Compute and store the IPv4 header checksum and the TCP or UDP checksum of
+   an Ethernet frame.  Returns the number of checksums written. */
+int vmnet_csum_fill(uint8_t *frame, size_t len);
+
+/* Verify the checksums vmnet_csum_fill would write.  Returns 1 if all the
+   checksums present are correct (or the frame carries none), 0 otherwise. */
+int vmnet_csum_verify(const uint8_t *frame, size_t len);
+
+/* Software TCP segmentation (vmnet_offload.c).  A TCP/IPv4 frame whose
+   payload exceeds [mss] is split into [nsegs] frames that each repeat the
+   headers and carry at most [mss] bytes of payload. */
+struct vmnet_gso {
+  struct vmnet_pkt pkt;
+  size_t hdr_len;      /* Ethernet + IPv4 + TCP headers */
+  size_t payload_len;
+  size_t mss;
+  int nsegs;
+};
+
+/* Returns 1 and fills [g] if [frame] is a TCP/IPv4 segment that can be
+   split with [mss], 0 otherwise. */
+int vmnet_gso_prepare(const uint8_t *frame, size_t len, size_t mss,
+                      struct vmnet_gso *g);
+
+/* Write segment [i] of [frame] with correct headers and checksums to [out],
+   which must hold [g->hdr_len + g->mss] bytes.  Returns its length. */
+size_t vmnet_gso_segment(const struct vmnet_gso *g, const uint8_t *frame,
+                         int i, uint8_t *out);
+
+/* Receive coalescing (vmnet_offload.c).  In-order TCP/IPv4 segments of the
+   same flow are appended to the frame of the first one while it still sits
+   in the producer side of a receive ring, so the reader sees one large
+   frame instead of many MTU-sized ones.  A flow is flushed (its headers
+   and checksums finalised) when a segment carries PSH, when a segment does
+   not continue it, and by vmnet_gro_flush at the end of each batch. */
+#define VMNET_GRO_FLOWS   8
+#define VMNET_GRO_MAX_IP  65535
+#define VMNET_GRO_SLOT    (VMNET_ETH_HLEN + 4 + VMNET_GRO_MAX_IP)
+
+struct vmnet_ring;
+
+struct vmnet_gro_flow {
+  int active;
+  unsigned slot;       /* ring index of the frame being grown */
+  uint8_t addrs[8];    /* IPv4 source and destination */
+  uint8_t ports[4];
+  uint32_t next_seq;
+  uint32_t ack;
+  size_t l3_off;
+  size_t l4_off;
+  size_t hdr_len;      /* Ethernet + IPv4 + TCP headers */
+};
+
+struct vmnet_gro {
+  struct vmnet_gro_flow flows[VMNET_GRO_FLOWS];
+  unsigned victim;     /* next flow to evict when all are in use */
+  uint64_t merged;     /* segments appended to an earlier frame */
+};
+
+/* Store [frame] in [r], either by appending it to an open flow or as a new
+   frame.  Returns 0 if there was no room for it. */
+int vmnet_gro_input(struct vmnet_gro *g, struct vmnet_ring *r,
+                    const uint8_t *frame, size_t len);
+
+/* Finalise every open flow. */
+void vmnet_gro_flush(struct vmnet_gro *g, struct vmnet_ring *r);
+
+/* virtio-net headers (vmnet_offload.c), the [struct virtio_net_hdr] of the
+   virtio specification that Linux TAP devices also use with
+   IFF_VNET_HDR.  They carry the offload state of the frame that follows
+   them; multi-byte fields are little-endian. */
+#define VMNET_VNET_HLEN          10
+#define VMNET_VNET_F_NEEDS_CSUM  1
+#define VMNET_VNET_F_DATA_VALID  2
+#define VMNET_VNET_GSO_NONE      0
+#define VMNET_VNET_GSO_TCPV4     1
+#define VMNET_VNET_GSO_UDP       3
+#define VMNET_VNET_GSO_TCPV6     4
+#define VMNET_VNET_GSO_ECN       0x80
+
+struct vmnet_vnet_hdr {
+  uint8_t flags;
+  uint8_t gso_type;
+  uint16_t hdr_len;     /* Ethernet + IP + TCP headers of a GSO frame */
+  uint16_t gso_size;    /* payload bytes per segment */
+  uint16_t csum_start;  /* where the checksummed data starts */
+  uint16_t csum_offset; /* of the checksum field from csum_start */
+};
+
+void vmnet_vnet_hdr_get(const uint8_t *p, struct vmnet_vnet_hdr *h);
+void vmnet_vnet_hdr_put(uint8_t *p, const struct vmnet_vnet_hdr *h);
+
+/* Complete the checksum of a frame sent with VMNET_VNET_F_NEEDS_CSUM: the
+   field at csum_start + csum_offset holds the sum of the pseudo header,
+   and is replaced by the checksum of everything from csum_start to the
+   end.  Returns 0 if the offsets are outside the frame. */
+int vmnet_vnet_csum(uint8_t *frame, size_t len, const struct vmnet_vnet_hdr *h);
+
+/* Describe a received frame in [h].  A frame coalesced from [segs] > 1
+   segments of up to [mss] payload bytes is a GSO frame with valid
+   checksums.  If [offload_mtu] is not 0, vmnet offloads checksums and
+   segmentation on an interface of that MTU: TCP and UDP checksums are left
+   to the reader, their field being set to the sum of the pseudo header,
+   and TCP frames larger than the MTU are GSO frames. */
+void vmnet_vnet_rx(uint8_t *frame, size_t len, uint32_t segs, uint32_t mss,
+                   size_t offload_mtu, struct vmnet_vnet_hdr *h);
+
+/* Receive side scaling (vmnet_rss.c).  The Toeplitz hash of the IP
+   addresses, and the ports of TCP and UDP, of a frame; 0 for non-IP
+   frames. */
+#define VMNET_RSS_KEY_LEN 40
+
+extern const uint8_t vmnet_rss_default_key[VMNET_RSS_KEY_LEN];
+
+uint32_t vmnet_toeplitz(const uint8_t *key, const uint8_t *data, size_t len);
+uint32_t vmnet_rss_hash(const uint8_t *key, const uint8_t *frame, size_t len);
+
+/* Classic BPF packet filters (vmnet_bpf.c) */
+#define VMNET_BPF_MAXINSNS  4096
+#define VMNET_BPF_MEMWORDS  16
+
+struct vmnet_bpf_insn {
+  uint16_t code;
+  uint8_t jt;
+  uint8_t jf;
+  uint32_t k;
+};
+
+/* Returns 1 if [prog] only uses known instructions, jumps forward within
+   itself, and ends with a return. */
+int vmnet_bpf_validate(const struct vmnet_bpf_insn *prog, size_t n);
+
+/* Run a validated program over [pkt].  Returns the number of bytes to
+   keep: 0 rejects the frame. */
+uint32_t vmnet_bpf_run(const struct vmnet_bpf_insn *prog, const uint8_t *pkt,
+                       size_t len);
+
+/* ARP and ICMP echo responder (vmnet_respond.c) for a set of IPv4
+   address and MAC bindings */
+struct vmnet_binding {
+  uint8_t ip[4];
+  uint8_t mac[6];
+};
+
+/* If [frame] is an ARP request for one of the [n] bound addresses, or an
+   ICMP echo request sent to one of them, rewrite it in place into the
+   reply and return the reply's length.  Returns 0 for other frames, which
+   are left untouched. */
+size_t vmnet_respond(const struct vmnet_binding *b, size_t n, uint8_t *frame,
+                     size_t len);
+
+#endif /* VMNET_PACKET_H */
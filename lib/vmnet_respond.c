@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (C) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <arpa/inet.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "vmnet_packet.h"
+
+#define ARP_LEN 28
+
+static const struct vmnet_binding *
+find_ip(const struct vmnet_binding *b, size_t n, const uint8_t *ip)
+{
+  for (size_t i = 0; i < n; i++)
+    if (memcmp(b[i].ip, ip, 4) == 0)
+      return &b[i];
+  return NULL;
+}
+
+static size_t
+respond_arp(const struct vmnet_binding *b, size_t n, uint8_t *frame,
+            size_t len, size_t l3_off)
+{
+  uint8_t *arp = frame + l3_off;
+  if (len < l3_off + ARP_LEN)
+    return 0;
+  /* Ethernet/IPv4 requests only */
+  if (vmnet_get_be16(arp) != 1 || vmnet_get_be16(arp + 2) != VMNET_ETHERTYPE_IPV4 ||
+      arp[4] != 6 || arp[5] != 4 || vmnet_get_be16(arp + 6) != 1)
+    return 0;
+  const struct vmnet_binding *me = find_ip(b, n, arp + 24);
+  /* Gratuitous ARP announces the sender's own address: leave it alone */
+  if (!me || memcmp(arp + 14, arp + 24, 4) == 0)
+    return 0;
+  vmnet_set_be16(arp + 6, 2);
+  memcpy(arp + 18, arp + 8, 10);        /* target = sender */
+  memcpy(arp + 8, me->mac, 6);
+  memcpy(arp + 14, me->ip, 4);
+  memcpy(frame, arp + 18, 6);
+  memcpy(frame + 6, me->mac, 6);
+  return len;
+}
+
+static size_t
+respond_icmp(const struct vmnet_binding *b, size_t n, uint8_t *frame,
+             const struct vmnet_pkt *p)
+{
+  uint8_t *ip = frame + p->l3_off;
+  uint8_t *icmp = frame + p->l4_off;
+  if (p->l4_proto != VMNET_PROTO_ICMP || p->fragment ||
+      p->l4_off - p->l3_off != 20 || p->l4_len < 8)
+    return 0;
+  if (icmp[0] != 8 || icmp[1] != 0)
+    return 0;
+  const struct vmnet_binding *me = find_ip(b, n, ip + 16);
+  if (!me || memcmp(frame, me->mac, 6) != 0)
+    return 0;
+  uint16_t csum;
+  /* Echo reply: only the type changes */
+  memcpy(&csum, icmp + 2, 2);
+  csum = htons(vmnet_csum_update16(ntohs(csum), 0x0800, 0x0000));
+  memcpy(icmp + 2, &csum, 2);
+  icmp[0] = 0;
+  memcpy(ip + 16, ip + 12, 4);
+  memcpy(ip + 12, me->ip, 4);
+  ip[8] = 64;
+  memset(ip + 10, 0, 2);
+  csum = ~vmnet_csum_fold(vmnet_csum_partial(ip, 20, 0));
+  memcpy(ip + 10, &csum, 2);
+  memcpy(frame, frame + 6, 6);
+  memcpy(frame + 6, me->mac, 6);
+  return p->l4_off + p->l4_len;
+}
+
+size_t
+vmnet_respond(const struct vmnet_binding *b, size_t n, uint8_t *frame,
+              size_t len)
+{
+  struct vmnet_pkt p;
+  if (n == 0 || !vmnet_pkt_parse(frame, len, &p))
+    return 0;
+  if (p.ethertype == VMNET_ETHERTYPE_ARP)
+    return respond_arp(b, n, frame, len, p.l3_off);
+  if (p.ip_version == 4)
+    return respond_icmp(b, n, frame, &p);
+  return 0;
+}
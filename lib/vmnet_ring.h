@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (C) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A ring of fixed-size frame slots, used to hold received frames between
+   vmnet and OCaml.  Indices are free-running counters masked on access.
+   The producer fills slots from [fill] and publishes them in one go by
+   moving [head]; consumers take slots from [tail].  A consumer may also
+   lend a slot out instead of copying it: the slot then stays in use until
+   it is returned, and [free] trails [tail] past the slots still lent.
+   Callers provide the locking. */
+
+#ifndef VMNET_RING_H
+#define VMNET_RING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct vmnet_ring_meta {
+  uint32_t len;
+  uint32_t segs;       /* received frames coalesced into this one */
+  uint64_t ts;         /* monotonic nanoseconds when it was received */
+  uint32_t lent;       /* consumed but not returned yet */
+  uint32_t mss;        /* largest segment payload when segs > 1 */
+};
+
+struct vmnet_ring {
+  uint8_t *mem;
+  struct vmnet_ring_meta *meta;
+  size_t slot_size;
+  unsigned nslots;     /* power of two */
+  unsigned free;       /* slots before this can be refilled */
+  unsigned tail;       /* next slot to consume */
+  unsigned head;       /* slots before this are visible to consumers */
+  unsigned fill;       /* next slot the producer fills */
+};
+
+static inline int
+vmnet_ring_init(struct vmnet_ring *r, unsigned nslots, size_t slot_size)
+{
+  memset(r, 0, sizeof(*r));
+  r->mem = malloc((size_t)nslots * slot_size);
+  r->meta = calloc(nslots, sizeof(struct vmnet_ring_meta));
+  if (!r->mem || !r->meta) {
+    free(r->mem);
+    free(r->meta);
+    r->mem = NULL;
+    r->meta = NULL;
+    return 0;
+  }
+  r->nslots = nslots;
+  r->slot_size = slot_size;
+  return 1;
+}
+
+static inline void
+vmnet_ring_free(struct vmnet_ring *r)
+{
+  free(r->mem);
+  free(r->meta);
+  memset(r, 0, sizeof(*r));
+}
+
+static inline uint8_t *
+vmnet_ring_slot(const struct vmnet_ring *r, unsigned i)
+{
+  return r->mem + (size_t)(i & (r->nslots - 1)) * r->slot_size;
+}
+
+static inline struct vmnet_ring_meta *
+vmnet_ring_meta(const struct vmnet_ring *r, unsigned i)
+{
+  return &r->meta[i & (r->nslots - 1)];
+}
+
+/* Published frames waiting to be consumed */
+static inline unsigned
+vmnet_ring_count(const struct vmnet_ring *r)
+{
+  return r->head - r->tail;
+}
+
+/* Slots the producer can still fill */
+static inline unsigned
+vmnet_ring_space(const struct vmnet_ring *r)
+{
+  return r->nslots - (r->fill - r->free);
+}
+
+/* Some consumed slots have not been returned yet */
+static inline int
+vmnet_ring_lent(const struct vmnet_ring *r)
+{
+  return r->free != r->tail;
+}
+
+static inline void
+vmnet_ring_reclaim(struct vmnet_ring *r)
+{
+  while (r->free != r->tail && !vmnet_ring_meta(r, r->free)->lent)
+    r->free++;
+}
+
+/* Consume the [n] oldest published frames */
+static inline void
+vmnet_ring_take(struct vmnet_ring *r, unsigned n)
+{
+  r->tail += n;
+  vmnet_ring_reclaim(r);
+}
+
+/* Consume the oldest published frame but keep its slot until it is
+   returned.  Returns the index of the slot. */
+static inline unsigned
+vmnet_ring_lend(struct vmnet_ring *r)
+{
+  vmnet_ring_meta(r, r->tail)->lent = 1;
+  return r->tail++;
+}
+
+/* Give back slot [i].  Returns 0 if it was not lent. */
+static inline int
+vmnet_ring_return(struct vmnet_ring *r, unsigned i)
+{
+  if (i - r->free >= r->tail - r->free || !vmnet_ring_meta(r, i)->lent)
+    return 0;
+  vmnet_ring_meta(r, i)->lent = 0;
+  vmnet_ring_reclaim(r);
+  return 1;
+}
+
+/* Copy [frame] into the next free slot.  Returns 0 if the ring is full or
+   the frame does not fit in a slot. */
+static inline int
+vmnet_ring_push(struct vmnet_ring *r, const uint8_t *frame, size_t len)
+{
+  if (vmnet_ring_space(r) == 0 || len > r->slot_size)
+    return 0;
+  memcpy(vmnet_ring_slot(r, r->fill), frame, len);
+  vmnet_ring_meta(r, r->fill)->len = (uint32_t)len;
+  vmnet_ring_meta(r, r->fill)->segs = 1;
+  vmnet_ring_meta(r, r->fill)->ts = 0;
+  vmnet_ring_meta(r, r->fill)->lent = 0;
+  vmnet_ring_meta(r, r->fill)->mss = 0;
+  r->fill++;
+  return 1;
+}
+
+static inline void
+vmnet_ring_commit(struct vmnet_ring *r)
+{
+  r->head = r->fill;
+}
+
+/* Move the frames of [from], which must have none lent, into [to], oldest
+   first, as long as they fit.  Returns 0 if some frames had to be left
+   behind. */
+static inline int
+vmnet_ring_move(struct vmnet_ring *to, struct vmnet_ring *from)
+{
+  while (vmnet_ring_count(from) > 0) {
+    struct vmnet_ring_meta *m = vmnet_ring_meta(from, from->tail);
+    if (!vmnet_ring_push(to, vmnet_ring_slot(from, from->tail), m->len))
+      return 0;
+    *vmnet_ring_meta(to, to->fill - 1) = *m;
+    vmnet_ring_take(from, 1);
+  }
+  vmnet_ring_commit(to);
+  return 1;
+}
+
+#endif /* VMNET_RING_H */
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (C) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Toeplitz flow hashing, as specified for receive side scaling. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <caml/mlvalues.h>
+#include <caml/bigarray.h>
+
+#include "vmnet_packet.h"
+
+const uint8_t vmnet_rss_default_key[VMNET_RSS_KEY_LEN] = {
+  0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+  0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+  0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+  0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+  0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+uint32_t
+vmnet_toeplitz(const uint8_t *key, const uint8_t *data, size_t len)
+{
+  /* [window] holds the 32 key bits starting at the current input bit */
+  uint32_t hash = 0;
+  uint32_t window = vmnet_get_be32(key);
+  size_t next = 32;
+  for (size_t i = 0; i < len; i++) {
+    for (int b = 7; b >= 0; b--) {
+      if (data[i] & (1 << b))
+        hash ^= window;
+      uint32_t bit = 0;
+      if (next < VMNET_RSS_KEY_LEN * 8)
+        bit = (key[next / 8] >> (7 - next % 8)) & 1;
+      window = (window << 1) | bit;
+      next++;
+    }
+  }
+  return hash;
+}
+
+uint32_t
+vmnet_rss_hash(const uint8_t *key, const uint8_t *frame, size_t len)
+{
+  struct vmnet_pkt p;
+  uint8_t tuple[36];
+  size_t n;
+  if (!vmnet_pkt_parse(frame, len, &p) || p.ip_version == 0)
+    return 0;
+  const uint8_t *ip = frame + p.l3_off;
+  if (p.ip_version == 4) {
+    memcpy(tuple, ip + 12, 8);
+    n = 8;
+  } else {
+    memcpy(tuple, ip + 8, 32);
+    n = 32;
+  }
+  /* Ports only for unfragmented TCP and UDP, so that all the fragments
+     of a datagram hash alike */
+  if ((p.l4_proto == VMNET_PROTO_TCP || p.l4_proto == VMNET_PROTO_UDP) &&
+      !p.fragment && p.l4_len >= 4) {
+    memcpy(tuple + n, frame + p.l4_off, 4);
+    n += 4;
+  }
+  return vmnet_toeplitz(key, tuple, n);
+}
+
+/* [v_key] is VMNET_RSS_KEY_LEN bytes, checked by the caller */
+CAMLprim value
+caml_vmnet_rss_hash(value v_key, value v_ba, value v_off, value v_len)
+{
+  const uint8_t *frame = (uint8_t *)Caml_ba_data_val(v_ba) + Long_val(v_off);
+  return Val_long(vmnet_rss_hash((const uint8_t *)String_val(v_key), frame,
+                                 Long_val(v_len)));
+}
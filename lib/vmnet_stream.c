@@ -0,0 +1,513 @@
+/*
+ * Copyright (C) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (C) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Switch ports speaking Ethernet over a stream socket, with one of two
+   framings.  vpnkit's, as used by hyperkit's virtio-net-vpnkit device,
+   starts with a handshake in which the client sends its interface UUID
+   and is told the MTU and MAC address to use, and then sends each frame
+   as a 16-bit little-endian length followed by its bytes.  QEMU's
+   -netdev stream has no handshake and a 32-bit big-endian length.  Frames
+   are read many at a time into one buffer and switched from there;
+   frames switched to the port are written with one sendmsg per batch,
+   and whatever the socket does not take at once is buffered, whole
+   frames only, until it drains.  None of this depends on
+   vmnet.framework. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/custom.h>
+#include <caml/fail.h>
+
+#include "vmnet_switch.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define VPNKIT_VERSION       22
+#define VPNKIT_INIT_LEN      49   /* "VMN3T", version, 40-byte commit */
+#define VPNKIT_UUID_LEN      36
+#define VPNKIT_RESPONSE_LEN  258  /* type, then a vif or a reason */
+
+#define VPNKIT_CMD_ETHERNET       1
+#define VPNKIT_CMD_PREFERRED_IPV4 8
+#define VPNKIT_RESPONSE_VIF       1
+#define VPNKIT_RESPONSE_DISCONNECT 2
+
+#define STREAM_VPNKIT        0
+#define STREAM_QEMU          1
+
+#define STREAM_FRAME_MAX     65535
+#define STREAM_HLEN_MAX      4
+#define STREAM_SOCKBUF       (4 << 20)
+#define STREAM_RBUF          (256 << 10)
+#define STREAM_WBUF          (1 << 20)
+#define STREAM_HANDSHAKE_S   5
+
+/* Bytes written to the wake pipe */
+#define STREAM_WAKE_STOP     0
+#define STREAM_WAKE_POLL     1    /* output was buffered: poll for POLLOUT */
+
+static const char vpnkit_hello[5] = { 'V', 'M', 'N', '3', 'T' };
+
+struct vmnet_stream {
+  struct vmnet_switch *sw;
+  struct vmnet_sw_port *port;
+  int port_no;
+  int proto;           /* STREAM_VPNKIT or STREAM_QEMU */
+  size_t hlen;         /* bytes of length before each frame */
+  int stopping;        /* the port was removed */
+  int listen_fd;
+  int conn_fd;         /* -1 until a client has done the handshake */
+  int wake[2];         /* written to stop or wake up the thread */
+  uint16_t mtu;        /* told to vpnkit clients */
+  uint8_t mac[6];
+  uint8_t *rbuf;       /* frames read, the last one maybe incomplete */
+  size_t rlen;
+  uint8_t *wbuf;       /* bytes the socket did not take yet */
+  size_t woff;
+  size_t wlen;
+};
+
+static int
+vpnkit_really(int fd, void *buf, size_t len, int writing)
+{
+  uint8_t *p = buf;
+  while (len > 0) {
+    ssize_t r = writing ? send(fd, p, len, MSG_NOSIGNAL) : recv(fd, p, len, 0);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return 0;
+    p += r;
+    len -= r;
+  }
+  return 1;
+}
+
+/* The client's side of the handshake, on a fresh connection [fd].  Called
+   unlocked; the socket times out so that a silent client cannot hold up
+   the thread for long. */
+static int
+vpnkit_handshake(struct vmnet_stream *st, int fd)
+{
+  uint8_t init[VPNKIT_INIT_LEN];
+  uint8_t cmd[1 + VPNKIT_UUID_LEN + 4];
+  uint8_t resp[VPNKIT_RESPONSE_LEN];
+  if (!vpnkit_really(fd, init, sizeof(init), 0) ||
+      memcmp(init, vpnkit_hello, sizeof(vpnkit_hello)) != 0)
+    return 0;
+  memset(init, 0, sizeof(init));
+  memcpy(init, vpnkit_hello, sizeof(vpnkit_hello));
+  init[5] = VPNKIT_VERSION;
+  if (!vpnkit_really(fd, init, sizeof(init), 1))
+    return 0;
+  if (!vpnkit_really(fd, cmd, 1 + VPNKIT_UUID_LEN, 0))
+    return 0;
+  if (cmd[0] == VPNKIT_CMD_PREFERRED_IPV4 &&
+      !vpnkit_really(fd, cmd + 1 + VPNKIT_UUID_LEN, 4, 0))
+    return 0;
+  memset(resp, 0, sizeof(resp));
+  if (cmd[0] != VPNKIT_CMD_ETHERNET && cmd[0] != VPNKIT_CMD_PREFERRED_IPV4) {
+    static const char reason[] = "unsupported command";
+    resp[0] = VPNKIT_RESPONSE_DISCONNECT;
+    resp[1] = sizeof(reason) - 1;
+    memcpy(resp + 2, reason, sizeof(reason) - 1);
+    vpnkit_really(fd, resp, sizeof(resp), 1);
+    return 0;
+  }
+  /* The preferred address is not ours to give: the client gets its
+     address the usual way, from DHCP on the switch */
+  resp[0] = VPNKIT_RESPONSE_VIF;
+  resp[1] = st->mtu & 0xff;
+  resp[2] = st->mtu >> 8;
+  resp[3] = (st->mtu + 14) & 0xff;
+  resp[4] = (st->mtu + 14) >> 8;
+  memcpy(resp + 5, st->mac, 6);
+  return vpnkit_really(fd, resp, sizeof(resp), 1);
+}
+
+static void
+stream_tune(int fd)
+{
+  int size = STREAM_SOCKBUF;
+  int on = 1;
+  struct timeval tv = { STREAM_HANDSHAKE_S, 0 };
+  (void)on;
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+/* The functions below are called with the switch locked */
+
+static void
+stream_disconnect(struct vmnet_stream *st)
+{
+  if (st->conn_fd >= 0)
+    close(st->conn_fd);
+  st->conn_fd = -1;
+  st->rlen = 0;
+  st->woff = 0;
+  st->wlen = 0;
+}
+
+static void
+stream_put_len(const struct vmnet_stream *st, uint8_t *hdr, size_t len)
+{
+  if (st->proto == STREAM_QEMU) {
+    hdr[0] = 0;
+    hdr[1] = 0;
+    hdr[2] = len >> 8;
+    hdr[3] = len & 0xff;
+  } else {
+    hdr[0] = len & 0xff;
+    hdr[1] = len >> 8;
+  }
+}
+
+static size_t
+stream_get_len(const struct vmnet_stream *st, const uint8_t *hdr)
+{
+  if (st->proto == STREAM_QEMU)
+    return ((size_t)hdr[0] << 24) | ((size_t)hdr[1] << 16) |
+           ((size_t)hdr[2] << 8) | hdr[3];
+  return hdr[0] | (hdr[1] << 8);
+}
+
+/* Queue what is left of [f] from byte [sent] of its framed form.  A frame
+   that was partly written must be finished; one that was not is dropped
+   if it does not fit. */
+static void
+stream_buffer(struct vmnet_stream *st, const uint8_t *hdr,
+              const struct vmnet_sw_frame *f, size_t sent)
+{
+  size_t hlen = st->hlen;
+  size_t total = hlen + f->len;
+  if (st->woff > 0 && st->woff + st->wlen + total > STREAM_WBUF) {
+    memmove(st->wbuf, st->wbuf + st->woff, st->wlen);
+    st->woff = 0;
+  }
+  if (st->woff + st->wlen + total - sent > STREAM_WBUF) {
+    st->port->dropped++;
+    return;
+  }
+  uint8_t *p = st->wbuf + st->woff + st->wlen;
+  if (sent < hlen) {
+    memcpy(p, hdr + sent, hlen - sent);
+    memcpy(p + hlen - sent, f->data, f->len);
+  } else {
+    memcpy(p, f->data + (sent - hlen), total - sent);
+  }
+  st->wlen += total - sent;
+}
+
+static void
+stream_wake(struct vmnet_stream *st, char c)
+{
+  /* The write end does not block: a full pipe wakes the thread anyway */
+  while (write(st->wake[1], &c, 1) < 0 && errno == EINTR);
+}
+
+/* Switch output: send frames to the client, in one sendmsg if nothing is
+   buffered.  The thread sleeps in poll without POLLOUT while nothing is
+   buffered, so it is woken up when that changes. */
+static void
+stream_output(void *ctx, const struct vmnet_sw_frame *frames, int n)
+{
+  struct vmnet_stream *st = ctx;
+  uint8_t hdr[VMNET_SWITCH_BATCH][STREAM_HLEN_MAX];
+  struct iovec iov[2 * VMNET_SWITCH_BATCH];
+  int was_empty = st->wlen == 0;
+  if (st->conn_fd < 0) {
+    st->port->dropped += n;
+    return;
+  }
+  for (int i = 0; i < n; i++) {
+    stream_put_len(st, hdr[i], frames[i].len);
+    iov[2 * i].iov_base = hdr[i];
+    iov[2 * i].iov_len = st->hlen;
+    iov[2 * i + 1].iov_base = (void *)frames[i].data;
+    iov[2 * i + 1].iov_len = frames[i].len;
+  }
+  ssize_t sent = 0;
+  if (st->wlen == 0) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2 * n;
+    while ((sent = sendmsg(st->conn_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 &&
+           errno == EINTR);
+    if (sent < 0) {
+      /* A broken connection is noticed by the thread */
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        st->port->dropped += n;
+        return;
+      }
+      sent = 0;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    size_t total = st->hlen + frames[i].len;
+    if ((size_t)sent >= total) {
+      sent -= total;
+      continue;
+    }
+    stream_buffer(st, hdr[i], &frames[i], sent);
+    sent = 0;
+  }
+  if (was_empty && st->wlen > 0)
+    stream_wake(st, STREAM_WAKE_POLL);
+}
+
+/* Send what is buffered.  Returns 0 if the connection broke. */
+static int
+stream_flush(struct vmnet_stream *st)
+{
+  while (st->wlen > 0) {
+    ssize_t r = send(st->conn_fd, st->wbuf + st->woff, st->wlen,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    st->woff += r;
+    st->wlen -= r;
+  }
+  st->woff = 0;
+  return 1;
+}
+
+/* Switch the complete frames in the read buffer, in batches, and keep the
+   incomplete one for the next read.  Returns 0 if a frame is too big, which
+   means the stream is garbage. */
+static int
+stream_input(struct vmnet_stream *st)
+{
+  size_t hlen = st->hlen;
+  int ok = 1;
+  struct vmnet_sw_frame frames[VMNET_SWITCH_BATCH];
+  uint64_t now = vmnet_switch_now();
+  size_t off = 0;
+  int n = 0;
+  for (;;) {
+    size_t len = 0;
+    int complete = st->rlen - off >= hlen;
+    if (complete) {
+      len = stream_get_len(st, st->rbuf + off);
+      ok = len <= STREAM_FRAME_MAX;
+      complete = ok && st->rlen - off - hlen >= len;
+    }
+    if (complete) {
+      frames[n].data = st->rbuf + off + hlen;
+      frames[n++].len = len;
+      off += hlen + len;
+    }
+    if (n == VMNET_SWITCH_BATCH || (!complete && n > 0)) {
+      vmnet_switch_input(st->sw, st->port_no, frames, n, now);
+      n = 0;
+    }
+    if (!complete)
+      break;
+  }
+  memmove(st->rbuf, st->rbuf + off, st->rlen - off);
+  st->rlen -= off;
+  return ok;
+}
+
+/* The thread serving the socket.  It runs unlocked and takes the switch
+   lock for each step; it frees everything once the port has been
+   removed.  Only the thread reads from the connection or changes it. */
+static void *
+stream_thread(void *arg)
+{
+  struct vmnet_stream *st = arg;
+  struct vmnet_switch *sw = st->sw;
+  for (;;) {
+    struct pollfd pfd[2];
+    pthread_mutex_lock(&sw->lock);
+    if (st->stopping) {
+      pthread_mutex_unlock(&sw->lock);
+      break;
+    }
+    int conn = st->conn_fd;
+    pfd[1].events = POLLIN | (st->wlen > 0 ? POLLOUT : 0);
+    pthread_mutex_unlock(&sw->lock);
+
+    pfd[0].fd = st->wake[0];
+    pfd[0].events = POLLIN;
+    pfd[1].fd = conn >= 0 ? conn : st->listen_fd;
+    if (poll(pfd, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (pfd[0].revents) {
+      char c[64];
+      ssize_t k;
+      while ((k = read(st->wake[0], c, sizeof(c))) < 0 && errno == EINTR);
+      if (k <= 0 || memchr(c, STREAM_WAKE_STOP, k))
+        break;
+      /* Otherwise POLLOUT is armed on the way round */
+    }
+    if (!pfd[1].revents)
+      continue;
+
+    if (conn < 0) {
+      int fd = accept(st->listen_fd, NULL, NULL);
+      if (fd < 0)
+        continue;
+      stream_tune(fd);
+      if (st->proto == STREAM_VPNKIT && !vpnkit_handshake(st, fd)) {
+        close(fd);
+        continue;
+      }
+      pthread_mutex_lock(&sw->lock);
+      st->conn_fd = fd;
+      pthread_mutex_unlock(&sw->lock);
+      continue;
+    }
+
+    int ok = 1;
+    size_t room = STREAM_RBUF - st->rlen;
+    ssize_t r = 0;
+    if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+      while ((r = recv(conn, st->rbuf + st->rlen, room, MSG_DONTWAIT)) < 0 &&
+             errno == EINTR);
+      ok = r > 0 || (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+    pthread_mutex_lock(&sw->lock);
+    if (!st->stopping) {
+      if (r > 0) {
+        st->rlen += r;
+        ok = stream_input(st);
+      }
+      if (ok && (pfd[1].revents & POLLOUT))
+        ok = stream_flush(st);
+      if (!ok)
+        stream_disconnect(st);
+    }
+    pthread_mutex_unlock(&sw->lock);
+  }
+  pthread_mutex_lock(&sw->lock);
+  stream_disconnect(st);
+  pthread_mutex_unlock(&sw->lock);
+  vmnet_switch_unlink(st->listen_fd);
+  close(st->listen_fd);
+  close(st->wake[0]);
+  close(st->wake[1]);
+  free(st->rbuf);
+  free(st->wbuf);
+  free(st);
+  vmnet_switch_release(sw);
+  return NULL;
+}
+
+/* Called with the switch locked when the port is removed: the thread
+   notices and cleans up */
+static void
+stream_detach(void *ctx)
+{
+  struct vmnet_stream *st = ctx;
+  st->stopping = 1;
+  stream_wake(st, STREAM_WAKE_STOP);
+}
+
+/* Serve the framing [v_proto] on the listening socket [v_fd], which is
+   taken over, as a new port of [v_sw].  vpnkit clients are told to use
+   [v_mtu] and the MAC address [v_mac].  Returns the port number, or -1 if
+   the switch is full. */
+CAMLprim value
+caml_vmnet_switch_add_stream(value v_sw, value v_fd, value v_proto,
+                             value v_mtu, value v_mac)
+{
+  CAMLparam5(v_sw, v_fd, v_proto, v_mtu, v_mac);
+  struct vmnet_switch *sw = Vmnet_switch_val(v_sw);
+  if (Long_val(v_mtu) < 68 || Long_val(v_mtu) > STREAM_FRAME_MAX - 18 ||
+      caml_string_length(v_mac) != 6)
+    caml_invalid_argument("Vmnet.Switch.add_stream_port");
+  struct vmnet_stream *st = calloc(1, sizeof(struct vmnet_stream));
+  uint8_t *rbuf = malloc(STREAM_RBUF);
+  uint8_t *wbuf = malloc(STREAM_WBUF);
+  if (!st || !rbuf || !wbuf) {
+    free(st);
+    free(rbuf);
+    free(wbuf);
+    caml_raise_out_of_memory();
+  }
+  if (pipe(st->wake) < 0) {
+    free(st);
+    free(rbuf);
+    free(wbuf);
+    caml_failwith("pipe failed unexpectedly");
+  }
+  fcntl(st->wake[1], F_SETFL, O_NONBLOCK);
+  st->sw = sw;
+  st->listen_fd = Int_val(v_fd);
+  st->conn_fd = -1;
+  st->proto = Int_val(v_proto);
+  st->hlen = st->proto == STREAM_QEMU ? 4 : 2;
+  st->mtu = Long_val(v_mtu);
+  memcpy(st->mac, String_val(v_mac), 6);
+  st->rbuf = rbuf;
+  st->wbuf = wbuf;
+  pthread_mutex_lock(&sw->lock);
+  int port = vmnet_switch_add_port(sw, stream_output, st);
+  if (port >= 0) {
+    st->port = &sw->ports[port];
+    st->port_no = port;
+    st->port->detach = stream_detach;
+  }
+  pthread_mutex_unlock(&sw->lock);
+  pthread_t thread;
+  if (port >= 0) {
+    vmnet_switch_retain(sw);
+    if (pthread_create(&thread, NULL, stream_thread, st) == 0) {
+      pthread_detach(thread);
+      CAMLreturn(Val_int(port));
+    }
+    vmnet_switch_release(sw);
+    pthread_mutex_lock(&sw->lock);
+    st->port->detach = NULL;
+    vmnet_switch_remove_port(sw, port);
+    pthread_mutex_unlock(&sw->lock);
+  }
+  close(st->wake[0]);
+  close(st->wake[1]);
+  free(rbuf);
+  free(wbuf);
+  free(st);
+  if (port >= 0)
+    caml_failwith("Vmnet.Switch.add_stream_port: cannot start thread");
+  CAMLreturn(Val_int(-1));
+}
@@ -21,6 +21,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
 #include <errno.h>
 #include <err.h>
 
@@ -34,6 +37,8 @@
 #include <caml/threads.h>
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <sys/uio.h>
 #include <dispatch/dispatch.h>
 #include <vmnet/vmnet.h>
@@ -41,6 +46,12 @@
 #include <availability.h>
 #include <uuid/uuid.h>
 
+#include "vmnet_fanout.h"
+#include "vmnet_packet.h"
+#include "vmnet_ring.h"
+#include "vmnet_switch.h"
+#include "vmnet_tx.h"
+
 static struct custom_operations vmnet_state_ops = {
   "org.openmirage.vmnet.vmnet_state",
   custom_finalize_default,
@@ -50,12 +61,86 @@ static struct custom_operations vmnet_state_ops = {
   custom_deserialize_default
 };
 
+#define VMNET_RXQ_MAX 16
+#define VMNET_RSS_TABLE_MAX 128
+
+/* A receive queue: frames waiting to be read, and the coalescing state of
+   the flows being merged into it */
+struct vmnet_rxq {
+  struct vmnet_ring ring;
+  struct vmnet_gro gro;
+  uint64_t dropped;     /* frames lost because the queue was full */
+};
+
+/* Frames whose EtherType (after one VLAN tag) matches [ethertype], or any
+   if it is -1, and whose destination matches [dst] go to [queue] */
+#define VMNET_DST_ANY        0
+#define VMNET_DST_MAC        1
+#define VMNET_DST_BROADCAST  2
+#define VMNET_DST_MULTICAST  3
+
+struct vmnet_demux_rule {
+  int ethertype;
+  int dst;
+  unsigned char mac[6];
+  int queue;
+};
+
 struct vmnet_state {
   interface_ref iref;
   pthread_mutex_t vmm;
   pthread_cond_t vmc;
   int last_event; /* incremented when an event is received */
   int seen_event; /* last event we saw */
+  int tx_csum; /* fill in IPv4/TCP/UDP checksums before writing */
+  int offload; /* vmnet does checksums and TCP segmentation */
+  unsigned int mtu;
+  unsigned int max_packet_size;
+  /* Receive pipeline.  Once enabled, frames are read from vmnet in batches
+     (from the event callback when there is one), filtered, sorted into
+     [rxq] and coalesced there, and OCaml reads are served from the
+     queues. */
+  pthread_mutex_t rxm;  /* protects the fields below */
+  int nrxq;             /* 0 while the pipeline is off */
+  struct vmnet_rxq rxq[VMNET_RXQ_MAX];
+  unsigned rx_slots;    /* per queue, or 0 for the default */
+  uint8_t *rx_scratch;  /* VMNET_READ_BATCH buffers for vmnet_read */
+  int rx_gro;           /* coalesce TCP segments */
+  struct vmnet_bpf_insn *filter; /* frames it rejects are dropped */
+  struct vmnet_binding *respond; /* ARP and ping are answered for these */
+  size_t nrespond;
+  struct vmnet_demux_rule *demux; /* first match wins, else queue 0 */
+  size_t ndemux;
+  /* Frames matching no demux rule are spread by flow hash when rss_size
+     (a power of two) is not 0 */
+  uint8_t rss_key[VMNET_RSS_KEY_LEN];
+  uint8_t rss_table[VMNET_RSS_TABLE_MAX];
+  unsigned rss_size;
+  uint64_t rx_frames;   /* read from vmnet */
+  uint64_t rx_accepted; /* passed by the filter */
+  uint64_t rx_dropped;  /* rejected by the filter */
+  uint64_t rx_answered; /* answered by the responder */
+  int borrow_checks;    /* catch borrowed frames used after release */
+  /* When the interface is a port of a switch, everything it receives is
+     switched from the event callback and OCaml reads see nothing */
+  struct vmnet_switch *sw; /* protected by rxm */
+  int sw_port;
+  uint8_t *sw_scratch;  /* also used when cross-connected */
+  /* When the interface is cross-connected, everything it receives is
+     written to [xc_peer] from the event callback instead */
+  struct vmnet_state *xc_peer; /* protected by rxm */
+  uint64_t xc_forwarded;
+  uint64_t xc_dropped;  /* the peer did not take them */
+  int handler_set;      /* the event callback is installed */
+  int stopped;          /* vmnet_stop_interface was called */
+  /* Frames written from OCaml go through the shaper when it is enabled */
+  struct vmnet_tx tx;
+  /* Frames read, and written if fanout_tx, are copied to the fan-out
+     file mapped here */
+  pthread_mutex_t fom;  /* protects the fields below */
+  void *fanout;
+  size_t fanout_size;
+  int fanout_tx;
 };
 
 #define Vmnet_state_val(v) (*((struct vmnet_state **) Data_custom_val(v)))
@@ -70,28 +155,198 @@ caml_raise_api_not_supported () {
   caml_raise_constant(*v_exc);
 }
 
+static int vmnet_tx_output_iface(void *ctx, const struct vmnet_tx_frame *frames,
+                                 int n);
+
 static value
-alloc_vmnet_state(interface_ref i)
+alloc_vmnet_state(interface_ref i, unsigned int max_packet_size)
 {
   value v = alloc_custom(&vmnet_state_ops, sizeof(struct vmnet_state *), 0, 1);
-  struct vmnet_state *vms = malloc(sizeof(struct vmnet_state));
+  struct vmnet_state *vms = calloc(1, sizeof(struct vmnet_state));
   if (!vms)
      caml_raise_out_of_memory();
   vms->iref = i;
   pthread_mutex_init(&vms->vmm, NULL);
   pthread_cond_init(&vms->vmc, NULL);
+  pthread_mutex_init(&vms->rxm, NULL);
+  pthread_mutex_init(&vms->tx.lock, NULL);
+  pthread_mutex_init(&vms->fom, NULL);
+  vms->tx.output = vmnet_tx_output_iface;
+  vms->tx.ctx = vms;
+  vms->tx.busy = (-1)*(int32_t)VMNET_BUFFER_EXHAUSTED;
+  vms->tx.nclasses = 1;
   vms->seen_event = 0;
   vms->last_event = 0;
+  vms->tx_csum = 0;
+  vms->max_packet_size = max_packet_size;
   Vmnet_state_val(v) = vms;
   return v;
 }
 
+/* An in-flight vmnet operation.  vmnet reports completion from a dispatch
+   queue, so the completion block writes a byte to a socketpair once every
+   outstanding callback has fired.  The OCaml side can then either block on
+   the read end with the runtime lock released, or hand it to an event loop
+   such as Lwt.  The structure is shared between the OCaml handle and the
+   callbacks and is freed when the last of them lets go of it. */
+struct vmnet_op {
+  int refs;          /* OCaml handle + one for all pending callbacks */
+  int remaining;     /* completions still outstanding */
+  int rfd;           /* readable once the operation completed */
+  int wfd;           /* written (and closed) by the last completion */
+  vmnet_return_t status;
+  /* vmnet_start_interface */
+  interface_ref iface;
+  int claimed;       /* iface has been handed over to OCaml */
+  unsigned char mac[6];
+  unsigned int mtu;
+  unsigned int max_packet_size;
+  int offload;       /* checksum and TSO offload were asked for */
+  uuid_t uuid;
+  /* one status per request of a bulk operation */
+  size_t nstatus;
+  vmnet_return_t *statuses;
+  /* vmnet_interface_get_port_forwarding_rules */
+  xpc_object_t rules;
+};
+
+#define Vmnet_op_val(v) (*((struct vmnet_op **) Data_custom_val(v)))
+
+static void
+vmnet_op_release(struct vmnet_op *op)
+{
+  if (__sync_sub_and_fetch(&op->refs, 1) != 0)
+    return;
+  if (op->iface != NULL && !op->claimed && op->status == VMNET_SUCCESS) {
+    /* Nobody collected the interface (e.g. the caller timed out) */
+    dispatch_queue_t q = dispatch_queue_create("org.openmirage.vmnet.stop", DISPATCH_QUEUE_SERIAL);
+    vmnet_stop_interface(op->iface, q, ^(vmnet_return_t status) {
+      dispatch_release(q);
+    });
+  }
+  if (op->rules != NULL)
+    xpc_release(op->rules);
+  free(op->statuses);
+  free(op);
+}
+
+static void
+vmnet_op_complete(struct vmnet_op *op)
+{
+  if (__sync_sub_and_fetch(&op->remaining, 1) != 0)
+    return;
+  char c = 0;
+  while (write(op->wfd, &c, 1) < 0 && errno == EINTR);
+  close(op->wfd);
+  vmnet_op_release(op);
+}
+
+static void
+vmnet_op_finalize(value v_op)
+{
+  struct vmnet_op *op = Vmnet_op_val(v_op);
+  close(op->rfd);
+  vmnet_op_release(op);
+}
+
+static struct custom_operations vmnet_op_ops = {
+  "org.openmirage.vmnet.vmnet_op",
+  vmnet_op_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static value
+alloc_vmnet_op(int remaining, size_t nstatus)
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    caml_failwith("socketpair failed unexpectedly");
+  int on = 1;
+  /* The OCaml side may close its end before the completion arrives */
+  setsockopt(fds[1], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+  struct vmnet_op *op = calloc(1, sizeof(struct vmnet_op));
+  vmnet_return_t *statuses = calloc(nstatus ? nstatus : 1, sizeof(vmnet_return_t));
+  if (!op || !statuses) {
+    free(op);
+    free(statuses);
+    close(fds[0]);
+    close(fds[1]);
+    caml_raise_out_of_memory();
+  }
+  op->refs = 2;
+  op->remaining = remaining;
+  op->nstatus = nstatus;
+  op->statuses = statuses;
+  op->rfd = fds[0];
+  op->wfd = fds[1];
+  value v = caml_alloc_custom(&vmnet_op_ops, sizeof(struct vmnet_op *), 0, 1);
+  Vmnet_op_val(v) = op;
+  return v;
+}
+
+static int
+vmnet_op_is_complete(struct vmnet_op *op)
+{
+  return __sync_fetch_and_add(&op->remaining, 0) <= 0;
+}
+
 CAMLprim value
-caml_init_vmnet(value v_mode, value v_iface, value v_existing_uuid,
-		value v_ipv4_config)
+caml_vmnet_op_fd(value v_op)
 {
-  CAMLparam4(v_mode, v_iface, v_existing_uuid, v_ipv4_config);
-  CAMLlocal4(v_iface_ref, v_res, v_mac, v_uuid);
+  return Val_int(Vmnet_op_val(v_op)->rfd);
+}
+
+/* Block for at most [v_timeout_ms] milliseconds (forever if negative) until
+   the operation completes, without holding the runtime lock. */
+CAMLprim value
+caml_vmnet_op_wait(value v_op, value v_timeout_ms)
+{
+  CAMLparam2(v_op, v_timeout_ms);
+  struct vmnet_op *op = Vmnet_op_val(v_op);
+  struct pollfd pfd = { op->rfd, POLLIN, 0 };
+  int timeout_ms = Int_val(v_timeout_ms);
+  int r;
+  if (vmnet_op_is_complete(op))
+    CAMLreturn(Val_true);
+  caml_release_runtime_system();
+  do {
+    r = poll(&pfd, 1, timeout_ms);
+  } while (r < 0 && errno == EINTR);
+  caml_acquire_runtime_system();
+  CAMLreturn(Val_bool(vmnet_op_is_complete(op)));
+}
+
+static void
+vmnet_op_check_complete(struct vmnet_op *op)
+{
+  if (!vmnet_op_is_complete(op))
+    caml_invalid_argument("Vmnet: operation has not completed");
+}
+
+CAMLprim value
+caml_vmnet_op_statuses(value v_op)
+{
+  CAMLparam1(v_op);
+  CAMLlocal1(v_res);
+  struct vmnet_op *op = Vmnet_op_val(v_op);
+  vmnet_op_check_complete(op);
+  if (op->nstatus == 0)
+    CAMLreturn(Atom(0));
+  v_res = caml_alloc(op->nstatus, 0);
+  for (size_t i = 0; i < op->nstatus; i++)
+    Store_field(v_res, i, Val_int(op->statuses[i]));
+  CAMLreturn(v_res);
+}
+
+CAMLprim value
+caml_init_vmnet_start(value v_mode, value v_iface, value v_existing_uuid,
+		value v_ipv4_config, value v_offload)
+{
+  CAMLparam5(v_mode, v_iface, v_existing_uuid, v_ipv4_config, v_offload);
+  CAMLlocal1(v_op);
   xpc_object_t interface_desc = xpc_dictionary_create(NULL, NULL, 0);
   xpc_dictionary_set_uint64(interface_desc, vmnet_operation_mode_key, Int_val(v_mode));
 
@@ -113,65 +368,146 @@ caml_init_vmnet(value v_mode, value v_iface, value v_existing_uuid,
   }
   #endif
 
-  uuid_t uuid;
-  memcpy(&uuid, Bytes_val(v_existing_uuid), sizeof(uuid_t));
-  if (uuid_is_null(uuid) == 1) {
-    uuid_generate_random(uuid);  
-  }
-  xpc_dictionary_set_uuid(interface_desc, vmnet_interface_id_key, uuid);
-
-  __block interface_ref iface = NULL;
-  __block vmnet_return_t iface_status = 0;
-  __block unsigned char *mac = malloc(6);
-  if (!mac) caml_raise_out_of_memory ();
-  __block unsigned int mtu = 0;
-  __block unsigned int max_packet_size = 0;
+  v_op = alloc_vmnet_op(1, 0);
+  struct vmnet_op *op = Vmnet_op_val(v_op);
+
+  #if __MAC_OS_X_VERSION_MAX_ALLOWED >= 120000
+  if (Bool_val(v_offload)) {
+    if (__builtin_available(macOS 12.0, *)) {
+      xpc_dictionary_set_bool(interface_desc, vmnet_enable_checksum_offload_key, true);
+      xpc_dictionary_set_bool(interface_desc, vmnet_enable_tso_key, true);
+      op->offload = 1;
+    }
+  }
+  #endif
+
+  memcpy(&op->uuid, Bytes_val(v_existing_uuid), sizeof(uuid_t));
+  if (uuid_is_null(op->uuid) == 1) {
+    uuid_generate_random(op->uuid);
+  }
+  xpc_dictionary_set_uuid(interface_desc, vmnet_interface_id_key, op->uuid);
+
   dispatch_queue_t if_create_q = dispatch_queue_create("org.openmirage.vmnet.create", DISPATCH_QUEUE_SERIAL);
-  dispatch_semaphore_t iface_created = dispatch_semaphore_create(0);
-  iface = vmnet_start_interface(interface_desc, if_create_q,
+  op->iface = vmnet_start_interface(interface_desc, if_create_q,
     ^(vmnet_return_t status, xpc_object_t interface_param) {
-      iface_status = status;
-      if (status != VMNET_SUCCESS || !interface_param) {
-         dispatch_semaphore_signal(iface_created);
-         return;
-      }
-      //printf("mac desc: %s\n", xpc_copy_description(xpc_dictionary_get_value(interface_param, vmnet_mac_address_key)));
-      const char *macStr = xpc_dictionary_get_string(interface_param, vmnet_mac_address_key);
-      if (macStr != NULL) {
-        unsigned char lmac[6];
-        if (sscanf(macStr, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &lmac[0], &lmac[1], &lmac[2], &lmac[3], &lmac[4], &lmac[5]) != 6)
-          errx(1, "Unexpected MAC address received from vmnet");
-        memcpy(mac, lmac, 6);
-      } else {
-        // Mac key is not set if vmnet_allocate_mac_address_key is false
-        memset(mac, 0, 6); // 00:00:00:00:00:00
+      op->status = status;
+      if (status == VMNET_SUCCESS && interface_param) {
+        //printf("mac desc: %s\n", xpc_copy_description(xpc_dictionary_get_value(interface_param, vmnet_mac_address_key)));
+        const char *macStr = xpc_dictionary_get_string(interface_param, vmnet_mac_address_key);
+        if (macStr != NULL) {
+          unsigned char lmac[6];
+          if (sscanf(macStr, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &lmac[0], &lmac[1], &lmac[2], &lmac[3], &lmac[4], &lmac[5]) != 6)
+            errx(1, "Unexpected MAC address received from vmnet");
+          memcpy(op->mac, lmac, 6);
+        } else {
+          // Mac key is not set if vmnet_allocate_mac_address_key is false
+          memset(op->mac, 0, 6); // 00:00:00:00:00:00
+        }
+
+        op->mtu = xpc_dictionary_get_uint64(interface_param, vmnet_mtu_key);
+        op->max_packet_size = xpc_dictionary_get_uint64(interface_param, vmnet_max_packet_size_key);
+      } else if (status == VMNET_SUCCESS) {
+        op->status = VMNET_FAILURE;
       }
-      
-      mtu = xpc_dictionary_get_uint64(interface_param, vmnet_mtu_key);
-      max_packet_size = xpc_dictionary_get_uint64(interface_param, vmnet_max_packet_size_key);
-      dispatch_semaphore_signal(iface_created);
+      dispatch_release(if_create_q);
+      vmnet_op_complete(op);
     });
-  dispatch_semaphore_wait(iface_created, DISPATCH_TIME_FOREVER);
-  dispatch_release(if_create_q);
-  if (iface == NULL || iface_status != VMNET_SUCCESS) {
+  xpc_release(interface_desc);
+  CAMLreturn(v_op);
+}
+
+CAMLprim value
+caml_init_vmnet_result(value v_op)
+{
+  CAMLparam1(v_op);
+  CAMLlocal4(v_iface_ref, v_res, v_mac, v_uuid);
+  struct vmnet_op *op = Vmnet_op_val(v_op);
+  vmnet_op_check_complete(op);
+  if (op->iface == NULL || op->status != VMNET_SUCCESS) {
      value *v_exc = caml_named_value("vmnet_raw_return");
      if (!v_exc)
        caml_failwith("Vmnet.Error exception not registered");
-     caml_raise_with_arg(*v_exc, Val_int(iface_status));
+     caml_raise_with_arg(*v_exc, Val_int(op->status ? op->status : VMNET_FAILURE));
   }
-  v_iface_ref = alloc_vmnet_state(iface);
+  if (op->claimed)
+    caml_invalid_argument("Vmnet: interface already collected");
+  /* With TSO, vmnet passes frames of up to 64k both ways */
+  if (op->offload && op->max_packet_size < VMNET_GRO_SLOT)
+    op->max_packet_size = VMNET_GRO_SLOT;
+  v_iface_ref = alloc_vmnet_state(op->iface, op->max_packet_size);
+  Vmnet_state_val(v_iface_ref)->offload = op->offload;
+  Vmnet_state_val(v_iface_ref)->mtu = op->mtu;
+  op->claimed = 1;
   v_mac = caml_alloc_string(6);
-  memcpy(String_val(v_mac),mac,6);
-  v_res = caml_alloc_tuple(5);
-  v_uuid = caml_alloc_initialized_string(sizeof(uuid_t), (char *)uuid);
+  memcpy(Bytes_val(v_mac), op->mac, 6);
+  v_res = caml_alloc_tuple(6);
+  v_uuid = caml_alloc_initialized_string(sizeof(uuid_t), (char *)op->uuid);
   Field(v_res,0) = v_iface_ref;
   Field(v_res,1) = v_mac;
-  Field(v_res,2) = Val_int(mtu);
-  Field(v_res,3) = Val_int(max_packet_size);
+  Field(v_res,2) = Val_int(op->mtu);
+  Field(v_res,3) = Val_int(op->max_packet_size);
   Field(v_res,4) = v_uuid;
+  Field(v_res,5) = Val_bool(op->offload);
   CAMLreturn(v_res);
 }
 
+/* Start stopping the interface.  The event callback is removed first so
+   that nothing reads from it once vmnet has let go of it; from then on
+   reads, writes and rule changes fail with VMNET_INVALID_ARGUMENT and
+   threads in caml_wait_for_event return.  Stopping it again completes at
+   once. */
+CAMLprim value
+caml_vmnet_stop_start(value v_vmnet)
+{
+  CAMLparam1(v_vmnet);
+  CAMLlocal1(v_op);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  pthread_mutex_lock(&vms->rxm);
+  int attached = vms->sw != NULL || vms->xc_peer != NULL;
+  pthread_mutex_unlock(&vms->rxm);
+  if (attached)
+    caml_invalid_argument("Vmnet.stop: interface is switched or cross-connected");
+  v_op = alloc_vmnet_op(1, 0);
+  struct vmnet_op *op = Vmnet_op_val(v_op);
+  op->status = VMNET_SUCCESS;
+
+  pthread_mutex_lock(&vms->vmm);
+  int stopped = vms->stopped;
+  int handler_set = vms->handler_set;
+  vms->stopped = 1;
+  pthread_cond_broadcast(&vms->vmc);
+  pthread_mutex_unlock(&vms->vmm);
+  if (stopped) {
+    vmnet_op_complete(op);
+    CAMLreturn(v_op);
+  }
+  if (handler_set)
+    vmnet_interface_set_event_callback(vms->iref,
+      VMNET_INTERFACE_PACKETS_AVAILABLE, NULL, NULL);
+
+  dispatch_queue_t q = dispatch_queue_create("org.openmirage.vmnet.stop", DISPATCH_QUEUE_SERIAL);
+  vmnet_return_t res = vmnet_stop_interface(vms->iref, q, ^(vmnet_return_t status) {
+    op->status = status;
+    dispatch_release(q);
+    vmnet_op_complete(op);
+  });
+  if (res != VMNET_SUCCESS) {
+    // Failed to queue vmnet command
+    dispatch_release(q);
+    op->status = res;
+    vmnet_op_complete(op);
+  }
+  CAMLreturn(v_op);
+}
+
+CAMLprim value
+caml_vmnet_stop_result(value v_op)
+{
+  struct vmnet_op *op = Vmnet_op_val(v_op);
+  vmnet_op_check_complete(op);
+  return Val_int(op->status);
+}
+
 CAMLprim value
 caml_shared_interface_list (void) {
   CAMLparam0();
@@ -202,38 +538,425 @@ caml_shared_interface_list (void) {
   #endif
 }
 
-CAMLprim value
-caml_set_event_handler(value v_vmnet)
+/* Most packets asked from vmnet_read in one call */
+#define VMNET_READ_BATCH 32
+
+/* Receive ring sizes for plain and coalesced frames */
+#define VMNET_RX_SLOTS     256
+#define VMNET_RX_GRO_SLOTS 64
+
+/* Copy [n] frames that went [dir] to the fan-out file, if there is one.
+   Consumers are never waited for. */
+static void
+vmnet_fanout_pkts(struct vmnet_state *vms, const struct vmpktdesc *pkts, int n,
+                  int dir)
+{
+  if (n <= 0 || __atomic_load_n(&vms->fanout, __ATOMIC_ACQUIRE) == NULL)
+    return;
+  uint64_t now = vmnet_switch_now();
+  pthread_mutex_lock(&vms->fom);
+  if (vms->fanout && (dir == VMNET_FANOUT_RX || vms->fanout_tx))
+    for (int i = 0; i < n; i++)
+      vmnet_fanout_publish(vms->fanout, pkts[i].vm_pkt_iov->iov_base,
+                           pkts[i].vm_pkt_size, dir, now);
+  pthread_mutex_unlock(&vms->fom);
+}
+
+/* Read up to [n] packets in batches.  Returns the number of packets read,
+   or the negated vmnet_return_t if the first batch failed. */
+static int
+vmnet_read_pkts(struct vmnet_state *vms, struct vmpktdesc *pkts, int n)
+{
+  int got = 0;
+  while (got < n) {
+    int pktcnt = n - got;
+    if (pktcnt > VMNET_READ_BATCH)
+      pktcnt = VMNET_READ_BATCH;
+    int want = pktcnt;
+    if (vms->stopped)
+      return got ? got : (-1)*(int32_t)VMNET_INVALID_ARGUMENT;
+    vmnet_return_t res = vmnet_read(vms->iref, pkts + got, &pktcnt);
+    if (res != VMNET_SUCCESS)
+      return got ? got : (-1)*(int32_t)res;
+    vmnet_fanout_pkts(vms, pkts + got, pktcnt, VMNET_FANOUT_RX);
+    got += pktcnt;
+    if (pktcnt < want)
+      break;
+  }
+  return got;
+}
+
+static unsigned
+vmnet_rx_default_slots(struct vmnet_state *vms, size_t slot_size)
+{
+  if (vms->rx_slots)
+    return vms->rx_slots;
+  return slot_size > vms->max_packet_size ? VMNET_RX_GRO_SLOTS : VMNET_RX_SLOTS;
+}
+
+/* Replace the receive queues with [nq] queues of at least [nslots] slots
+   of [slot_size] bytes.  Frames already queued are kept, those of queues
+   that go away ending up in the last one.  Called with rxm held. */
+static int
+vmnet_rx_configure(struct vmnet_state *vms, int nq, unsigned nslots,
+                   size_t slot_size)
+{
+  struct vmnet_rxq q[VMNET_RXQ_MAX];
+  unsigned need[VMNET_RXQ_MAX];
+  if (!vms->rx_scratch) {
+    vms->rx_scratch = malloc((size_t)VMNET_READ_BATCH * vms->max_packet_size);
+    if (!vms->rx_scratch)
+      return 0;
+  }
+  memset(q, 0, sizeof(q));
+  memset(need, 0, sizeof(need));
+  for (int i = 0; i < vms->nrxq; i++)
+    need[i < nq ? i : nq - 1] += vmnet_ring_count(&vms->rxq[i].ring);
+  for (int i = 0; i < nq; i++) {
+    unsigned n = nslots;
+    while (n < need[i])
+      n *= 2;
+    if (!vmnet_ring_init(&q[i].ring, n, slot_size)) {
+      while (i-- > 0)
+        vmnet_ring_free(&q[i].ring);
+      return 0;
+    }
+  }
+  for (int i = 0; i < vms->nrxq; i++) {
+    struct vmnet_rxq *to = &q[i < nq ? i : nq - 1];
+    vmnet_ring_move(&to->ring, &vms->rxq[i].ring);
+    to->dropped += vms->rxq[i].dropped;
+    to->gro.merged += vms->rxq[i].gro.merged;
+    vmnet_ring_free(&vms->rxq[i].ring);
+  }
+  memcpy(vms->rxq, q, sizeof(q));
+  vms->nrxq = nq;
+  return 1;
+}
+
+/* Turn the pipeline on if needed, with slots of at least [slot_size]
+   bytes.  Called with rxm held. */
+static int
+vmnet_rx_enable(struct vmnet_state *vms, size_t slot_size)
+{
+  if (vms->nrxq > 0 && vms->rxq[0].ring.slot_size >= slot_size)
+    return 1;
+  return vmnet_rx_configure(vms, vms->nrxq ? vms->nrxq : 1,
+                            vmnet_rx_default_slots(vms, slot_size), slot_size);
+}
+
+static int
+vmnet_rx_classify(struct vmnet_state *vms, const uint8_t *frame, size_t len)
+{
+  static const unsigned char broadcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+  if (len < VMNET_ETH_HLEN)
+    return 0;
+  int ethertype = vmnet_get_be16(frame + 12);
+  if (ethertype == VMNET_ETHERTYPE_VLAN && len >= VMNET_ETH_HLEN + 4)
+    ethertype = vmnet_get_be16(frame + 16);
+  for (size_t i = 0; i < vms->ndemux; i++) {
+    struct vmnet_demux_rule *r = &vms->demux[i];
+    if (r->ethertype >= 0 && r->ethertype != ethertype)
+      continue;
+    switch (r->dst) {
+    case VMNET_DST_MAC:
+      if (memcmp(frame, r->mac, 6) != 0)
+        continue;
+      break;
+    case VMNET_DST_BROADCAST:
+      if (memcmp(frame, broadcast, 6) != 0)
+        continue;
+      break;
+    case VMNET_DST_MULTICAST:
+      if (!(frame[0] & 1) || memcmp(frame, broadcast, 6) == 0)
+        continue;
+      break;
+    }
+    return r->queue;
+  }
+  if (vms->rss_size) {
+    uint32_t hash = vmnet_rss_hash(vms->rss_key, frame, len);
+    int q = vms->rss_table[hash & (vms->rss_size - 1)];
+    return q < vms->nrxq ? q : 0;
+  }
+  return 0;
+}
+
+static int vmnet_write_pkts(struct vmnet_state *vms, struct vmpktdesc *pkts,
+                            int n);
+
+/* Read one batch from vmnet into the queues.  As many frames are read as
+   the emptiest queue can take; frames for a queue that is full are
+   dropped, and those the responder answers are not queued at all.  The
+   frames are stamped with [now].  Called with rxm held; returns the number
+   of frames read or the negated vmnet_return_t. */
+static int
+vmnet_rx_refill(struct vmnet_state *vms, uint64_t now)
+{
+  struct iovec iov[VMNET_READ_BATCH];
+  struct vmpktdesc pkts[VMNET_READ_BATCH];
+  unsigned space = 0;
+  for (int q = 0; q < vms->nrxq; q++)
+    if (vmnet_ring_space(&vms->rxq[q].ring) > space)
+      space = vmnet_ring_space(&vms->rxq[q].ring);
+  int n = space < VMNET_READ_BATCH ? (int)space : VMNET_READ_BATCH;
+  for (int i = 0; i < n; i++) {
+    iov[i].iov_base = vms->rx_scratch + (size_t)i * vms->max_packet_size;
+    iov[i].iov_len = vms->max_packet_size;
+    pkts[i].vm_pkt_size = vms->max_packet_size;
+    pkts[i].vm_pkt_iov = &iov[i];
+    pkts[i].vm_pkt_iovcnt = 1;
+    pkts[i].vm_flags = 0;
+  }
+  int pktcnt = n;
+  if (vms->stopped)
+    return (-1)*(int32_t)VMNET_INVALID_ARGUMENT;
+  vmnet_return_t res = n ? vmnet_read(vms->iref, pkts, &pktcnt) : VMNET_SUCCESS;
+  if (res != VMNET_SUCCESS)
+    return (-1)*(int32_t)res;
+  vms->rx_frames += pktcnt;
+  vmnet_fanout_pkts(vms, pkts, pktcnt, VMNET_FANOUT_RX);
+  int nreply = 0;
+  for (int i = 0; i < pktcnt; i++) {
+    uint8_t *frame = iov[i].iov_base;
+    size_t len = pkts[i].vm_pkt_size;
+    if (vms->nrespond) {
+      /* Replies are built in place and written once the batch is done */
+      size_t reply = vmnet_respond(vms->respond, vms->nrespond, frame, len);
+      if (reply > 0) {
+        iov[nreply].iov_base = frame;
+        iov[nreply].iov_len = reply;
+        pkts[nreply].vm_pkt_size = reply;
+        pkts[nreply].vm_pkt_iov = &iov[nreply];
+        pkts[nreply].vm_flags = 0;
+        nreply++;
+        continue;
+      }
+    }
+    if (vms->filter) {
+      uint32_t keep = vmnet_bpf_run(vms->filter, frame, len);
+      if (keep == 0) {
+        vms->rx_dropped++;
+        continue;
+      }
+      vms->rx_accepted++;
+      if (keep < len)
+        len = keep;
+    }
+    struct vmnet_rxq *q = &vms->rxq[vmnet_rx_classify(vms, frame, len)];
+    int queued;
+    if (vms->rx_gro)
+      queued = vmnet_gro_input(&q->gro, &q->ring, frame, len);
+    else
+      queued = vmnet_ring_push(&q->ring, frame, len);
+    if (!queued)
+      q->dropped++;
+  }
+  for (int q = 0; q < vms->nrxq; q++) {
+    struct vmnet_ring *r = &vms->rxq[q].ring;
+    if (vms->rx_gro)
+      vmnet_gro_flush(&vms->rxq[q].gro, r);
+    for (unsigned i = r->head; i != r->fill; i++)
+      vmnet_ring_meta(r, i)->ts = now;
+    vmnet_ring_commit(r);
+  }
+  if (nreply > 0) {
+    vms->rx_answered += nreply;
+    vmnet_write_pkts(vms, pkts, nreply);
+  }
+  return pktcnt;
+}
+
+/* Bit i is set if queue i has frames waiting.  Called with rxm held. */
+static int
+vmnet_rx_ready(struct vmnet_state *vms)
+{
+  int mask = 0;
+  for (int q = 0; q < vms->nrxq; q++)
+    if (vmnet_ring_count(&vms->rxq[q].ring) > 0)
+      mask |= 1 << q;
+  return mask;
+}
+
+/* Called from the event callback: drain vmnet into the queues if the
+   pipeline is on.  The first batch is stamped with [now], when the event
+   fired.  Returns whether OCaml should be woken up. */
+static int
+vmnet_rx_poll(struct vmnet_state *vms, uint64_t now)
+{
+  int wake = 1;
+  pthread_mutex_lock(&vms->rxm);
+  if (vms->nrxq > 0) {
+    while (vmnet_rx_refill(vms, now) == VMNET_READ_BATCH)
+      now = vmnet_switch_now();
+    wake = vmnet_rx_ready(vms) != 0;
+  }
+  pthread_mutex_unlock(&vms->rxm);
+  return wake;
+}
+
+static int vmnet_switch_poll(struct vmnet_state *vms);
+static int vmnet_xc_poll(struct vmnet_state *vms);
+
+/* Install the event callback unless it already is: OCaml waiting for
+   events, switching and cross-connects need it. */
+static void
+vmnet_set_handler(struct vmnet_state *vms)
 {
-  CAMLparam1(v_vmnet);
-  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
   interface_ref iface = vms->iref;
+  pthread_mutex_lock(&vms->vmm);
+  if (vms->handler_set || vms->stopped) {
+    pthread_mutex_unlock(&vms->vmm);
+    return;
+  }
+  vms->handler_set = 1;
+  pthread_mutex_unlock(&vms->vmm);
   /* TODO: release queue. */
   dispatch_queue_t iface_q = dispatch_queue_create("org.openmirage.vmnet.iface_q", 0);
   vmnet_interface_set_event_callback(iface, VMNET_INTERFACE_PACKETS_AVAILABLE, iface_q,
     ^(interface_event_t event_id, xpc_object_t event)
     {
+      uint64_t now = vmnet_switch_now();
+      if (vmnet_xc_poll(vms) || vmnet_switch_poll(vms) ||
+          !vmnet_rx_poll(vms, now))
+        return;
       pthread_mutex_lock(&vms->vmm);
       vms->last_event ++;
       pthread_cond_broadcast(&vms->vmc);
       pthread_mutex_unlock(&vms->vmm);
     });
-  CAMLreturn(Val_unit);
 }
 
 CAMLprim value
-caml_wait_for_event(value v_vmnet)
+caml_set_event_handler(value v_vmnet)
 {
   CAMLparam1(v_vmnet);
+  vmnet_set_handler(Vmnet_state_val(v_vmnet));
+  CAMLreturn(Val_unit);
+}
+
+/* Wait for an event, for at most [v_timeout_ms] milliseconds unless it is
+   negative.  Returns 1 once there was one, 0 if none came in time, or the
+   negated VMNET_INVALID_ARGUMENT if the interface is stopped. */
+CAMLprim value
+caml_wait_for_event(value v_vmnet, value v_timeout_ms)
+{
+  CAMLparam2(v_vmnet, v_timeout_ms);
   struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  long timeout_ms = Long_val(v_timeout_ms);
+  struct timespec deadline;
+  int seen = 1;
+  if (timeout_ms >= 0) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + timeout_ms / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000L + (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  }
   caml_release_runtime_system();
   pthread_mutex_lock(&vms->vmm);
-  while (vms->seen_event == vms->last_event)
-    pthread_cond_wait(&vms->vmc, &vms->vmm);
+  while (!vms->stopped && vms->seen_event == vms->last_event) {
+    if (timeout_ms < 0) {
+      pthread_cond_wait(&vms->vmc, &vms->vmm);
+    } else if (pthread_cond_timedwait(&vms->vmc, &vms->vmm,
+                                      &deadline) == ETIMEDOUT) {
+      seen = vms->seen_event != vms->last_event;
+      break;
+    }
+  }
   vms->seen_event = vms->last_event;
+  if (vms->stopped)
+    seen = (-1)*(int32_t)VMNET_INVALID_ARGUMENT;
   pthread_mutex_unlock(&vms->vmm);
   caml_acquire_runtime_system();
-  CAMLreturn(Val_unit);
+  CAMLreturn(Val_int(seen));
+}
+
+/* Copy the oldest frame of queue [qi] into [buf], refilling the queues
+   from vmnet first if it is empty.  Called with rxm held; returns the
+   frame length, 0 if there is none, or the negated vmnet_return_t.  A
+   frame larger than [len] is left in the queue. */
+static int
+vmnet_rx_take(struct vmnet_state *vms, int qi, uint8_t *buf, size_t len,
+              struct vmnet_ring_meta *info)
+{
+  struct vmnet_ring *r = &vms->rxq[qi].ring;
+  if (vmnet_ring_count(r) == 0) {
+    int res = vmnet_rx_refill(vms, vmnet_switch_now());
+    if (res < 0)
+      return res;
+  }
+  if (vmnet_ring_count(r) == 0)
+    return 0;
+  struct vmnet_ring_meta *m = vmnet_ring_meta(r, r->tail);
+  if (m->len > len)
+    return (-1)*(int32_t)VMNET_PACKET_TOO_BIG;
+  memcpy(buf, vmnet_ring_slot(r, r->tail), m->len);
+  if (info)
+    *info = *m;
+  vmnet_ring_take(r, 1);
+  return m->len;
+}
+
+/* Raise Invalid_argument [msg] if frames of the receive queues are still
+   lent to OCaml, as the queues cannot be replaced then.  Called with rxm
+   held, which it releases before raising. */
+static void
+vmnet_rx_check_unlent(struct vmnet_state *vms, const char *msg)
+{
+  for (int q = 0; q < vms->nrxq; q++)
+    if (vmnet_ring_lent(&vms->rxq[q].ring)) {
+      pthread_mutex_unlock(&vms->rxm);
+      caml_invalid_argument(msg);
+    }
+}
+
+/* Raise Invalid_argument unless [qi] names a queue.  Called with rxm
+   held, which it releases before raising. */
+static void
+vmnet_rx_check_queue(struct vmnet_state *vms, int qi)
+{
+  if (qi < 0 || qi >= (vms->nrxq ? vms->nrxq : 1)) {
+    pthread_mutex_unlock(&vms->rxm);
+    caml_invalid_argument("Vmnet: no such receive queue");
+  }
+}
+
+static int
+vmnet_read_one(struct vmnet_state *vms, int qi, uint8_t *buf, size_t len,
+               struct vmnet_ring_meta *info)
+{
+  int r;
+  pthread_mutex_lock(&vms->rxm);
+  vmnet_rx_check_queue(vms, qi);
+  if (vms->nrxq > 0) {
+    r = vmnet_rx_take(vms, qi, buf, len, info);
+  } else {
+    struct iovec iov;
+    struct vmpktdesc v;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    v.vm_pkt_size = len;
+    v.vm_pkt_iov = &iov;
+    v.vm_pkt_iovcnt = 1;
+    v.vm_flags = 0;
+    r = vmnet_read_pkts(vms, &v, 1);
+    if (r > 0) {
+      vms->rx_frames++;
+      r = v.vm_pkt_size;
+    }
+    if (info) {
+      info->len = r > 0 ? r : 0;
+      info->segs = 1;
+      info->ts = vmnet_switch_now();
+      info->mss = 0;
+    }
+  }
+  pthread_mutex_unlock(&vms->rxm);
+  return r;
 }
 
 CAMLprim value
@@ -241,29 +964,533 @@ caml_vmnet_read(value v_vmnet, value v_ba, value v_ba_off, value v_ba_len)
 {
   CAMLparam4(v_vmnet, v_ba, v_ba_off, v_ba_len);
   struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
-  interface_ref iface = vms->iref;
-  struct iovec iov;
-  iov.iov_base = Caml_ba_data_val(v_ba) + (Int_val(v_ba_off));
-  iov.iov_len = Int_val(v_ba_len);
-  struct vmpktdesc v;
-  v.vm_pkt_size = Int_val(v_ba_len);
-  v.vm_pkt_iov = &iov;
-  v.vm_pkt_iovcnt = 1;
-  v.vm_flags = 0; /* TODO no clue what this is */
-  int pktcnt = 1;
-  vmnet_return_t res = vmnet_read(iface, &v, &pktcnt);
-  if (res != VMNET_SUCCESS)
-    CAMLreturn(Val_int((-1)*(int32_t)res));
-  else if (pktcnt <= 0)
+  uint8_t *buf = (uint8_t *)Caml_ba_data_val(v_ba) + Int_val(v_ba_off);
+  CAMLreturn(Val_int(vmnet_read_one(vms, 0, buf, Int_val(v_ba_len), NULL)));
+}
+
+/* As caml_vmnet_read from queue [v_queue], also storing the number of
+   segments coalesced into the frame in [v_info.(0)] and when it was
+   received in [v_info.(1)]. */
+CAMLprim value
+caml_vmnet_read_info(value v_vmnet, value v_queue, value v_ba, value v_ba_off,
+		value v_ba_len, value v_info)
+{
+  CAMLparam5(v_vmnet, v_queue, v_ba, v_ba_off, v_ba_len);
+  CAMLxparam1(v_info);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  uint8_t *buf = (uint8_t *)Caml_ba_data_val(v_ba) + Int_val(v_ba_off);
+  struct vmnet_ring_meta info = { 0, 0, 0, 0, 0 };
+  int r = vmnet_read_one(vms, Int_val(v_queue), buf, Int_val(v_ba_len), &info);
+  Field(v_info, 0) = Val_int(info.segs);
+  Field(v_info, 1) = Val_long(info.ts);
+  CAMLreturn(Val_int(r));
+}
+
+CAMLprim value
+caml_vmnet_read_info_byte(value *argv, int argn)
+{
+  return caml_vmnet_read_info(argv[0], argv[1], argv[2], argv[3], argv[4],
+                              argv[5]);
+}
+
+/* As caml_vmnet_read from queue [v_queue], storing the frame after a
+   virtio-net header that describes it.  Returns the length of both. */
+CAMLprim value
+caml_vmnet_read_vnet(value v_vmnet, value v_queue, value v_ba, value v_ba_off,
+                     value v_ba_len)
+{
+  CAMLparam5(v_vmnet, v_queue, v_ba, v_ba_off, v_ba_len);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  uint8_t *buf = (uint8_t *)Caml_ba_data_val(v_ba) + Long_val(v_ba_off);
+  size_t len = Long_val(v_ba_len);
+  struct vmnet_ring_meta info = { 0, 0, 0, 0, 0 };
+  struct vmnet_vnet_hdr h;
+  if (len < VMNET_VNET_HLEN)
+    caml_invalid_argument("Vmnet.read_vnet");
+  int r = vmnet_read_one(vms, Int_val(v_queue), buf + VMNET_VNET_HLEN,
+                         len - VMNET_VNET_HLEN, &info);
+  if (r > 0) {
+    vmnet_vnet_rx(buf + VMNET_VNET_HLEN, r, info.segs, info.mss,
+                  vms->offload ? vms->mtu : 0, &h);
+    vmnet_vnet_hdr_put(buf, &h);
+    r += VMNET_VNET_HLEN;
+  }
+  CAMLreturn(Val_int(r));
+}
+
+/* Read up to one frame from queue [v_queue] into each of the (buffer,
+   offset, length) triples of [v_bufs], storing the frame lengths in
+   [v_lens] and, if [v_info] is not empty, the segment count and receive
+   time of frame i in [v_info.(2i)] and [v_info.(2i+1)].  Returns the
+   number of frames read or the negated vmnet_return_t. */
+CAMLprim value
+caml_vmnet_read_batch(value v_vmnet, value v_queue, value v_bufs, value v_lens,
+                      value v_info)
+{
+  CAMLparam5(v_vmnet, v_queue, v_bufs, v_lens, v_info);
+  int with_info = Wosize_val(v_info) > 0;
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  int n = Wosize_val(v_bufs);
+  int got = 0;
+  pthread_mutex_lock(&vms->rxm);
+  vmnet_rx_check_queue(vms, Int_val(v_queue));
+  if (n == 0) {
+    pthread_mutex_unlock(&vms->rxm);
     CAMLreturn(Val_int(0));
-  else
-    CAMLreturn(Val_int(v.vm_pkt_size));
+  }
+  if (vms->nrxq > 0) {
+    while (got < n) {
+      value v_buf = Field(v_bufs, got);
+      uint8_t *buf = (uint8_t *)Caml_ba_data_val(Field(v_buf, 0)) + Long_val(Field(v_buf, 1));
+      struct vmnet_ring_meta m;
+      int r = vmnet_rx_take(vms, Int_val(v_queue), buf, Long_val(Field(v_buf, 2)), &m);
+      if (r <= 0) {
+        if (got == 0)
+          got = r;
+        break;
+      }
+      Field(v_lens, got) = Val_int(r);
+      if (with_info) {
+        Field(v_info, 2 * got) = Val_int(m.segs);
+        Field(v_info, 2 * got + 1) = Val_long(m.ts);
+      }
+      got++;
+    }
+    pthread_mutex_unlock(&vms->rxm);
+    CAMLreturn(Val_int(got));
+  }
+  pthread_mutex_unlock(&vms->rxm);
+
+  struct iovec *iov = calloc(n, sizeof(struct iovec));
+  struct vmpktdesc *pkts = calloc(n, sizeof(struct vmpktdesc));
+  if (!iov || !pkts) {
+    free(iov);
+    free(pkts);
+    caml_raise_out_of_memory();
+  }
+  for (int i = 0; i < n; i++) {
+    value v_buf = Field(v_bufs, i);
+    iov[i].iov_base = Caml_ba_data_val(Field(v_buf, 0)) + Long_val(Field(v_buf, 1));
+    iov[i].iov_len = Long_val(Field(v_buf, 2));
+    pkts[i].vm_pkt_size = iov[i].iov_len;
+    pkts[i].vm_pkt_iov = &iov[i];
+    pkts[i].vm_pkt_iovcnt = 1;
+    pkts[i].vm_flags = 0;
+  }
+  pthread_mutex_lock(&vms->rxm);
+  got = vmnet_read_pkts(vms, pkts, n);
+  uint64_t now = vmnet_switch_now();
+  if (got > 0)
+    vms->rx_frames += got;
+  pthread_mutex_unlock(&vms->rxm);
+  for (int i = 0; i < got; i++) {
+    Field(v_lens, i) = Val_int(pkts[i].vm_pkt_size);
+    if (with_info) {
+      Field(v_info, 2 * i) = Val_int(1);
+      Field(v_info, 2 * i + 1) = Val_long(now);
+    }
+  }
+  free(iov);
+  free(pkts);
+  CAMLreturn(Val_int(got));
 }
 
+/* Released views of borrowed frames are pointed here when checks are on,
+   so that they read poison instead of the frames that reuse their slots.
+   The stubs run with the runtime lock held, which serialises access. */
+#define VMNET_POISON 0xdb
+static uint8_t vmnet_poison[VMNET_GRO_SLOT];
+static size_t vmnet_poison_len; /* bytes poisoned so far */
+
+static void
+vmnet_poison_check(void)
+{
+  for (size_t i = 0; i < vmnet_poison_len; i++)
+    if (vmnet_poison[i] != VMNET_POISON) {
+      memset(vmnet_poison, VMNET_POISON, vmnet_poison_len);
+      caml_failwith("Vmnet: borrowed frame written after release");
+    }
+}
+
+/* Lend the oldest frame of queue [v_queue] to OCaml, enabling the receive
+   pipeline if needed.  Returns [Some ba], with [ba] an external bigarray
+   over the frame in its slot, and stores the length, slot index, segment
+   count and receive time of the frame and whether checks are on in
+   [v_info.(0..4)].  Returns [None] with 0 or the negated vmnet_return_t in
+   [v_info.(0)] if there is no frame. */
 CAMLprim value
-caml_vmnet_write(value v_vmnet, value v_ba, value v_ba_off, value v_ba_len)
+caml_vmnet_borrow(value v_vmnet, value v_queue, value v_info)
 {
-  CAMLparam4(v_vmnet, v_ba, v_ba_off, v_ba_len);
+  CAMLparam3(v_vmnet, v_queue, v_info);
+  CAMLlocal2(v_ba, v_res);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  int qi = Int_val(v_queue);
+  int res = 0;
+  pthread_mutex_lock(&vms->rxm);
+  vmnet_rx_check_queue(vms, qi);
+  if (!vmnet_rx_enable(vms, vms->max_packet_size)) {
+    pthread_mutex_unlock(&vms->rxm);
+    caml_raise_out_of_memory();
+  }
+  struct vmnet_ring *r = &vms->rxq[qi].ring;
+  if (vmnet_ring_count(r) == 0)
+    res = vmnet_rx_refill(vms, vmnet_switch_now());
+  if (res < 0 || vmnet_ring_count(r) == 0) {
+    pthread_mutex_unlock(&vms->rxm);
+    Field(v_info, 0) = Val_int(res < 0 ? res : 0);
+    CAMLreturn(Val_none);
+  }
+  struct vmnet_ring_meta m = *vmnet_ring_meta(r, r->tail);
+  unsigned slot = vmnet_ring_lend(r);
+  uint8_t *data = vmnet_ring_slot(r, slot);
+  int checks = vms->borrow_checks;
+  pthread_mutex_unlock(&vms->rxm);
+  if (checks)
+    vmnet_poison_check();
+  v_ba = caml_ba_alloc_dims(CAML_BA_CHAR | CAML_BA_C_LAYOUT | CAML_BA_EXTERNAL,
+                            1, data, (intnat)m.len);
+  v_res = caml_alloc_small(1, 0);
+  Field(v_res, 0) = v_ba;
+  Field(v_info, 0) = Val_int(m.len);
+  Field(v_info, 1) = Val_long(slot);
+  Field(v_info, 2) = Val_int(m.segs);
+  Field(v_info, 3) = Val_long(m.ts);
+  Field(v_info, 4) = Val_bool(checks);
+  CAMLreturn(v_res);
+}
+
+/* Give back slot [v_slot] of queue [v_queue], lent as [v_ba].  With checks
+   on, [v_ba] is pointed at the poison so that the views of it still
+   around no longer see the slot. */
+CAMLprim value
+caml_vmnet_release(value v_vmnet, value v_queue, value v_slot, value v_ba)
+{
+  CAMLparam4(v_vmnet, v_queue, v_slot, v_ba);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  int qi = Int_val(v_queue);
+  int ok;
+  pthread_mutex_lock(&vms->rxm);
+  ok = qi >= 0 && qi < vms->nrxq &&
+       vmnet_ring_return(&vms->rxq[qi].ring, (unsigned)Long_val(v_slot));
+  int checks = vms->borrow_checks;
+  pthread_mutex_unlock(&vms->rxm);
+  if (!ok)
+    caml_invalid_argument("Vmnet.release: frame not borrowed");
+  if (checks) {
+    struct caml_ba_array *ba = Caml_ba_array_val(v_ba);
+    vmnet_poison_check();
+    if (ba->dim[0] > (intnat)sizeof(vmnet_poison))
+      ba->dim[0] = sizeof(vmnet_poison);
+    if ((size_t)ba->dim[0] > vmnet_poison_len) {
+      memset(vmnet_poison + vmnet_poison_len, VMNET_POISON,
+             ba->dim[0] - vmnet_poison_len);
+      vmnet_poison_len = ba->dim[0];
+    }
+    ba->data = vmnet_poison;
+  }
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_vmnet_set_borrow_checks(value v_vmnet, value v_enable)
+{
+  CAMLparam2(v_vmnet, v_enable);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  pthread_mutex_lock(&vms->rxm);
+  vms->borrow_checks = Bool_val(v_enable);
+  pthread_mutex_unlock(&vms->rxm);
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_vmnet_set_gro(value v_vmnet, value v_enable)
+{
+  CAMLparam2(v_vmnet, v_enable);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  int ok = 1;
+  pthread_mutex_lock(&vms->rxm);
+  if (Bool_val(v_enable)) {
+    if (vms->nrxq > 0 && vms->rxq[0].ring.slot_size < VMNET_GRO_SLOT)
+      vmnet_rx_check_unlent(vms, "Vmnet.set_gro: frames are borrowed");
+    ok = vmnet_rx_enable(vms, VMNET_GRO_SLOT);
+  }
+  if (ok)
+    vms->rx_gro = Bool_val(v_enable);
+  pthread_mutex_unlock(&vms->rxm);
+  if (!ok)
+    caml_raise_out_of_memory();
+  CAMLreturn(Val_unit);
+}
+
+/* Install the BPF program in [v_prog], an array of (code, jt, jf, k), or
+   remove the filter if it is empty.  Frames are filtered as they are read
+   into the receive queues, which are enabled here.  Returns false if the
+   program is not valid. */
+CAMLprim value
+caml_vmnet_set_filter(value v_vmnet, value v_prog)
+{
+  CAMLparam2(v_vmnet, v_prog);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  size_t n = Wosize_val(v_prog);
+  struct vmnet_bpf_insn *prog = NULL;
+  if (n > 0) {
+    prog = calloc(n, sizeof(struct vmnet_bpf_insn));
+    if (!prog)
+      caml_raise_out_of_memory();
+    for (size_t i = 0; i < n; i++) {
+      value v_insn = Field(v_prog, i);
+      prog[i].code = Int_val(Field(v_insn, 0));
+      prog[i].jt = Int_val(Field(v_insn, 1));
+      prog[i].jf = Int_val(Field(v_insn, 2));
+      prog[i].k = (uint32_t)Long_val(Field(v_insn, 3));
+    }
+    if (!vmnet_bpf_validate(prog, n)) {
+      free(prog);
+      CAMLreturn(Val_false);
+    }
+  }
+  pthread_mutex_lock(&vms->rxm);
+  int ok = prog == NULL || vmnet_rx_enable(vms, vms->max_packet_size);
+  if (ok) {
+    free(vms->filter);
+    vms->filter = prog;
+  }
+  pthread_mutex_unlock(&vms->rxm);
+  if (!ok) {
+    free(prog);
+    caml_raise_out_of_memory();
+  }
+  CAMLreturn(Val_true);
+}
+
+/* Answer ARP requests and ICMP echo requests for the addresses in
+   [v_bindings], an array of (IPv4 address, MAC) octet strings, from the
+   receive pipeline, which is enabled here.  An empty array turns the
+   responder off. */
+CAMLprim value
+caml_vmnet_set_responder(value v_vmnet, value v_bindings)
+{
+  CAMLparam2(v_vmnet, v_bindings);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  size_t n = Wosize_val(v_bindings);
+  struct vmnet_binding *b = NULL;
+  if (n > 0) {
+    b = calloc(n, sizeof(struct vmnet_binding));
+    if (!b)
+      caml_raise_out_of_memory();
+    for (size_t i = 0; i < n; i++) {
+      value v_b = Field(v_bindings, i);
+      if (caml_string_length(Field(v_b, 0)) != 4 ||
+          caml_string_length(Field(v_b, 1)) != 6) {
+        free(b);
+        caml_invalid_argument("Vmnet.set_responder");
+      }
+      memcpy(b[i].ip, String_val(Field(v_b, 0)), 4);
+      memcpy(b[i].mac, String_val(Field(v_b, 1)), 6);
+    }
+  }
+  pthread_mutex_lock(&vms->rxm);
+  int ok = b == NULL || vmnet_rx_enable(vms, vms->max_packet_size);
+  if (ok) {
+    free(vms->respond);
+    vms->respond = b;
+    vms->nrespond = n;
+  }
+  pthread_mutex_unlock(&vms->rxm);
+  if (!ok) {
+    free(b);
+    caml_raise_out_of_memory();
+  }
+  CAMLreturn(Val_unit);
+}
+
+/* Split received frames over [v_queues] queues of [v_slots] frames each
+   (0 for the default) using [v_rules], an array of (ethertype, dst, mac,
+   queue) tried in order.  Frames matching no rule go to queue 0. */
+CAMLprim value
+caml_vmnet_set_demux(value v_vmnet, value v_queues, value v_slots, value v_rules)
+{
+  CAMLparam4(v_vmnet, v_queues, v_slots, v_rules);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  int nq = Int_val(v_queues);
+  size_t n = Wosize_val(v_rules);
+  unsigned slots = 0;
+  if (nq < 1 || nq > VMNET_RXQ_MAX || Long_val(v_slots) < 0 ||
+      Long_val(v_slots) > 65536)
+    caml_invalid_argument("Vmnet.set_demux");
+  if (Long_val(v_slots) > 0)
+    for (slots = 1; slots < (unsigned)Long_val(v_slots); slots *= 2);
+  struct vmnet_demux_rule *rules = calloc(n ? n : 1, sizeof(struct vmnet_demux_rule));
+  if (!rules)
+    caml_raise_out_of_memory();
+  for (size_t i = 0; i < n; i++) {
+    value v_rule = Field(v_rules, i);
+    rules[i].ethertype = Int_val(Field(v_rule, 0));
+    rules[i].dst = Int_val(Field(v_rule, 1));
+    if (caml_string_length(Field(v_rule, 2)) == 6)
+      memcpy(rules[i].mac, String_val(Field(v_rule, 2)), 6);
+    rules[i].queue = Int_val(Field(v_rule, 3));
+    if (rules[i].queue < 0 || rules[i].queue >= nq) {
+      free(rules);
+      caml_invalid_argument("Vmnet.set_demux: no such queue");
+    }
+  }
+  pthread_mutex_lock(&vms->rxm);
+  for (int q = 0; q < vms->nrxq; q++)
+    if (vmnet_ring_lent(&vms->rxq[q].ring)) {
+      pthread_mutex_unlock(&vms->rxm);
+      free(rules);
+      caml_invalid_argument("Vmnet.set_demux: frames are borrowed");
+    }
+  size_t slot_size = vms->rx_gro ? VMNET_GRO_SLOT : vms->max_packet_size;
+  unsigned old_slots = vms->rx_slots;
+  vms->rx_slots = slots;
+  unsigned nslots = vmnet_rx_default_slots(vms, slot_size);
+  vms->rx_slots = old_slots;
+  int ok = vmnet_rx_configure(vms, nq, nslots, slot_size);
+  if (ok) {
+    /* Only now do the queues have the new size */
+    vms->rx_slots = slots;
+    free(vms->demux);
+    vms->demux = rules;
+    vms->ndemux = n;
+  }
+  pthread_mutex_unlock(&vms->rxm);
+  if (!ok) {
+    free(rules);
+    caml_raise_out_of_memory();
+  }
+  CAMLreturn(Val_unit);
+}
+
+/* Steer frames that match no demux rule to queue [v_table.(hash mod
+   size)], where hash is the Toeplitz hash of the flow under [v_key].  An
+   empty table turns steering off. */
+CAMLprim value
+caml_vmnet_set_rss(value v_vmnet, value v_key, value v_table)
+{
+  CAMLparam3(v_vmnet, v_key, v_table);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  size_t n = Wosize_val(v_table);
+  if (caml_string_length(v_key) != VMNET_RSS_KEY_LEN ||
+      n > VMNET_RSS_TABLE_MAX || (n & (n - 1)) != 0)
+    caml_invalid_argument("Vmnet.set_rss");
+  pthread_mutex_lock(&vms->rxm);
+  for (size_t i = 0; i < n; i++) {
+    long q = Long_val(Field(v_table, i));
+    if (q < 0 || q >= (vms->nrxq ? vms->nrxq : 1)) {
+      pthread_mutex_unlock(&vms->rxm);
+      caml_invalid_argument("Vmnet.set_rss: no such queue");
+    }
+  }
+  memcpy(vms->rss_key, String_val(v_key), VMNET_RSS_KEY_LEN);
+  for (size_t i = 0; i < n; i++)
+    vms->rss_table[i] = Long_val(Field(v_table, i));
+  vms->rss_size = n;
+  pthread_mutex_unlock(&vms->rxm);
+  CAMLreturn(Val_unit);
+}
+
+/* Publish the traffic in a fan-out ring of [v_slots] slots of
+   [v_slot_size] bytes in the file [v_fd], which is resized to fit, or stop
+   publishing if [v_fd] is None.  Transmitted frames are published too if
+   [v_tx].  The ring replaces any previous one. */
+CAMLprim value
+caml_vmnet_set_fanout(value v_vmnet, value v_fd, value v_slots,
+                      value v_slot_size, value v_tx)
+{
+  CAMLparam5(v_vmnet, v_fd, v_slots, v_slot_size, v_tx);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  void *mem = NULL;
+  size_t size = 0;
+  if (Is_block(v_fd)) {
+    long slots = Long_val(v_slots);
+    long slot_size = Long_val(v_slot_size);
+    if (slots <= 0 || slots > (1L << 24) || (slots & (slots - 1)) != 0 ||
+        slot_size <= 0 || slot_size > 65535)
+      caml_invalid_argument("Vmnet.Fanout.publish");
+    int fd = Int_val(Some_val(v_fd));
+    size = vmnet_fanout_size(slots, slot_size);
+    if (ftruncate(fd, size) < 0)
+      caml_failwith("Vmnet.Fanout.publish: cannot resize the file");
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED)
+      caml_failwith("Vmnet.Fanout.publish: cannot map the file");
+    vmnet_fanout_init(mem, slots, slot_size, Bool_val(v_tx));
+  }
+  pthread_mutex_lock(&vms->fom);
+  void *old = vms->fanout;
+  size_t old_size = vms->fanout_size;
+  __atomic_store_n(&vms->fanout, mem, __ATOMIC_RELEASE);
+  vms->fanout_size = size;
+  vms->fanout_tx = Bool_val(v_tx);
+  pthread_mutex_unlock(&vms->fom);
+  if (old)
+    munmap(old, old_size);
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value
+caml_vmnet_ready_queues(value v_vmnet)
+{
+  CAMLparam1(v_vmnet);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  pthread_mutex_lock(&vms->rxm);
+  int mask = vmnet_rx_ready(vms);
+  pthread_mutex_unlock(&vms->rxm);
+  CAMLreturn(Val_int(mask));
+}
+
+/* The clock of receive timestamps; declared [@@noalloc]. */
+CAMLprim value
+caml_vmnet_now(value v_unit)
+{
+  return Val_long(vmnet_switch_now());
+}
+
+CAMLprim value
+caml_vmnet_stats(value v_vmnet)
+{
+  CAMLparam1(v_vmnet);
+  CAMLlocal1(v_res);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  uint64_t merged = 0, full = 0;
+  v_res = caml_alloc_tuple(6);
+  pthread_mutex_lock(&vms->rxm);
+  for (int q = 0; q < vms->nrxq; q++) {
+    merged += vms->rxq[q].gro.merged;
+    full += vms->rxq[q].dropped;
+  }
+  Field(v_res, 0) = Val_long(vms->rx_frames);
+  Field(v_res, 1) = Val_long(vms->rx_accepted);
+  Field(v_res, 2) = Val_long(vms->rx_dropped);
+  Field(v_res, 3) = Val_long(merged);
+  Field(v_res, 4) = Val_long(full);
+  Field(v_res, 5) = Val_long(vms->rx_answered);
+  pthread_mutex_unlock(&vms->rxm);
+  CAMLreturn(v_res);
+}
+
+/* Smallest buffer that can hold any frame returned by a read */
+CAMLprim value
+caml_vmnet_rx_buffer_size(value v_vmnet)
+{
+  CAMLparam1(v_vmnet);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  pthread_mutex_lock(&vms->rxm);
+  size_t size = vms->nrxq ? vms->rxq[0].ring.slot_size : vms->max_packet_size;
+  pthread_mutex_unlock(&vms->rxm);
+  CAMLreturn(Val_int(size));
+}
+
+static int vmnet_write_shaped(struct vmnet_state *vms, struct vmpktdesc *pkts,
+                              int n, int cls);
+
+CAMLprim value
+caml_vmnet_write(value v_vmnet, value v_class, value v_ba, value v_ba_off,
+                 value v_ba_len)
+{
+  CAMLparam5(v_vmnet, v_class, v_ba, v_ba_off, v_ba_len);
   struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
   interface_ref iface = vms->iref;
   struct iovec iov;
@@ -273,89 +1500,698 @@ caml_vmnet_write(value v_vmnet, value v_ba, value v_ba_off, value v_ba_len)
   v.vm_pkt_size = Int_val(v_ba_len);
   v.vm_pkt_iov = &iov;
   v.vm_pkt_iovcnt = 1;
-  v.vm_flags = 0; /* TODO no clue what this is */
+  /* vm_flags is for per-packet flags, and vmnet defines none for frames
+     given to vmnet_write: checksum and TSO offload are asked for once per
+     interface with vmnet_enable_checksum_offload_key and
+     vmnet_enable_tso_key in vmnet_start_interface, so it must be 0 */
+  v.vm_flags = 0;
   int pktcnt = 1;
-  vmnet_return_t res = vmnet_write(iface, &v, &pktcnt);
-  if (res == VMNET_SUCCESS)
+  if (vms->tx_csum)
+    vmnet_csum_fill(iov.iov_base, iov.iov_len);
+  if (vms->tx.enabled) {
+    int sent = vmnet_write_shaped(vms, &v, 1, Int_val(v_class));
+    if (sent == 0)
+      sent = (-1)*(int32_t)VMNET_BUFFER_EXHAUSTED;
+    CAMLreturn(Val_int(sent > 0 ? (int)v.vm_pkt_size : sent));
+  }
+  vmnet_return_t res = vms->stopped ? VMNET_INVALID_ARGUMENT
+                                    : vmnet_write(iface, &v, &pktcnt);
+  if (res == VMNET_SUCCESS) {
+    vmnet_fanout_pkts(vms, &v, pktcnt, VMNET_FANOUT_TX);
     CAMLreturn(Val_int(v.vm_pkt_size));
+  }
   else
     CAMLreturn(Val_int((-1)*(int32_t)res));
 }
 
+/* Most packets handed to vmnet_write in one call */
+#define VMNET_WRITE_BATCH 32
+
+/* Write [n] packets in batches.  Returns the number of packets vmnet
+   accepted, or the negated vmnet_return_t if the first batch failed. */
+static int
+vmnet_write_pkts(struct vmnet_state *vms, struct vmpktdesc *pkts, int n)
+{
+  int written = 0;
+  while (written < n) {
+    int pktcnt = n - written;
+    if (pktcnt > VMNET_WRITE_BATCH)
+      pktcnt = VMNET_WRITE_BATCH;
+    int want = pktcnt;
+    if (vms->stopped)
+      return written ? written : (-1)*(int32_t)VMNET_INVALID_ARGUMENT;
+    vmnet_return_t res = vmnet_write(vms->iref, pkts + written, &pktcnt);
+    if (res != VMNET_SUCCESS)
+      return written ? written : (-1)*(int32_t)res;
+    vmnet_fanout_pkts(vms, pkts + written, pktcnt, VMNET_FANOUT_TX);
+    written += pktcnt;
+    if (pktcnt < want)
+      break;
+  }
+  return written;
+}
+
+static int
+vmnet_tx_output_iface(void *ctx, const struct vmnet_tx_frame *frames, int n)
+{
+  struct vmnet_state *vms = ctx;
+  struct iovec iov[VMNET_TX_BATCH];
+  struct vmpktdesc pkts[VMNET_TX_BATCH];
+  for (int i = 0; i < n; i++) {
+    iov[i].iov_base = (void *)frames[i].data;
+    iov[i].iov_len = frames[i].len;
+    pkts[i].vm_pkt_size = frames[i].len;
+    pkts[i].vm_pkt_iov = &iov[i];
+    pkts[i].vm_pkt_iovcnt = 1;
+    pkts[i].vm_flags = 0;
+  }
+  return vmnet_write_pkts(vms, pkts, n);
+}
+
+/* Arm a drain of the shaper queues in [wait] nanoseconds, unless there is
+   nothing to wait for or one is pending.  Called with tx.lock held. */
+static void
+vmnet_tx_schedule(struct vmnet_state *vms, uint64_t wait)
+{
+  if (wait == 0 || vms->tx.timer_armed)
+    return;
+  vms->tx.timer_armed = 1;
+  dispatch_after(dispatch_time(DISPATCH_TIME_NOW, wait),
+    dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
+      pthread_mutex_lock(&vms->tx.lock);
+      vms->tx.timer_armed = 0;
+      vmnet_tx_schedule(vms, vmnet_tx_drain(&vms->tx, vmnet_switch_now()));
+      pthread_mutex_unlock(&vms->tx.lock);
+    });
+}
+
+/* Write packets from OCaml, through the shaper if it is enabled, in class
+   [cls] or, if it is -1, the class of their rule.  Returns like
+   vmnet_write_pkts, counting frames the shaper queued or dropped as
+   written. */
+static int
+vmnet_write_shaped(struct vmnet_state *vms, struct vmpktdesc *pkts, int n,
+                   int cls)
+{
+  struct vmnet_tx_frame frames[VMNET_TX_BATCH];
+  struct vmnet_tx *tx = &vms->tx;
+  if (!tx->enabled)
+    return vmnet_write_pkts(vms, pkts, n);
+  pthread_mutex_lock(&tx->lock);
+  uint64_t now = vmnet_switch_now();
+  int done = 0;
+  while (done < n) {
+    int batch = n - done < VMNET_TX_BATCH ? n - done : VMNET_TX_BATCH;
+    for (int i = 0; i < batch; i++) {
+      frames[i].data = pkts[done + i].vm_pkt_iov->iov_base;
+      frames[i].len = pkts[done + i].vm_pkt_size;
+    }
+    int res = vmnet_tx_input(tx, frames, batch,
+                             cls < tx->nclasses ? cls : tx->nclasses - 1, now);
+    if (res < 0) {
+      if (done == 0)
+        done = res;
+      break;
+    }
+    done += res;
+    if (res < batch)
+      break;
+  }
+  if (vmnet_tx_queued(tx) > 0)
+    vmnet_tx_schedule(vms, vmnet_tx_drain(tx, now));
+  pthread_mutex_unlock(&tx->lock);
+  return done;
+}
+
 CAMLprim value
-caml_vmnet_interface_add_port_forwarding_rule(value v_vmnet, value v_protocol,
-		value v_ext_port, value v_int_addr, value v_int_port) {
-  CAMLparam5(v_vmnet, v_protocol, v_ext_port, v_int_addr, v_int_port);
+caml_vmnet_write_batch(value v_vmnet, value v_class, value v_bufs)
+{
+  CAMLparam3(v_vmnet, v_class, v_bufs);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  int n = Wosize_val(v_bufs);
+  if (n == 0)
+    CAMLreturn(Val_int(0));
+  struct iovec *iov = calloc(n, sizeof(struct iovec));
+  struct vmpktdesc *pkts = calloc(n, sizeof(struct vmpktdesc));
+  if (!iov || !pkts) {
+    free(iov);
+    free(pkts);
+    caml_raise_out_of_memory();
+  }
+  for (int i = 0; i < n; i++) {
+    value v_buf = Field(v_bufs, i);
+    iov[i].iov_base = Caml_ba_data_val(Field(v_buf, 0)) + Long_val(Field(v_buf, 1));
+    iov[i].iov_len = Long_val(Field(v_buf, 2));
+    if (vms->tx_csum)
+      vmnet_csum_fill(iov[i].iov_base, iov[i].iov_len);
+    pkts[i].vm_pkt_size = iov[i].iov_len;
+    pkts[i].vm_pkt_iov = &iov[i];
+    pkts[i].vm_pkt_iovcnt = 1;
+    pkts[i].vm_flags = 0;
+  }
+  int res = vmnet_write_shaped(vms, pkts, n, Int_val(v_class));
+  free(iov);
+  free(pkts);
+  CAMLreturn(Val_int(res));
+}
 
-  #if __MAC_OS_X_VERSION_MAX_ALLOWED >= 101500
+/* Split one large TCP/IPv4 segment into [mss]-sized frames of class [cls]
+   and write them in as few vmnet_write calls as possible.  The segments
+   are plain frames, with vm_flags 0 as in caml_vmnet_write.  Returns what
+   vmnet_write_shaped does; raises Out_of_memory. */
+static int
+vmnet_write_gso_frame(struct vmnet_state *vms, uint8_t *frame, size_t len,
+                      size_t mss, int cls)
+{
+  struct vmnet_gso g;
+  struct iovec iov1;
+  struct vmpktdesc pkt1;
+
+  if (!vmnet_gso_prepare(frame, len, mss, &g) || g.nsegs == 1) {
+    /* Nothing to split: send the frame as it is */
+    if (vms->tx_csum)
+      vmnet_csum_fill(frame, len);
+    iov1.iov_base = frame;
+    iov1.iov_len = len;
+    pkt1.vm_pkt_size = len;
+    pkt1.vm_pkt_iov = &iov1;
+    pkt1.vm_pkt_iovcnt = 1;
+    pkt1.vm_flags = 0;
+    return vmnet_write_shaped(vms, &pkt1, 1, cls);
+  }
+
+  size_t seg_size = g.hdr_len + g.mss;
+  uint8_t *segs = malloc(g.nsegs * seg_size);
+  struct iovec *iov = calloc(g.nsegs, sizeof(struct iovec));
+  struct vmpktdesc *pkts = calloc(g.nsegs, sizeof(struct vmpktdesc));
+  if (!segs || !iov || !pkts) {
+    free(segs);
+    free(iov);
+    free(pkts);
+    caml_raise_out_of_memory();
+  }
+  for (int i = 0; i < g.nsegs; i++) {
+    iov[i].iov_base = segs + i * seg_size;
+    iov[i].iov_len = vmnet_gso_segment(&g, frame, i, iov[i].iov_base);
+    pkts[i].vm_pkt_size = iov[i].iov_len;
+    pkts[i].vm_pkt_iov = &iov[i];
+    pkts[i].vm_pkt_iovcnt = 1;
+    pkts[i].vm_flags = 0;
+  }
+  int res = vmnet_write_shaped(vms, pkts, g.nsegs, cls);
+  free(segs);
+  free(iov);
+  free(pkts);
+  return res;
+}
+
+CAMLprim value
+caml_vmnet_write_gso(value v_vmnet, value v_ba, value v_ba_off, value v_ba_len,
+		value v_mss)
+{
+  CAMLparam5(v_vmnet, v_ba, v_ba_off, v_ba_len, v_mss);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  uint8_t *frame = (uint8_t *)Caml_ba_data_val(v_ba) + Long_val(v_ba_off);
+  CAMLreturn(Val_int(vmnet_write_gso_frame(vms, frame, Long_val(v_ba_len),
+                                           Long_val(v_mss), -1)));
+}
+
+/* Write the frame that follows the virtio-net header at the start of
+   [v_ba].  Unless vmnet offloads them, checksums are completed and TCP/IPv4
+   GSO frames split here; other GSO frames are refused.  Returns the number
+   of frames accepted or the negated vmnet_return_t. */
+CAMLprim value
+caml_vmnet_write_vnet(value v_vmnet, value v_class, value v_ba, value v_ba_off,
+                      value v_ba_len)
+{
+  CAMLparam5(v_vmnet, v_class, v_ba, v_ba_off, v_ba_len);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  uint8_t *buf = (uint8_t *)Caml_ba_data_val(v_ba) + Long_val(v_ba_off);
+  size_t len = Long_val(v_ba_len);
+  struct vmnet_vnet_hdr h;
+  if (len < VMNET_VNET_HLEN)
+    caml_invalid_argument("Vmnet.write_vnet");
+  vmnet_vnet_hdr_get(buf, &h);
+  uint8_t *frame = buf + VMNET_VNET_HLEN;
+  len -= VMNET_VNET_HLEN;
+  int gso = h.gso_type & ~VMNET_VNET_GSO_ECN;
+  int sent;
+  if (!vms->offload) {
+    if (gso == VMNET_VNET_GSO_TCPV4 && h.gso_size > 0) {
+      sent = vmnet_write_gso_frame(vms, frame, len, h.gso_size,
+                                   Int_val(v_class));
+      if (sent == 0)
+        sent = (-1)*(int32_t)VMNET_BUFFER_EXHAUSTED;
+      CAMLreturn(Val_int(sent));
+    }
+    if (gso != VMNET_VNET_GSO_NONE ||
+        ((h.flags & VMNET_VNET_F_NEEDS_CSUM) && !vmnet_vnet_csum(frame, len, &h)))
+      CAMLreturn(Val_int((-1)*(int32_t)VMNET_INVALID_ARGUMENT));
+  }
+  struct iovec iov;
+  struct vmpktdesc pkt;
+  iov.iov_base = frame;
+  iov.iov_len = len;
+  pkt.vm_pkt_size = len;
+  pkt.vm_pkt_iov = &iov;
+  pkt.vm_pkt_iovcnt = 1;
+  /* Even a GSO frame left to vmnet carries no flags: it offloads because
+     the interface was started with offload (see caml_vmnet_write) */
+  pkt.vm_flags = 0;
+  sent = vmnet_write_shaped(vms, &pkt, 1, Int_val(v_class));
+  if (sent == 0)
+    sent = (-1)*(int32_t)VMNET_BUFFER_EXHAUSTED;
+  CAMLreturn(Val_int(sent));
+}
+
+CAMLprim value
+caml_vmnet_set_tx_checksum(value v_vmnet, value v_enable)
+{
+  CAMLparam2(v_vmnet, v_enable);
+  Vmnet_state_val(v_vmnet)->tx_csum = Bool_val(v_enable);
+  CAMLreturn(Val_unit);
+}
+
+/* [v_limit] is (bytes/s, frames/s, burst bytes, burst frames) */
+static void
+vmnet_shaper_of_value(struct vmnet_shaper *s, value v_limit)
+{
+  memset(s, 0, sizeof(*s));
+  s->bytes.rate = Double_val(Field(v_limit, 0));
+  s->pkts.rate = Double_val(Field(v_limit, 1));
+  s->bytes.burst = s->bytes.tokens = Double_val(Field(v_limit, 2));
+  s->pkts.burst = s->pkts.tokens = Double_val(Field(v_limit, 3));
+}
+
+static int
+vmnet_shaper_limited(const struct vmnet_shaper *s)
+{
+  return s->bytes.rate != 0 || s->pkts.rate != 0;
+}
+
+/* Shape the frames written from OCaml with [v_limit] for the interface and
+   [v_classes] for each class, frames being put in classes by [v_rules], an
+   array of (ethertype, dscp, class).  If all of [v_depths] are 0, frames
+   that do not conform are dropped.  Otherwise class i queues up to
+   [v_depths.(i)] frames that do not conform or that vmnet refuses, and
+   the queues are drained by priority.  Frames queued in classes that go
+   away end up in the last one. */
+CAMLprim value
+caml_vmnet_set_shaper(value v_vmnet, value v_limit, value v_classes,
+                      value v_rules, value v_depths)
+{
+  CAMLparam5(v_vmnet, v_limit, v_classes, v_rules, v_depths);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  struct vmnet_tx *tx = &vms->tx;
+  int nc = Wosize_val(v_classes);
+  size_t n = Wosize_val(v_rules);
+  unsigned depth[VMNET_TX_CLASSES];
+  int queue = 0;
+  if (nc < 1 || nc > VMNET_TX_CLASSES || Wosize_val(v_depths) != (size_t)nc)
+    caml_invalid_argument("Vmnet.set_shaper");
+  for (int c = 0; c < nc; c++) {
+    long d = Long_val(Field(v_depths, c));
+    if (d < 0 || d > 65536)
+      caml_invalid_argument("Vmnet.set_shaper: queue depth");
+    depth[c] = 0;
+    if (d > 0)
+      for (depth[c] = 1; depth[c] < (unsigned)d; depth[c] *= 2);
+    queue |= d > 0;
+  }
+  struct vmnet_tx_rule *rules = calloc(n ? n : 1, sizeof(struct vmnet_tx_rule));
+  if (!rules)
+    caml_raise_out_of_memory();
+  for (size_t i = 0; i < n; i++) {
+    value v_rule = Field(v_rules, i);
+    rules[i].ethertype = Int_val(Field(v_rule, 0));
+    rules[i].dscp = Int_val(Field(v_rule, 1));
+    rules[i].cls = Int_val(Field(v_rule, 2));
+    if (rules[i].cls < 0 || rules[i].cls >= nc) {
+      free(rules);
+      caml_invalid_argument("Vmnet.set_shaper: no such class");
+    }
+  }
+  struct vmnet_tx_class cls[VMNET_TX_CLASSES];
+  memset(cls, 0, sizeof(cls));
+  int limited = 0;
+  for (int c = 0; c < nc; c++) {
+    vmnet_shaper_of_value(&cls[c].shaper, Field(v_classes, c));
+    limited |= vmnet_shaper_limited(&cls[c].shaper);
+    if (depth[c] && !vmnet_ring_init(&cls[c].ring, depth[c], vms->max_packet_size)) {
+      while (c-- > 0)
+        vmnet_ring_free(&cls[c].ring);
+      free(rules);
+      caml_raise_out_of_memory();
+    }
+  }
+  pthread_mutex_lock(&tx->lock);
+  vmnet_shaper_of_value(&tx->shaper, v_limit);
+  limited |= vmnet_shaper_limited(&tx->shaper);
+  for (int c = 0; c < tx->nclasses; c++) {
+    struct vmnet_tx_class *to = &cls[c < nc ? c : nc - 1];
+    to->sent += tx->cls[c].sent;
+    to->shaped += tx->cls[c].shaped;
+    to->dropped += tx->cls[c].dropped;
+    if (!to->ring.mem || !vmnet_ring_move(&to->ring, &tx->cls[c].ring))
+      to->dropped += vmnet_ring_count(&tx->cls[c].ring);
+    vmnet_ring_free(&tx->cls[c].ring);
+  }
+  memcpy(tx->cls, cls, sizeof(cls));
+  tx->nclasses = nc;
+  tx->policy = queue ? VMNET_TX_QUEUE : VMNET_TX_DROP;
+  free(tx->rules);
+  tx->rules = rules;
+  tx->nrules = n;
+  tx->last = vmnet_switch_now();
+  tx->enabled = limited || queue;
+  if (vmnet_tx_queued(tx) > 0)
+    vmnet_tx_schedule(vms, vmnet_tx_drain(tx, tx->last));
+  pthread_mutex_unlock(&tx->lock);
+  CAMLreturn(Val_unit);
+}
+
+/* (sent, shaped, dropped, queued) for each class */
+CAMLprim value
+caml_vmnet_tx_stats(value v_vmnet)
+{
+  CAMLparam1(v_vmnet);
+  CAMLlocal2(v_res, v_class);
   struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  uint64_t counts[VMNET_TX_CLASSES][4];
+  pthread_mutex_lock(&vms->tx.lock);
+  int nc = vms->tx.nclasses;
+  for (int c = 0; c < nc; c++) {
+    counts[c][0] = vms->tx.cls[c].sent;
+    counts[c][1] = vms->tx.cls[c].shaped;
+    counts[c][2] = vms->tx.cls[c].dropped;
+    counts[c][3] = vmnet_ring_count(&vms->tx.cls[c].ring);
+  }
+  pthread_mutex_unlock(&vms->tx.lock);
+  v_res = caml_alloc_tuple(nc);
+  for (int c = 0; c < nc; c++) {
+    v_class = caml_alloc_tuple(4);
+    for (int i = 0; i < 4; i++)
+      Store_field(v_class, i, Val_long(counts[c][i]));
+    Store_field(v_res, c, v_class);
+  }
+  CAMLreturn(v_res);
+}
+
+/* Switch ports backed by an interface.  The switch is locked before rxm
+   whenever both are held. */
+
+static void
+vmnet_switch_output(void *ctx, const struct vmnet_sw_frame *frames, int n)
+{
+  struct vmnet_state *vms = ctx;
+  struct iovec iov[VMNET_SWITCH_BATCH];
+  struct vmpktdesc pkts[VMNET_SWITCH_BATCH];
+  for (int i = 0; i < n; i++) {
+    iov[i].iov_base = (void *)frames[i].data;
+    iov[i].iov_len = frames[i].len;
+    pkts[i].vm_pkt_size = frames[i].len;
+    pkts[i].vm_pkt_iov = &iov[i];
+    pkts[i].vm_pkt_iovcnt = 1;
+    pkts[i].vm_flags = 0;
+  }
+  vmnet_write_pkts(vms, pkts, n);
+}
+
+static void
+vmnet_switch_detach(void *ctx)
+{
+  struct vmnet_state *vms = ctx;
+  pthread_mutex_lock(&vms->rxm);
+  vms->sw = NULL;
+  pthread_mutex_unlock(&vms->rxm);
+}
+
+/* Called from the event callback: if the interface is a switch port, feed
+   everything it received to the switch and return 1. */
+static int
+vmnet_switch_poll(struct vmnet_state *vms)
+{
+  struct vmpktdesc pkts[VMNET_SWITCH_BATCH];
+  struct iovec iov[VMNET_SWITCH_BATCH];
+  struct vmnet_sw_frame frames[VMNET_SWITCH_BATCH];
+  pthread_mutex_lock(&vms->rxm);
+  struct vmnet_switch *sw = vms->sw;
+  int port = vms->sw_port;
+  if (sw)
+    vmnet_switch_retain(sw);
+  pthread_mutex_unlock(&vms->rxm);
+  if (!sw)
+    return 0;
+  int n;
+  do {
+    for (int i = 0; i < VMNET_SWITCH_BATCH; i++) {
+      iov[i].iov_base = vms->sw_scratch + i * vms->max_packet_size;
+      iov[i].iov_len = vms->max_packet_size;
+      pkts[i].vm_pkt_size = vms->max_packet_size;
+      pkts[i].vm_pkt_iov = &iov[i];
+      pkts[i].vm_pkt_iovcnt = 1;
+      pkts[i].vm_flags = 0;
+    }
+    n = VMNET_SWITCH_BATCH;
+    if (vmnet_read(vms->iref, pkts, &n) != VMNET_SUCCESS)
+      break;
+    vmnet_fanout_pkts(vms, pkts, n, VMNET_FANOUT_RX);
+    for (int i = 0; i < n; i++) {
+      frames[i].data = iov[i].iov_base;
+      frames[i].len = pkts[i].vm_pkt_size;
+    }
+    pthread_mutex_lock(&sw->lock);
+    /* The port may have been removed since we looked */
+    if (sw->ports[port].ctx == vms)
+      vmnet_switch_input(sw, port, frames, n, vmnet_switch_now());
+    pthread_mutex_unlock(&sw->lock);
+  } while (n == VMNET_SWITCH_BATCH);
+  vmnet_switch_release(sw);
+  return 1;
+}
+
+/* Cross-connects.  Two interfaces are wired together: each one's event
+   callback reads what it received in batches and writes the same buffers
+   to the other, so frames are neither copied nor seen by OCaml. */
+
+/* Called from the event callback: if the interface is cross-connected,
+   forward everything it received to its peer and return 1. */
+static int
+vmnet_xc_poll(struct vmnet_state *vms)
+{
+  struct vmpktdesc pkts[VMNET_SWITCH_BATCH];
+  struct iovec iov[VMNET_SWITCH_BATCH];
+  uint64_t forwarded = 0, dropped = 0;
+  pthread_mutex_lock(&vms->rxm);
+  struct vmnet_state *peer = vms->xc_peer;
+  pthread_mutex_unlock(&vms->rxm);
+  if (!peer)
+    return 0;
+  int n;
+  do {
+    for (int i = 0; i < VMNET_SWITCH_BATCH; i++) {
+      iov[i].iov_base = vms->sw_scratch + i * vms->max_packet_size;
+      iov[i].iov_len = vms->max_packet_size;
+      pkts[i].vm_pkt_size = vms->max_packet_size;
+      pkts[i].vm_pkt_iov = &iov[i];
+      pkts[i].vm_pkt_iovcnt = 1;
+      pkts[i].vm_flags = 0;
+    }
+    n = VMNET_SWITCH_BATCH;
+    if (vmnet_read(vms->iref, pkts, &n) != VMNET_SUCCESS)
+      break;
+    vmnet_fanout_pkts(vms, pkts, n, VMNET_FANOUT_RX);
+    int w = n > 0 ? vmnet_write_pkts(peer, pkts, n) : 0;
+    if (w < 0)
+      w = 0;
+    forwarded += w;
+    dropped += n - w;
+  } while (n == VMNET_SWITCH_BATCH);
+  pthread_mutex_lock(&vms->rxm);
+  vms->xc_forwarded += forwarded;
+  vms->xc_dropped += dropped;
+  pthread_mutex_unlock(&vms->rxm);
+  return 1;
+}
+
+static int
+vmnet_xc_alloc(struct vmnet_state *vms)
+{
+  if (vms->sw_scratch == NULL)
+    vms->sw_scratch = malloc((size_t)VMNET_SWITCH_BATCH * vms->max_packet_size);
+  return vms->sw_scratch != NULL;
+}
+
+/* Wire [v_a] and [v_b] together.  Returns 0, -1 if they are the same
+   interface, or -2 if either is attached to a switch or cross-connected
+   already. */
+CAMLprim value
+caml_vmnet_cross_connect(value v_a, value v_b)
+{
+  CAMLparam2(v_a, v_b);
+  struct vmnet_state *a = Vmnet_state_val(v_a);
+  struct vmnet_state *b = Vmnet_state_val(v_b);
+  if (a == b)
+    CAMLreturn(Val_int(-1));
+  if (!vmnet_xc_alloc(a) || !vmnet_xc_alloc(b))
+    caml_raise_out_of_memory();
+  /* Lock in a fixed order, so that two racing calls cannot deadlock */
+  struct vmnet_state *first = a < b ? a : b;
+  struct vmnet_state *second = a < b ? b : a;
+  int res = -2;
+  pthread_mutex_lock(&first->rxm);
+  pthread_mutex_lock(&second->rxm);
+  if (!a->sw && !b->sw && !a->xc_peer && !b->xc_peer) {
+    a->xc_peer = b;
+    b->xc_peer = a;
+    a->xc_forwarded = a->xc_dropped = 0;
+    b->xc_forwarded = b->xc_dropped = 0;
+    res = 0;
+  }
+  pthread_mutex_unlock(&second->rxm);
+  pthread_mutex_unlock(&first->rxm);
+  if (res == 0) {
+    vmnet_set_handler(a);
+    vmnet_set_handler(b);
+  }
+  CAMLreturn(Val_int(res));
+}
+
+/* Undo the cross-connect of [v_vmnet], if any, on both sides.  A batch
+   being forwarded when this is called still reaches the peer. */
+CAMLprim value
+caml_vmnet_cross_disconnect(value v_vmnet)
+{
+  CAMLparam1(v_vmnet);
+  struct vmnet_state *a = Vmnet_state_val(v_vmnet);
+  for (;;) {
+    pthread_mutex_lock(&a->rxm);
+    struct vmnet_state *b = a->xc_peer;
+    pthread_mutex_unlock(&a->rxm);
+    if (!b)
+      break;
+    struct vmnet_state *first = a < b ? a : b;
+    struct vmnet_state *second = a < b ? b : a;
+    pthread_mutex_lock(&first->rxm);
+    pthread_mutex_lock(&second->rxm);
+    /* It may have changed while nothing was locked */
+    int same = a->xc_peer == b;
+    if (same) {
+      a->xc_peer = NULL;
+      b->xc_peer = NULL;
+    }
+    pthread_mutex_unlock(&second->rxm);
+    pthread_mutex_unlock(&first->rxm);
+    if (same)
+      break;
+  }
+  CAMLreturn(Val_unit);
+}
 
+/* (forwarded, dropped): frames received on [v_vmnet] since it was
+   cross-connected, and those its peer refused */
+CAMLprim value
+caml_vmnet_cross_stats(value v_vmnet)
+{
+  CAMLparam1(v_vmnet);
+  CAMLlocal1(v_res);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  pthread_mutex_lock(&vms->rxm);
+  uint64_t forwarded = vms->xc_forwarded;
+  uint64_t dropped = vms->xc_dropped;
+  pthread_mutex_unlock(&vms->rxm);
+  v_res = caml_alloc_tuple(2);
+  Store_field(v_res, 0, Val_long(forwarded));
+  Store_field(v_res, 1, Val_long(dropped));
+  CAMLreturn(v_res);
+}
+
+/* Returns the port number, -1 if the switch is full, or -2 if the
+   interface is already attached to a switch. */
+CAMLprim value
+caml_vmnet_switch_attach(value v_sw, value v_vmnet)
+{
+  CAMLparam2(v_sw, v_vmnet);
+  struct vmnet_switch *sw = Vmnet_switch_val(v_sw);
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  int port = -2;
+  if (vms->sw_scratch == NULL) {
+    vms->sw_scratch = malloc((size_t)VMNET_SWITCH_BATCH * vms->max_packet_size);
+    if (!vms->sw_scratch)
+      caml_raise_out_of_memory();
+  }
+  pthread_mutex_lock(&sw->lock);
+  pthread_mutex_lock(&vms->rxm);
+  if (vms->sw == NULL && vms->xc_peer == NULL) {
+    port = vmnet_switch_add_port(sw, vmnet_switch_output, vms);
+    if (port >= 0) {
+      sw->ports[port].detach = vmnet_switch_detach;
+      vms->sw = sw;
+      vms->sw_port = port;
+    }
+  }
+  pthread_mutex_unlock(&vms->rxm);
+  pthread_mutex_unlock(&sw->lock);
+  if (port >= 0)
+    vmnet_set_handler(vms);
+  CAMLreturn(Val_int(port));
+}
+
+CAMLprim value
+caml_interface_get_port_forwarding_rules_start (value v_vmnet) {
+  CAMLparam1(v_vmnet);
+
+  #if __MAC_OS_X_VERSION_MAX_ALLOWED >= 101500
+  CAMLlocal1(v_op);
+
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
   interface_ref iface = vms->iref;
-  uint8_t _protocol = Int_val(v_protocol);
-  uint16_t _ext_port = Int_val(v_ext_port);
-  struct in_addr _int_addr;
-  inet_pton(AF_INET, String_val(v_int_addr), &_int_addr);
-  uint16_t _int_port = Int_val(v_int_port);
-
-  __block vmnet_return_t vmnet_status = 0;
-  dispatch_semaphore_t rule_added = dispatch_semaphore_create(0);
-
-  vmnet_return_t res = vmnet_interface_add_port_forwarding_rule(iface, _protocol, _ext_port, _int_addr, _int_port,
-    ^(vmnet_return_t status) {
-      vmnet_status = status;
-      dispatch_semaphore_signal(rule_added);
-      return;
-    });
+  v_op = alloc_vmnet_op(1, 0);
+  struct vmnet_op *op = Vmnet_op_val(v_op);
+
+  op->status = VMNET_SUCCESS;
+  vmnet_return_t res = VMNET_INVALID_ARGUMENT;
+  if (!vms->stopped)
+    res = vmnet_interface_get_port_forwarding_rules(iface,
+      ^(xpc_object_t rules) {
+        op->rules = rules;
+        if (op->rules != NULL)
+          xpc_retain(op->rules);
+        vmnet_op_complete(op);
+      });
 
   if (res != VMNET_SUCCESS) {
     // Failed to queue vmnet command
-    CAMLreturn(Val_int(res));
+    op->status = res;
+    vmnet_op_complete(op);
   }
 
-  // Wait for signal
-  dispatch_semaphore_wait(rule_added, DISPATCH_TIME_FOREVER);
-
-  CAMLreturn(Val_int(vmnet_status));
+  CAMLreturn(v_op);
 
   #else
   caml_raise_api_not_supported();
-  CAMLreturn(Val_int(1000)); // Not reached
+  CAMLreturn(Val_unit); // Not reached
   #endif
 }
 
 CAMLprim value
-caml_interface_get_port_forwarding_rules (value v_vmnet) {
-  CAMLparam1(v_vmnet);
+caml_interface_get_port_forwarding_rules_result (value v_op) {
+  CAMLparam1(v_op);
 
   #if __MAC_OS_X_VERSION_MAX_ALLOWED >= 101500
   CAMLlocal3(ret_array, v_ip, v_ret);
 
-  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
-
-  interface_ref iface = vms->iref;
-  dispatch_semaphore_t op_complete = dispatch_semaphore_create(0);
-  __block xpc_object_t vmnet_rules = NULL;
-
-  vmnet_return_t res = vmnet_interface_get_port_forwarding_rules(iface,
-    ^(xpc_object_t rules) {
-      vmnet_rules = rules;
-      if (vmnet_rules != NULL)
-        xpc_retain(vmnet_rules);
-      dispatch_semaphore_signal(op_complete);
-      return;
-    });
+  struct vmnet_op *op = Vmnet_op_val(v_op);
+  vmnet_op_check_complete(op);
 
-  // Failed to queue vmnet command
-  if (res != VMNET_SUCCESS) {
+  if (op->status != VMNET_SUCCESS) {
     value *v_exc = caml_named_value("vmnet_raw_return");
     if (!v_exc)
       caml_failwith("Vmnet.Error exception not registered");
-    caml_raise_with_arg(*v_exc, Val_int(res));
+    caml_raise_with_arg(*v_exc, Val_int(op->status));
   }
 
-  // Wait for signal
-  dispatch_semaphore_wait(op_complete, DISPATCH_TIME_FOREVER);
-
+  xpc_object_t vmnet_rules = op->rules;
   if (vmnet_rules != NULL) {
     size_t len = xpc_array_get_count(vmnet_rules);
 
@@ -370,7 +2206,7 @@ caml_interface_get_port_forwarding_rules (value v_vmnet) {
       struct in_addr _internal_address;
       uint16_t _internal_port;
 
-      res = vmnet_port_forwarding_rule_get_details(xpc_array_get_dictionary(vmnet_rules, i),
+      vmnet_return_t res = vmnet_port_forwarding_rule_get_details(xpc_array_get_dictionary(vmnet_rules, i),
                                                 &_protocol,
                                                 &_external_port,
                                                 &_internal_address,
@@ -378,7 +2214,6 @@ caml_interface_get_port_forwarding_rules (value v_vmnet) {
 
       // Failed to decode rule
       if (res != VMNET_SUCCESS) {
-        xpc_release(vmnet_rules);
         value *v_exc = caml_named_value("vmnet_raw_return");
         if (!v_exc)
           caml_failwith("Vmnet.Error exception not registered");
@@ -400,8 +2235,6 @@ caml_interface_get_port_forwarding_rules (value v_vmnet) {
       Store_field(ret_array, i, v_ret);
     }
 
-    xpc_release(vmnet_rules);
-
     CAMLreturn(ret_array);
   } else {
     CAMLreturn(Atom(0)); // Array empty
@@ -413,40 +2246,119 @@ caml_interface_get_port_forwarding_rules (value v_vmnet) {
   #endif
 }
 
+/* Port forwarding rules are added and removed in bulk: every request is
+   queued back to back and the returned operation completes once vmnet has
+   answered all of them, with one status per rule.  Single rules go through
+   the same path. */
+
+struct vmnet_fw_rule {
+  uint8_t protocol;
+  uint16_t ext_port;
+  struct in_addr int_addr;
+  uint16_t int_port;
+};
+
+static struct vmnet_fw_rule *
+vmnet_fw_rules_of_array(value v_rules, int with_target)
+{
+  size_t n = Wosize_val(v_rules);
+  struct vmnet_fw_rule *rules = calloc(n ? n : 1, sizeof(struct vmnet_fw_rule));
+  if (!rules)
+    caml_raise_out_of_memory();
+  for (size_t i = 0; i < n; i++) {
+    value v_rule = Field(v_rules, i);
+    rules[i].protocol = Int_val(Field(v_rule, 0));
+    rules[i].ext_port = Int_val(Field(v_rule, 1));
+    if (with_target) {
+      rules[i].int_addr.s_addr = htonl((uint32_t)Long_val(Field(v_rule, 2)));
+      rules[i].int_port = Int_val(Field(v_rule, 3));
+    }
+  }
+  return rules;
+}
+
 CAMLprim value
-caml_vmnet_interface_remove_port_forwarding_rule(value v_vmnet, value v_protocol,
-  value v_ext_port) {
-  CAMLparam3(v_vmnet, v_protocol, v_ext_port);
+caml_vmnet_interface_add_port_forwarding_rules(value v_vmnet, value v_rules)
+{
+  CAMLparam2(v_vmnet, v_rules);
+  CAMLlocal1(v_op);
 
   #if __MAC_OS_X_VERSION_MAX_ALLOWED >= 101500
   struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
-
   interface_ref iface = vms->iref;
-  uint8_t _protocol = Int_val(v_protocol);
-  uint16_t _ext_port = Int_val(v_ext_port);
+  size_t n = Wosize_val(v_rules);
+  struct vmnet_fw_rule *rules = vmnet_fw_rules_of_array(v_rules, 1);
 
-  __block vmnet_return_t vmnet_status = 0;
-  dispatch_semaphore_t rule_added = dispatch_semaphore_create(0);
-
-  vmnet_return_t res = vmnet_interface_remove_port_forwarding_rule(iface, _protocol, _ext_port,
-    ^(vmnet_return_t status) {
-      vmnet_status = status;
-      dispatch_semaphore_signal(rule_added);
-      return;
-    });
+  // One completion per rule, plus one for ourselves once all are queued
+  v_op = alloc_vmnet_op(n + 1, n);
+  struct vmnet_op *op = Vmnet_op_val(v_op);
 
-  if (res != VMNET_SUCCESS) {
-    // Failed to queue vmnet command
-    CAMLreturn(Val_int(res));
+  caml_release_runtime_system();
+  for (size_t i = 0; i < n; i++) {
+    vmnet_return_t res = VMNET_INVALID_ARGUMENT;
+    if (!vms->stopped)
+      res = vmnet_interface_add_port_forwarding_rule(iface,
+        rules[i].protocol, rules[i].ext_port, rules[i].int_addr, rules[i].int_port,
+        ^(vmnet_return_t status) {
+          op->statuses[i] = status;
+          vmnet_op_complete(op);
+        });
+    if (res != VMNET_SUCCESS) {
+      // Failed to queue vmnet command
+      op->statuses[i] = res;
+      vmnet_op_complete(op);
+    }
   }
+  vmnet_op_complete(op);
+  caml_acquire_runtime_system();
+
+  free(rules);
+  CAMLreturn(v_op);
 
-  // Wait for signal
-  dispatch_semaphore_wait(rule_added, DISPATCH_TIME_FOREVER);
+  #else
+  caml_raise_api_not_supported();
+  CAMLreturn(Val_unit); // Not reached
+  #endif
+}
+
+CAMLprim value
+caml_vmnet_interface_remove_port_forwarding_rules(value v_vmnet, value v_rules)
+{
+  CAMLparam2(v_vmnet, v_rules);
+  CAMLlocal1(v_op);
+
+  #if __MAC_OS_X_VERSION_MAX_ALLOWED >= 101500
+  struct vmnet_state *vms = Vmnet_state_val(v_vmnet);
+  interface_ref iface = vms->iref;
+  size_t n = Wosize_val(v_rules);
+  struct vmnet_fw_rule *rules = vmnet_fw_rules_of_array(v_rules, 0);
+
+  v_op = alloc_vmnet_op(n + 1, n);
+  struct vmnet_op *op = Vmnet_op_val(v_op);
+
+  caml_release_runtime_system();
+  for (size_t i = 0; i < n; i++) {
+    vmnet_return_t res = VMNET_INVALID_ARGUMENT;
+    if (!vms->stopped)
+      res = vmnet_interface_remove_port_forwarding_rule(iface,
+        rules[i].protocol, rules[i].ext_port,
+        ^(vmnet_return_t status) {
+          op->statuses[i] = status;
+          vmnet_op_complete(op);
+        });
+    if (res != VMNET_SUCCESS) {
+      op->statuses[i] = res;
+      vmnet_op_complete(op);
+    }
+  }
+  vmnet_op_complete(op);
+  caml_acquire_runtime_system();
 
-  CAMLreturn(Val_int(vmnet_status));
+  free(rules);
+  CAMLreturn(v_op);
 
   #else
   caml_raise_api_not_supported();
-  CAMLreturn(Val_int(1000)); // Not reached
+  CAMLreturn(Val_unit); // Not reached
   #endif
 }
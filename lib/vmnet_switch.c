@@ -0,0 +1,442 @@
+/*
+ * Copyright (C) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (C) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/custom.h>
+#include <caml/fail.h>
+#include <caml/bigarray.h>
+
+#include "vmnet_switch.h"
+
+static uint64_t
+mac_of(const uint8_t *p)
+{
+  return ((uint64_t)p[0] << 40) | ((uint64_t)p[1] << 32) |
+         ((uint64_t)p[2] << 24) | ((uint64_t)p[3] << 16) |
+         ((uint64_t)p[4] << 8) | (uint64_t)p[5];
+}
+
+static unsigned
+mac_hash(const struct vmnet_switch *sw, uint64_t mac)
+{
+  return (unsigned)((mac * 0x9e3779b97f4a7c15ULL) >> 32) & (sw->table_size - 1);
+}
+
+static int
+entry_fresh(const struct vmnet_switch *sw, const struct vmnet_sw_entry *e,
+            uint64_t now)
+{
+  return e->state == VMNET_SW_LIVE && now - e->seen <= sw->aging;
+}
+
+static int
+lookup(struct vmnet_switch *sw, uint64_t mac, uint64_t now)
+{
+  unsigned mask = sw->table_size - 1;
+  unsigned i = mac_hash(sw, mac);
+  for (unsigned probe = 0; probe < sw->table_size; probe++, i = (i + 1) & mask) {
+    struct vmnet_sw_entry *e = &sw->table[i];
+    if (e->state == VMNET_SW_EMPTY)
+      break;
+    if (e->state == VMNET_SW_LIVE && e->mac == mac)
+      return entry_fresh(sw, e, now) ? e->port : -1;
+  }
+  return -1;
+}
+
+/* Rebuild the table without stale and dead entries, doubling it if it is
+   more than half full of live ones.  The old table is kept if memory runs
+   out. */
+static void
+rehash(struct vmnet_switch *sw, uint64_t now)
+{
+  unsigned live = 0;
+  for (unsigned i = 0; i < sw->table_size; i++)
+    live += entry_fresh(sw, &sw->table[i], now);
+  unsigned size = live * 2 > sw->table_size ? sw->table_size * 2 : sw->table_size;
+  struct vmnet_sw_entry *table = calloc(size, sizeof(struct vmnet_sw_entry));
+  if (!table)
+    return;
+  struct vmnet_sw_entry *old = sw->table;
+  unsigned old_size = sw->table_size;
+  sw->table = table;
+  sw->table_size = size;
+  sw->used = 0;
+  for (unsigned i = 0; i < old_size; i++) {
+    if (!entry_fresh(sw, &old[i], now))
+      continue;
+    unsigned j = mac_hash(sw, old[i].mac);
+    while (table[j].state != VMNET_SW_EMPTY)
+      j = (j + 1) & (size - 1);
+    table[j] = old[i];
+    sw->used++;
+  }
+  free(old);
+}
+
+static void
+learn(struct vmnet_switch *sw, uint64_t mac, int port, uint64_t now)
+{
+  unsigned mask = sw->table_size - 1;
+  unsigned i = mac_hash(sw, mac);
+  int reuse = -1;
+  unsigned probe;
+  for (probe = 0; probe < sw->table_size; probe++, i = (i + 1) & mask) {
+    struct vmnet_sw_entry *e = &sw->table[i];
+    if (e->state == VMNET_SW_EMPTY)
+      break;
+    if (e->state == VMNET_SW_LIVE && e->mac == mac) {
+      e->port = port;
+      e->seen = now;
+      return;
+    }
+    if (reuse < 0 && !entry_fresh(sw, e, now))
+      reuse = i;
+  }
+  if (reuse < 0) {
+    if (probe == sw->table_size)
+      return;
+    reuse = i;
+    sw->used++;
+  }
+  sw->table[reuse].mac = mac;
+  sw->table[reuse].seen = now;
+  sw->table[reuse].port = port;
+  sw->table[reuse].state = VMNET_SW_LIVE;
+  sw->learned++;
+  if (sw->used > sw->table_size / 4 * 3)
+    rehash(sw, now);
+}
+
+int
+vmnet_switch_add_port(struct vmnet_switch *sw, vmnet_sw_output output, void *ctx)
+{
+  for (int p = 0; p < VMNET_SWITCH_MAX_PORTS; p++) {
+    if (sw->ports[p].output)
+      continue;
+    memset(&sw->ports[p], 0, sizeof(struct vmnet_sw_port));
+    sw->ports[p].output = output;
+    sw->ports[p].ctx = ctx;
+    sw->active[sw->nactive++] = p;
+    return p;
+  }
+  return -1;
+}
+
+void
+vmnet_switch_remove_port(struct vmnet_switch *sw, int port)
+{
+  struct vmnet_sw_port *p = &sw->ports[port];
+  if (p->detach)
+    p->detach(p->ctx);
+  vmnet_ring_free(&p->ring);
+  memset(p, 0, sizeof(*p));
+  for (int i = 0; i < sw->nactive; i++) {
+    if (sw->active[i] == port) {
+      sw->active[i] = sw->active[--sw->nactive];
+      break;
+    }
+  }
+  for (unsigned i = 0; i < sw->table_size; i++)
+    if (sw->table[i].state == VMNET_SW_LIVE && sw->table[i].port == port)
+      sw->table[i].state = VMNET_SW_DEAD;
+}
+
+static void
+enqueue(struct vmnet_switch *sw, int port, const struct vmnet_sw_frame *f)
+{
+  sw->out[port][sw->nout[port]++] = *f;
+}
+
+void
+vmnet_switch_input(struct vmnet_switch *sw, int in,
+                   const struct vmnet_sw_frame *frames, int n, uint64_t now)
+{
+  for (int i = 0; i < n; i++) {
+    const struct vmnet_sw_frame *f = &frames[i];
+    if (f->len < 14) {
+      sw->dropped++;
+      continue;
+    }
+    /* Group addresses are never sources */
+    if (!(f->data[6] & 1))
+      learn(sw, mac_of(f->data + 6), in, now);
+    int out = (f->data[0] & 1) ? -1 : lookup(sw, mac_of(f->data), now);
+    if (out == in) {
+      sw->dropped++;
+    } else if (out >= 0) {
+      enqueue(sw, out, f);
+      sw->forwarded++;
+    } else {
+      for (int a = 0; a < sw->nactive; a++)
+        if (sw->active[a] != in)
+          enqueue(sw, sw->active[a], f);
+      sw->flooded++;
+    }
+  }
+  for (int a = 0; a < sw->nactive; a++) {
+    int p = sw->active[a];
+    if (sw->nout[p] == 0)
+      continue;
+    sw->ports[p].tx += sw->nout[p];
+    sw->ports[p].output(sw->ports[p].ctx, sw->out[p], sw->nout[p]);
+    sw->nout[p] = 0;
+  }
+}
+
+void
+vmnet_switch_retain(struct vmnet_switch *sw)
+{
+  __sync_add_and_fetch(&sw->refs, 1);
+}
+
+void
+vmnet_switch_release(struct vmnet_switch *sw)
+{
+  if (__sync_sub_and_fetch(&sw->refs, 1) != 0)
+    return;
+  for (int p = 0; p < VMNET_SWITCH_MAX_PORTS; p++)
+    vmnet_ring_free(&sw->ports[p].ring);
+  pthread_mutex_destroy(&sw->lock);
+  free(sw->table);
+  free(sw);
+}
+
+void
+vmnet_switch_unlink(int fd)
+{
+  struct sockaddr_un sun;
+  socklen_t len = sizeof(sun);
+  memset(&sun, 0, sizeof(sun));
+  if (getsockname(fd, (struct sockaddr *)&sun, &len) == 0 &&
+      sun.sun_family == AF_UNIX && sun.sun_path[0] != '\0')
+    unlink(sun.sun_path);
+}
+
+uint64_t
+vmnet_switch_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Local ports queue what the switch sends them for OCaml to read */
+static void
+local_output(void *ctx, const struct vmnet_sw_frame *frames, int n)
+{
+  struct vmnet_sw_port *p = ctx;
+  if (p->ring.mem == NULL)
+    return;
+  for (int i = 0; i < n; i++)
+    if (!vmnet_ring_push(&p->ring, frames[i].data, frames[i].len))
+      p->dropped++;
+  vmnet_ring_commit(&p->ring);
+}
+
+static void
+vmnet_switch_finalize(value v_sw)
+{
+  struct vmnet_switch *sw = Vmnet_switch_val(v_sw);
+  pthread_mutex_lock(&sw->lock);
+  while (sw->nactive > 0)
+    vmnet_switch_remove_port(sw, sw->active[0]);
+  pthread_mutex_unlock(&sw->lock);
+  vmnet_switch_release(sw);
+}
+
+static struct custom_operations vmnet_switch_ops = {
+  "org.openmirage.vmnet.switch",
+  vmnet_switch_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+CAMLprim value
+caml_vmnet_switch_create(value v_table_size, value v_aging_ms)
+{
+  CAMLparam2(v_table_size, v_aging_ms);
+  CAMLlocal1(v_sw);
+  unsigned size = 16;
+  while (size < (unsigned)Long_val(v_table_size) && size < (1u << 24))
+    size *= 2;
+  struct vmnet_switch *sw = calloc(1, sizeof(struct vmnet_switch));
+  struct vmnet_sw_entry *table = calloc(size, sizeof(struct vmnet_sw_entry));
+  if (!sw || !table) {
+    free(sw);
+    free(table);
+    caml_raise_out_of_memory();
+  }
+  pthread_mutex_init(&sw->lock, NULL);
+  sw->refs = 1;
+  sw->table = table;
+  sw->table_size = size;
+  sw->aging = (uint64_t)Long_val(v_aging_ms) * 1000000ULL;
+  v_sw = caml_alloc_custom(&vmnet_switch_ops, sizeof(struct vmnet_switch *), 0, 1);
+  Vmnet_switch_val(v_sw) = sw;
+  CAMLreturn(v_sw);
+}
+
+/* Raise Invalid_argument unless [port] is in use.  Called with the lock
+   held, which it releases before raising. */
+void
+vmnet_switch_check_port(struct vmnet_switch *sw, long port)
+{
+  if (port < 0 || port >= VMNET_SWITCH_MAX_PORTS || !sw->ports[port].output) {
+    pthread_mutex_unlock(&sw->lock);
+    caml_invalid_argument("Vmnet.Switch: no such port");
+  }
+}
+
+/* Returns the port number, or -1 if the switch is full */
+CAMLprim value
+caml_vmnet_switch_add_local(value v_sw, value v_slots, value v_slot_size)
+{
+  CAMLparam3(v_sw, v_slots, v_slot_size);
+  struct vmnet_switch *sw = Vmnet_switch_val(v_sw);
+  struct vmnet_ring ring;
+  unsigned slots = 0;
+  memset(&ring, 0, sizeof(ring));
+  if (Long_val(v_slots) > 0) {
+    for (slots = 1; slots < (unsigned)Long_val(v_slots); slots *= 2);
+    if (!vmnet_ring_init(&ring, slots, Long_val(v_slot_size)))
+      caml_raise_out_of_memory();
+  }
+  pthread_mutex_lock(&sw->lock);
+  int port = vmnet_switch_add_port(sw, local_output, NULL);
+  if (port >= 0) {
+    sw->ports[port].ctx = &sw->ports[port];
+    sw->ports[port].ring = ring;
+  }
+  pthread_mutex_unlock(&sw->lock);
+  if (port < 0)
+    vmnet_ring_free(&ring);
+  CAMLreturn(Val_int(port));
+}
+
+CAMLprim value
+caml_vmnet_switch_remove_port(value v_sw, value v_port)
+{
+  CAMLparam2(v_sw, v_port);
+  struct vmnet_switch *sw = Vmnet_switch_val(v_sw);
+  pthread_mutex_lock(&sw->lock);
+  vmnet_switch_check_port(sw, Long_val(v_port));
+  vmnet_switch_remove_port(sw, Long_val(v_port));
+  pthread_mutex_unlock(&sw->lock);
+  CAMLreturn(Val_unit);
+}
+
+/* Switch the (buffer, offset, length) frames of [v_bufs] as if received
+   on [v_port] */
+CAMLprim value
+caml_vmnet_switch_inject(value v_sw, value v_port, value v_bufs)
+{
+  CAMLparam3(v_sw, v_port, v_bufs);
+  struct vmnet_switch *sw = Vmnet_switch_val(v_sw);
+  struct vmnet_sw_frame frames[VMNET_SWITCH_BATCH];
+  size_t n = Wosize_val(v_bufs);
+  int port = Long_val(v_port);
+  pthread_mutex_lock(&sw->lock);
+  vmnet_switch_check_port(sw, port);
+  uint64_t now = vmnet_switch_now();
+  for (size_t i = 0; i < n; ) {
+    int batch = 0;
+    for (; i < n && batch < VMNET_SWITCH_BATCH; i++, batch++) {
+      value v_buf = Field(v_bufs, i);
+      frames[batch].data = (uint8_t *)Caml_ba_data_val(Field(v_buf, 0)) + Long_val(Field(v_buf, 1));
+      frames[batch].len = Long_val(Field(v_buf, 2));
+    }
+    vmnet_switch_input(sw, port, frames, batch, now);
+  }
+  pthread_mutex_unlock(&sw->lock);
+  CAMLreturn(Val_unit);
+}
+
+/* Take the oldest frame queued on local port [v_port].  Returns its
+   length, 0 if there is none, or -1 if it does not fit in the buffer. */
+CAMLprim value
+caml_vmnet_switch_read(value v_sw, value v_port, value v_ba, value v_off,
+		value v_len)
+{
+  CAMLparam5(v_sw, v_port, v_ba, v_off, v_len);
+  struct vmnet_switch *sw = Vmnet_switch_val(v_sw);
+  uint8_t *buf = (uint8_t *)Caml_ba_data_val(v_ba) + Long_val(v_off);
+  int r = 0;
+  pthread_mutex_lock(&sw->lock);
+  vmnet_switch_check_port(sw, Long_val(v_port));
+  struct vmnet_ring *ring = &sw->ports[Long_val(v_port)].ring;
+  if (ring->mem && vmnet_ring_count(ring) > 0) {
+    struct vmnet_ring_meta *m = vmnet_ring_meta(ring, ring->tail);
+    if (m->len > (size_t)Long_val(v_len)) {
+      r = -1;
+    } else {
+      memcpy(buf, vmnet_ring_slot(ring, ring->tail), m->len);
+      r = m->len;
+      vmnet_ring_take(ring, 1);
+    }
+  }
+  pthread_mutex_unlock(&sw->lock);
+  CAMLreturn(Val_int(r));
+}
+
+CAMLprim value
+caml_vmnet_switch_stats(value v_sw)
+{
+  CAMLparam1(v_sw);
+  CAMLlocal1(v_res);
+  struct vmnet_switch *sw = Vmnet_switch_val(v_sw);
+  uint64_t now = vmnet_switch_now();
+  unsigned entries = 0;
+  v_res = caml_alloc_tuple(5);
+  pthread_mutex_lock(&sw->lock);
+  for (unsigned i = 0; i < sw->table_size; i++)
+    entries += entry_fresh(sw, &sw->table[i], now);
+  Field(v_res, 0) = Val_long(sw->forwarded);
+  Field(v_res, 1) = Val_long(sw->flooded);
+  Field(v_res, 2) = Val_long(sw->dropped);
+  Field(v_res, 3) = Val_long(sw->learned);
+  Field(v_res, 4) = Val_long(entries);
+  pthread_mutex_unlock(&sw->lock);
+  CAMLreturn(v_res);
+}
+
+/* (frames sent out of the port, frames dropped because its queue was full) */
+CAMLprim value
+caml_vmnet_switch_port_stats(value v_sw, value v_port)
+{
+  CAMLparam2(v_sw, v_port);
+  CAMLlocal1(v_res);
+  struct vmnet_switch *sw = Vmnet_switch_val(v_sw);
+  v_res = caml_alloc_tuple(2);
+  pthread_mutex_lock(&sw->lock);
+  vmnet_switch_check_port(sw, Long_val(v_port));
+  Field(v_res, 0) = Val_long(sw->ports[Long_val(v_port)].tx);
+  Field(v_res, 1) = Val_long(sw->ports[Long_val(v_port)].dropped);
+  pthread_mutex_unlock(&sw->lock);
+  CAMLreturn(v_res);
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (C) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A learning Ethernet switch between ports that are either vmnet
+   interfaces or local queues.  Frames are switched in batches: sources
+   are learned into an open-addressing MAC table, and each destination
+   port is handed all of its frames of the batch in one call. */
+
+#ifndef VMNET_SWITCH_H
+#define VMNET_SWITCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "vmnet_ring.h"
+
+#define VMNET_SWITCH_MAX_PORTS 64
+#define VMNET_SWITCH_BATCH     32
+
+struct vmnet_sw_frame {
+  const uint8_t *data;
+  size_t len;
+};
+
+/* Transmit [n] frames out of a port.  Called with the switch locked. */
+typedef void (*vmnet_sw_output)(void *ctx, const struct vmnet_sw_frame *frames,
+                                int n);
+
+#define VMNET_SW_EMPTY 0   /* never used: ends a probe sequence */
+#define VMNET_SW_LIVE  1
+#define VMNET_SW_DEAD  2   /* port removed: reusable, but keep probing */
+
+struct vmnet_sw_entry {
+  uint64_t mac;
+  uint64_t seen;       /* when the address was last a source */
+  int16_t port;
+  uint8_t state;
+};
+
+/* Called with the switch locked when a port is removed */
+typedef void (*vmnet_sw_detach)(void *ctx);
+
+struct vmnet_sw_port {
+  vmnet_sw_output output; /* NULL if the port is free */
+  vmnet_sw_detach detach;
+  void *ctx;
+  /* Local ports queue their frames here (ring.mem is NULL for a sink) */
+  struct vmnet_ring ring;
+  uint64_t tx;         /* frames switched out of the port */
+  uint64_t dropped;    /* ... that did not fit in its ring */
+};
+
+struct vmnet_switch {
+  pthread_mutex_t lock;
+  int refs;            /* OCaml handle + callbacks switching frames */
+  struct vmnet_sw_entry *table;
+  unsigned table_size; /* power of two */
+  unsigned used;       /* slots that are not EMPTY */
+  uint64_t aging;      /* entries unseen for longer are ignored */
+  struct vmnet_sw_port ports[VMNET_SWITCH_MAX_PORTS];
+  int active[VMNET_SWITCH_MAX_PORTS]; /* ports in use, for flooding */
+  int nactive;
+  struct vmnet_sw_frame out[VMNET_SWITCH_MAX_PORTS][VMNET_SWITCH_BATCH];
+  int nout[VMNET_SWITCH_MAX_PORTS];
+  uint64_t forwarded;
+  uint64_t flooded;
+  uint64_t dropped;
+  uint64_t learned;
+};
+
+/* The switch behind an OCaml Vmnet.Switch.t */
+#define Vmnet_switch_val(v) (*((struct vmnet_switch **) Data_custom_val(v)))
+
+/* The functions below must be called with [lock] held */
+
+/* Returns the new port number, or -1 if all ports are in use. */
+int vmnet_switch_add_port(struct vmnet_switch *sw, vmnet_sw_output output,
+                          void *ctx);
+void vmnet_switch_remove_port(struct vmnet_switch *sw, int port);
+
+/* Switch [n] (at most VMNET_SWITCH_BATCH) frames received on [in] at time
+   [now] (in nanoseconds). */
+void vmnet_switch_input(struct vmnet_switch *sw, int in,
+                        const struct vmnet_sw_frame *frames, int n,
+                        uint64_t now);
+
+/* Raise Invalid_argument, after unlocking, unless [port] is in use. */
+void vmnet_switch_check_port(struct vmnet_switch *sw, long port);
+
+/* The switch is freed, ports and all, when the last reference goes */
+void vmnet_switch_retain(struct vmnet_switch *sw);
+void vmnet_switch_release(struct vmnet_switch *sw);
+
+/* Remove the file the Unix socket [fd] of a port is bound to */
+void vmnet_switch_unlink(int fd);
+
+/* Monotonic clock in nanoseconds */
+uint64_t vmnet_switch_now(void);
+
+#endif /* VMNET_SWITCH_H */
@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (C) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "vmnet_packet.h"
+#include "vmnet_tx.h"
+
+/* How long to wait before retrying a queue the output refused */
+#define RETRY_NS 1000000ULL
+
+static void
+tb_refill(struct vmnet_tb *tb, double dt)
+{
+  if (tb->rate == 0)
+    return;
+  tb->tokens += tb->rate * dt;
+  if (tb->tokens > tb->burst)
+    tb->tokens = tb->burst;
+}
+
+/* A full bucket lets any frame through, so that frames larger than the
+   burst are delayed rather than stuck; the bucket then goes into debt. */
+static int
+tb_conforms(const struct vmnet_tb *tb, double cost)
+{
+  return tb->rate == 0 || tb->tokens >= cost || tb->tokens >= tb->burst;
+}
+
+/* Nanoseconds until [cost] tokens conform */
+static uint64_t
+tb_wait(const struct vmnet_tb *tb, double cost)
+{
+  if (tb_conforms(tb, cost))
+    return 0;
+  double need = (cost < tb->burst ? cost : tb->burst) - tb->tokens;
+  return (uint64_t)(need / tb->rate * 1e9) + 1;
+}
+
+static void
+tb_take(struct vmnet_tb *tb, double cost)
+{
+  if (tb->rate != 0)
+    tb->tokens -= cost;
+}
+
+static int
+shaper_conforms(const struct vmnet_shaper *s, size_t len)
+{
+  return tb_conforms(&s->bytes, len) && tb_conforms(&s->pkts, 1);
+}
+
+static uint64_t
+shaper_wait(const struct vmnet_shaper *s, size_t len)
+{
+  uint64_t a = tb_wait(&s->bytes, len);
+  uint64_t b = tb_wait(&s->pkts, 1);
+  return a > b ? a : b;
+}
+
+static void
+shaper_take(struct vmnet_shaper *s, size_t len, double sign)
+{
+  tb_take(&s->bytes, sign * len);
+  tb_take(&s->pkts, sign);
+}
+
+static void
+refill(struct vmnet_tx *tx, uint64_t now)
+{
+  double dt = (now - tx->last) / 1e9;
+  tx->last = now;
+  tb_refill(&tx->shaper.bytes, dt);
+  tb_refill(&tx->shaper.pkts, dt);
+  for (int c = 0; c < tx->nclasses; c++) {
+    tb_refill(&tx->cls[c].shaper.bytes, dt);
+    tb_refill(&tx->cls[c].shaper.pkts, dt);
+  }
+}
+
+static int
+dscp_of(const uint8_t *frame, size_t len, size_t l3_off, int ethertype)
+{
+  const uint8_t *ip = frame + l3_off;
+  if (ethertype == VMNET_ETHERTYPE_IPV4 && len >= l3_off + 2)
+    return ip[1] >> 2;
+  if (ethertype == VMNET_ETHERTYPE_IPV6 && len >= l3_off + 2)
+    return (((ip[0] & 0x0f) << 4) | (ip[1] >> 4)) >> 2;
+  return -1;
+}
+
+static int
+classify(const struct vmnet_tx *tx, const uint8_t *frame, size_t len)
+{
+  if (len < VMNET_ETH_HLEN)
+    return 0;
+  int ethertype = vmnet_get_be16(frame + 12);
+  size_t l3_off = VMNET_ETH_HLEN;
+  if (ethertype == VMNET_ETHERTYPE_VLAN && len >= VMNET_ETH_HLEN + 4) {
+    ethertype = vmnet_get_be16(frame + 16);
+    l3_off += 4;
+  }
+  int dscp = -2;               /* not looked at yet */
+  for (size_t i = 0; i < tx->nrules; i++) {
+    const struct vmnet_tx_rule *r = &tx->rules[i];
+    if (r->ethertype >= 0 && r->ethertype != ethertype)
+      continue;
+    if (r->dscp >= 0) {
+      if (dscp == -2)
+        dscp = dscp_of(frame, len, l3_off, ethertype);
+      if (r->dscp != dscp)
+        continue;
+    }
+    return r->cls;
+  }
+  return 0;
+}
+
+/* Hand out[0..n) to the output.  Frames it did not take give their tokens
+   back.  Returns what the output returned. */
+static int
+flush(struct vmnet_tx *tx, const struct vmnet_tx_frame *out, const int *cls,
+      int n)
+{
+  if (n == 0)
+    return 0;
+  int res = tx->output(tx->ctx, out, n);
+  int sent = res > 0 ? res : 0;
+  for (int i = 0; i < n; i++) {
+    if (i < sent) {
+      tx->cls[cls[i]].sent++;
+    } else {
+      shaper_take(&tx->shaper, out[i].len, -1);
+      shaper_take(&tx->cls[cls[i]].shaper, out[i].len, -1);
+    }
+  }
+  return res;
+}
+
+/* Hand out[0..n) to the output, in order, when queueing.  A frame it
+   refuses for any reason but being backed up is dropped, or it would hold
+   up its class forever; when a batch is refused, its first frame is sent
+   alone to find out which.  Returns how many frames were sent or dropped:
+   fewer than [n] when the output is backed up, and the rest must wait. */
+static int
+send_frames(struct vmnet_tx *tx, const struct vmnet_tx_frame *out,
+            const int *cls, int n)
+{
+  int done = 0;
+  while (done < n) {
+    int res = flush(tx, out + done, cls + done, n - done);
+    if (res < 0 && res != tx->busy && n - done > 1)
+      res = flush(tx, out + done, cls + done, 1);
+    if (res > 0) {
+      done += res;
+    } else if (res == 0 || res == tx->busy) {
+      break;
+    } else {
+      tx->cls[cls[done]].dropped++;
+      done++;
+    }
+  }
+  return done;
+}
+
+/* Frames are waiting in class [c] or a higher one */
+static int
+backlog(const struct vmnet_tx *tx, int c)
+{
+  for (int k = c; k < tx->nclasses; k++)
+    if (vmnet_ring_count(&tx->cls[k].ring) > 0)
+      return 1;
+  return 0;
+}
+
+static void
+enqueue(struct vmnet_tx *tx, struct vmnet_tx_class *k,
+        const struct vmnet_tx_frame *f)
+{
+  if (tx->policy == VMNET_TX_QUEUE && vmnet_ring_push(&k->ring, f->data, f->len))
+    vmnet_ring_commit(&k->ring);
+  else
+    k->dropped++;
+}
+
+int
+vmnet_tx_input(struct vmnet_tx *tx, const struct vmnet_tx_frame *frames,
+               int n, int cls, uint64_t now)
+{
+  struct vmnet_tx_frame out[VMNET_TX_BATCH];
+  int out_cls[VMNET_TX_BATCH];
+  int nout = 0;
+  int start = 0;               /* index in [frames] of out[0] */
+  refill(tx, now);
+  for (int i = 0; i <= n; i++) {
+    int c = 0;
+    int conform = 1;
+    int pass = 0;
+    if (i < n) {
+      c = cls >= 0 ? cls : classify(tx, frames[i].data, frames[i].len);
+      struct vmnet_tx_class *k = &tx->cls[c];
+      conform = shaper_conforms(&tx->shaper, frames[i].len) &&
+                shaper_conforms(&k->shaper, frames[i].len);
+      pass = conform && !backlog(tx, c);
+      if (pass) {
+        shaper_take(&tx->shaper, frames[i].len, 1);
+        shaper_take(&k->shaper, frames[i].len, 1);
+        out[nout] = frames[i];
+        out_cls[nout++] = c;
+        if (nout < VMNET_TX_BATCH)
+          continue;
+      }
+    }
+    /* Frames before this one must be out before it is queued or dropped */
+    if (tx->policy != VMNET_TX_QUEUE) {
+      int res = flush(tx, out, out_cls, nout);
+      if (res < nout)
+        return res > 0 ? start + res : (start > 0 ? start : res);
+    } else {
+      /* What vmnet has no room for yet waits for the drain */
+      for (int j = send_frames(tx, out, out_cls, nout); j < nout; j++)
+        enqueue(tx, &tx->cls[out_cls[j]], &out[j]);
+    }
+    nout = 0;
+    start = i + 1;
+    if (i == n || pass)
+      continue;
+    struct vmnet_tx_class *k = &tx->cls[c];
+    if (!conform)
+      k->shaped++;
+    enqueue(tx, k, &frames[i]);
+  }
+  return n;
+}
+
+uint64_t
+vmnet_tx_drain(struct vmnet_tx *tx, uint64_t now)
+{
+  struct vmnet_tx_frame out[VMNET_TX_BATCH];
+  int out_cls[VMNET_TX_BATCH];
+  uint64_t wait = 0;
+  refill(tx, now);
+  for (int c = tx->nclasses - 1; c >= 0; c--) {
+    struct vmnet_tx_class *k = &tx->cls[c];
+    while (vmnet_ring_count(&k->ring) > 0) {
+      int nout = 0;
+      uint64_t w = 0;
+      for (unsigned i = k->ring.tail; i != k->ring.head && nout < VMNET_TX_BATCH; i++) {
+        size_t len = vmnet_ring_meta(&k->ring, i)->len;
+        if (!shaper_conforms(&tx->shaper, len) || !shaper_conforms(&k->shaper, len)) {
+          uint64_t a = shaper_wait(&tx->shaper, len);
+          uint64_t b = shaper_wait(&k->shaper, len);
+          w = a > b ? a : b;
+          break;
+        }
+        shaper_take(&tx->shaper, len, 1);
+        shaper_take(&k->shaper, len, 1);
+        out[nout].data = vmnet_ring_slot(&k->ring, i);
+        out[nout].len = len;
+        out_cls[nout++] = c;
+      }
+      int res = send_frames(tx, out, out_cls, nout);
+      if (res > 0)
+        vmnet_ring_take(&k->ring, res);
+      /* Lower classes must not overtake while vmnet is backed up */
+      if (res < nout)
+        return RETRY_NS;
+      if (w) {
+        if (wait == 0 || w < wait)
+          wait = w;
+        break;
+      }
+    }
+  }
+  return wait;
+}
+
+unsigned
+vmnet_tx_queued(const struct vmnet_tx *tx)
+{
+  unsigned n = 0;
+  for (int c = 0; c < tx->nclasses; c++)
+    n += vmnet_ring_count(&tx->cls[c].ring);
+  return n;
+}
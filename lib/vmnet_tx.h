@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (C) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Transmit shaping and priority.  Frames written from OCaml are sorted into
+   classes by EtherType and DSCP, or by the caller, and must conform to the
+   token buckets of their class and of the interface before they are handed
+   to the output function.  Frames that do not are either dropped or queued
+   per class until the buckets have refilled.  When queueing, frames the
+   output refuses because it is backed up are queued too, those it refuses
+   for any other reason are dropped, and the queues are drained in strict
+   priority order: the highest class first, and a frame only bypasses the
+   queues if its own class and all higher ones are empty. */
+
+#ifndef VMNET_TX_H
+#define VMNET_TX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "vmnet_ring.h"
+
+#define VMNET_TX_CLASSES 8
+#define VMNET_TX_BATCH   32
+
+#define VMNET_TX_DROP    0
+#define VMNET_TX_QUEUE   1
+
+struct vmnet_tx_frame {
+  const uint8_t *data;
+  size_t len;
+};
+
+/* Write [n] frames.  Returns how many were accepted, or the negated
+   vmnet_return_t if none was. */
+typedef int (*vmnet_tx_output)(void *ctx, const struct vmnet_tx_frame *frames,
+                               int n);
+
+/* A token bucket filling at [rate] tokens per second up to [burst].  A
+   rate of 0 means no limit. */
+struct vmnet_tb {
+  double rate;
+  double burst;
+  double tokens;
+};
+
+/* Limits in bytes and in frames */
+struct vmnet_shaper {
+  struct vmnet_tb bytes;
+  struct vmnet_tb pkts;
+};
+
+/* Frames whose EtherType (after one VLAN tag) and IP DSCP match, -1
+   matching anything, belong to [cls] */
+struct vmnet_tx_rule {
+  int ethertype;
+  int dscp;
+  int cls;
+};
+
+struct vmnet_tx_class {
+  struct vmnet_shaper shaper;
+  struct vmnet_ring ring;  /* frames waiting (VMNET_TX_QUEUE) */
+  uint64_t sent;
+  uint64_t shaped;         /* did not conform when written */
+  uint64_t dropped;        /* not sent: shaped when dropping, the ring
+                              was full or the output refused it */
+};
+
+struct vmnet_tx {
+  pthread_mutex_t lock;
+  int enabled;             /* frames go straight to the output when 0 */
+  int policy;
+  struct vmnet_shaper shaper; /* the whole interface */
+  uint64_t last;           /* when the buckets were last refilled */
+  struct vmnet_tx_rule *rules; /* first match wins, else class 0 */
+  size_t nrules;
+  int nclasses;
+  struct vmnet_tx_class cls[VMNET_TX_CLASSES];
+  int timer_armed;         /* a drain is scheduled */
+  vmnet_tx_output output;
+  void *ctx;
+  int busy;                /* what the output returns when backed up */
+};
+
+/* The functions below must be called with [lock] held; [now] is in
+   nanoseconds. */
+
+/* Classify [n] (at most VMNET_TX_BATCH) frames, unless [cls] is a class
+   for all of them, send those that may go and drop or queue the others.
+   Returns the number of frames dealt with.  That is [n] when queueing,
+   so the caller never learns that the output was backed up;
+   otherwise it is less if the output accepted fewer frames than it was
+   given, or the negated vmnet_return_t if it accepted none of the first
+   ones. */
+int vmnet_tx_input(struct vmnet_tx *tx, const struct vmnet_tx_frame *frames,
+                   int n, int cls, uint64_t now);
+
+/* Send the queued frames that conform by now.  Returns how many
+   nanoseconds to wait before calling it again, or 0 if nothing is
+   queued. */
+uint64_t vmnet_tx_drain(struct vmnet_tx *tx, uint64_t now);
+
+/* Frames waiting in the queues of all classes */
+unsigned vmnet_tx_queued(const struct vmnet_tx *tx);
+
+#endif /* VMNET_TX_H */
@@ -0,0 +1,822 @@
+/*
+ * Copyright (C) 2014 Anil Madhavapeddy <anil@recoil.org>
+ * Copyright (C) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A vhost-user network backend plugged into a switch port.  A hypervisor
+   connects to the listening socket, shares the guest memory and the
+   virtqueues of its virtio-net device, and frames then move between those
+   queues and the switch in C: frames the guest transmits are switched
+   straight from guest memory when they sit in one descriptor, and frames
+   switched to the port are copied once, into the guest's receive buffers.
+   Used entries are published once per batch, kicks are suppressed while
+   the transmit queue is being drained, and the guest is only notified if
+   it asked to be.  One queue pair of split virtqueues is supported.  None
+   of this depends on vmnet.framework. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/custom.h>
+#include <caml/fail.h>
+
+#include "vmnet_packet.h"
+#include "vmnet_switch.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Front-end requests */
+#define VHOST_USER_GET_FEATURES          1
+#define VHOST_USER_SET_FEATURES          2
+#define VHOST_USER_SET_OWNER             3
+#define VHOST_USER_RESET_OWNER           4
+#define VHOST_USER_SET_MEM_TABLE         5
+#define VHOST_USER_SET_LOG_BASE          6
+#define VHOST_USER_SET_LOG_FD            7
+#define VHOST_USER_SET_VRING_NUM         8
+#define VHOST_USER_SET_VRING_ADDR        9
+#define VHOST_USER_SET_VRING_BASE        10
+#define VHOST_USER_GET_VRING_BASE        11
+#define VHOST_USER_SET_VRING_KICK        12
+#define VHOST_USER_SET_VRING_CALL        13
+#define VHOST_USER_SET_VRING_ERR         14
+#define VHOST_USER_GET_PROTOCOL_FEATURES 15
+#define VHOST_USER_SET_PROTOCOL_FEATURES 16
+#define VHOST_USER_GET_QUEUE_NUM         17
+#define VHOST_USER_SET_VRING_ENABLE      18
+
+#define VHOST_USER_VERSION    0x1
+#define VHOST_USER_REPLY      0x4
+#define VHOST_USER_VRING_NOFD 0x100
+
+#define VIRTIO_F_VERSION_1             (1ULL << 32)
+#define VHOST_USER_F_PROTOCOL_FEATURES (1ULL << 30)
+#define VHOST_FEATURES (VIRTIO_F_VERSION_1 | VHOST_USER_F_PROTOCOL_FEATURES)
+
+#define VRING_DESC_F_NEXT          1
+#define VRING_DESC_F_WRITE         2
+#define VRING_USED_F_NO_NOTIFY     1
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+
+#define VHOST_MAX_REGIONS 8
+#define VHOST_MAX_FDS     8
+#define VHOST_MAX_VRING   32768
+#define VHOST_RX 0           /* frames to the guest */
+#define VHOST_TX 1           /* frames from the guest */
+#define VHOST_TX_BUDGET 16   /* batches switched per wake-up */
+
+struct vhost_msg {
+  uint32_t request;
+  uint32_t flags;
+  uint32_t size;
+  union {
+    uint64_t u64;
+    struct {
+      uint32_t index;
+      uint32_t num;
+    } state;
+    struct {
+      uint32_t index;
+      uint32_t flags;
+      uint64_t desc;
+      uint64_t used;
+      uint64_t avail;
+      uint64_t log;
+    } addr;
+    struct {
+      uint32_t nregions;
+      uint32_t padding;
+      struct {
+        uint64_t gpa;
+        uint64_t size;
+        uint64_t uva;
+        uint64_t mmap_offset;
+      } regions[VHOST_MAX_REGIONS];
+    } mem;
+  } payload;
+} __attribute__((packed));
+
+#define VHOST_MSG_HLEN 12
+
+struct vring_desc {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+};
+
+struct vring_avail {
+  uint16_t flags;
+  uint16_t idx;
+  uint16_t ring[];
+};
+
+struct vring_used_elem {
+  uint32_t id;
+  uint32_t len;
+};
+
+struct vring_used {
+  uint16_t flags;
+  uint16_t idx;
+  struct vring_used_elem ring[];
+};
+
+struct vhost_region {
+  uint64_t gpa;
+  uint64_t size;
+  uint64_t uva;
+  uint8_t *base;       /* where gpa is mapped */
+  void *map;
+  size_t map_len;
+};
+
+struct vhost_vq {
+  unsigned num;
+  struct vring_desc *desc;
+  struct vring_avail *avail;
+  struct vring_used *used;
+  uint16_t last_avail;
+  int kick;            /* -1 if none */
+  int call;
+  int started;         /* has addresses and was given a kick */
+  int enabled;
+};
+
+struct vmnet_vhost {
+  struct vmnet_switch *sw;
+  struct vmnet_sw_port *port;
+  int port_no;
+  int stopping;        /* the port was removed */
+  int listen_fd;
+  int conn_fd;         /* -1 until a front-end connects */
+  int wake[2];         /* written to stop the thread */
+  uint64_t features;
+  uint64_t protocol_features;
+  struct vhost_region regions[VHOST_MAX_REGIONS];
+  int nregions;
+  struct vhost_vq vq[2];
+  uint8_t *scratch;    /* VMNET_SWITCH_BATCH frames from the guest */
+};
+
+#define VHOST_FRAME_MAX VMNET_GRO_SLOT
+
+/* The functions below are called with the switch locked, unless noted */
+
+static uint8_t *
+vhost_gpa(struct vmnet_vhost *vh, uint64_t gpa, uint64_t len)
+{
+  for (int i = 0; i < vh->nregions; i++) {
+    struct vhost_region *r = &vh->regions[i];
+    if (gpa >= r->gpa && len <= r->size && gpa - r->gpa <= r->size - len)
+      return r->base + (gpa - r->gpa);
+  }
+  return NULL;
+}
+
+static uint8_t *
+vhost_uva(struct vmnet_vhost *vh, uint64_t uva, uint64_t len)
+{
+  for (int i = 0; i < vh->nregions; i++) {
+    struct vhost_region *r = &vh->regions[i];
+    if (uva >= r->uva && len <= r->size && uva - r->uva <= r->size - len)
+      return r->base + (uva - r->uva);
+  }
+  return NULL;
+}
+
+static size_t
+vhost_hdr_len(const struct vmnet_vhost *vh)
+{
+  return (vh->features & VIRTIO_F_VERSION_1) ? 12 : 10;
+}
+
+static int
+vhost_vq_ready(const struct vhost_vq *vq)
+{
+  return vq->started && vq->enabled && vq->desc != NULL;
+}
+
+static void
+vhost_signal(struct vhost_vq *vq)
+{
+  uint64_t one = 1;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (vq->call >= 0 && !(vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT))
+    while (write(vq->call, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+static void
+vhost_unmap(struct vmnet_vhost *vh)
+{
+  for (int i = 0; i < vh->nregions; i++)
+    munmap(vh->regions[i].map, vh->regions[i].map_len);
+  vh->nregions = 0;
+  for (int q = 0; q < 2; q++) {
+    vh->vq[q].desc = NULL;
+    vh->vq[q].avail = NULL;
+    vh->vq[q].used = NULL;
+  }
+}
+
+static void
+vhost_vq_reset(struct vhost_vq *vq)
+{
+  if (vq->kick >= 0)
+    close(vq->kick);
+  if (vq->call >= 0)
+    close(vq->call);
+  memset(vq, 0, sizeof(*vq));
+  vq->kick = -1;
+  vq->call = -1;
+}
+
+/* Forget the front-end, ready for the next one */
+static void
+vhost_reset(struct vmnet_vhost *vh)
+{
+  vhost_unmap(vh);
+  for (int q = 0; q < 2; q++)
+    vhost_vq_reset(&vh->vq[q]);
+  vh->features = 0;
+  vh->protocol_features = 0;
+  if (vh->conn_fd >= 0)
+    close(vh->conn_fd);
+  vh->conn_fd = -1;
+}
+
+/* Descriptor [i] of [vq].  The guest can rewrite descriptors at any time,
+   so each is read once and only the copy is checked and used. */
+static void
+vhost_desc_get(const struct vhost_vq *vq, unsigned i, struct vring_desc *d)
+{
+  const struct vring_desc *g = &vq->desc[i];
+  d->addr = __atomic_load_n(&g->addr, __ATOMIC_RELAXED);
+  d->len = __atomic_load_n(&g->len, __ATOMIC_RELAXED);
+  d->flags = __atomic_load_n(&g->flags, __ATOMIC_RELAXED);
+  d->next = __atomic_load_n(&g->next, __ATOMIC_RELAXED);
+}
+
+/* The frame in the descriptor chain at [head], without its virtio-net
+   header: pointed to in guest memory if it is in one descriptor, copied
+   to [buf] otherwise.  Returns its length, or 0 if the chain is bad. */
+static size_t
+vhost_gather(struct vmnet_vhost *vh, struct vhost_vq *vq, uint16_t head,
+             uint8_t *buf, const uint8_t **data)
+{
+  size_t skip = vhost_hdr_len(vh);
+  size_t len = 0;
+  unsigned i = head;
+  for (unsigned n = 0; n < vq->num; n++) {
+    if (i >= vq->num)
+      return 0;
+    struct vring_desc d;
+    vhost_desc_get(vq, i, &d);
+    uint8_t *p = vhost_gpa(vh, d.addr, d.len);
+    if (!p || (d.flags & VRING_DESC_F_WRITE))
+      return 0;
+    size_t dlen = d.len;
+    if (skip >= dlen) {
+      skip -= dlen;
+    } else {
+      p += skip;
+      dlen -= skip;
+      skip = 0;
+      if (len == 0 && !(d.flags & VRING_DESC_F_NEXT)) {
+        if (dlen > VHOST_FRAME_MAX)
+          return 0;
+        *data = p;
+        return dlen;
+      }
+      if (len + dlen > VHOST_FRAME_MAX)
+        return 0;
+      memcpy(buf + len, p, dlen);
+      len += dlen;
+    }
+    if (!(d.flags & VRING_DESC_F_NEXT))
+      break;
+    i = d.next;
+  }
+  *data = buf;
+  return len;
+}
+
+/* Copy [f] behind a virtio-net header into the writable descriptor chain
+   at [head].  Returns the bytes written, or 0 if it does not fit. */
+static uint32_t
+vhost_scatter(struct vmnet_vhost *vh, struct vhost_vq *vq, uint16_t head,
+              const struct vmnet_sw_frame *f)
+{
+  uint8_t hdr[12];
+  size_t hlen = vhost_hdr_len(vh);
+  memset(hdr, 0, sizeof(hdr));
+  hdr[10] = 1;                 /* num_buffers, little-endian */
+  size_t total = hlen + f->len;
+  size_t done = 0;
+  unsigned i = head;
+  for (unsigned n = 0; n < vq->num && done < total; n++) {
+    if (i >= vq->num)
+      return 0;
+    struct vring_desc d;
+    vhost_desc_get(vq, i, &d);
+    uint8_t *p = vhost_gpa(vh, d.addr, d.len);
+    if (!p || !(d.flags & VRING_DESC_F_WRITE))
+      return 0;
+    size_t room = d.len;
+    while (room > 0 && done < total) {
+      size_t k;
+      if (done < hlen) {
+        k = hlen - done < room ? hlen - done : room;
+        memcpy(p, hdr + done, k);
+      } else {
+        k = total - done < room ? total - done : room;
+        memcpy(p, f->data + (done - hlen), k);
+      }
+      p += k;
+      room -= k;
+      done += k;
+    }
+    if (!(d.flags & VRING_DESC_F_NEXT))
+      break;
+    i = d.next;
+  }
+  return done == total ? (uint32_t)total : 0;
+}
+
+/* Switch output: hand frames to the guest */
+static void
+vhost_output(void *ctx, const struct vmnet_sw_frame *frames, int n)
+{
+  struct vmnet_vhost *vh = ctx;
+  struct vhost_vq *vq = &vh->vq[VHOST_RX];
+  if (!vhost_vq_ready(vq)) {
+    vh->port->dropped += n;
+    return;
+  }
+  uint16_t used_idx = vq->used->idx;
+  uint16_t avail_idx = __atomic_load_n(&vq->avail->idx, __ATOMIC_ACQUIRE);
+  int done = 0;
+  for (int i = 0; i < n; i++) {
+    if (vq->last_avail == avail_idx) {
+      vh->port->dropped += n - i;
+      break;
+    }
+    uint16_t head = vq->avail->ring[vq->last_avail % vq->num];
+    vq->last_avail++;
+    uint32_t len = vhost_scatter(vh, vq, head, &frames[i]);
+    if (len == 0)
+      vh->port->dropped++;
+    vq->used->ring[used_idx % vq->num].id = head;
+    vq->used->ring[used_idx % vq->num].len = len;
+    used_idx++;
+    done++;
+  }
+  if (done == 0)
+    return;
+  __atomic_store_n(&vq->used->idx, used_idx, __ATOMIC_RELEASE);
+  vhost_signal(vq);
+}
+
+/* Switch one batch of what the guest transmitted.  Kicks are suppressed
+   while the queue is being drained; once it is empty they are allowed
+   again and the queue is checked once more so that none is missed.
+   Returns 1 if a batch was switched, so that the caller comes back
+   without waiting for a kick, and 0 once the queue is empty. */
+static int
+vhost_tx(struct vmnet_vhost *vh)
+{
+  struct vhost_vq *vq = &vh->vq[VHOST_TX];
+  struct vmnet_sw_frame frames[VMNET_SWITCH_BATCH];
+  if (!vhost_vq_ready(vq))
+    return 0;
+  vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+  uint16_t avail_idx = __atomic_load_n(&vq->avail->idx, __ATOMIC_ACQUIRE);
+  if (vq->last_avail == avail_idx) {
+    vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    avail_idx = __atomic_load_n(&vq->avail->idx, __ATOMIC_ACQUIRE);
+    if (vq->last_avail == avail_idx)
+      return 0;
+    vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+  }
+  uint16_t used_idx = vq->used->idx;
+  int n = 0;
+  while (n < VMNET_SWITCH_BATCH && vq->last_avail != avail_idx) {
+    uint16_t head = vq->avail->ring[vq->last_avail % vq->num];
+    vq->last_avail++;
+    const uint8_t *data = NULL;
+    size_t len = vhost_gather(vh, vq, head,
+                              vh->scratch + (size_t)n * VHOST_FRAME_MAX, &data);
+    if (len > 0) {
+      frames[n].data = data;
+      frames[n].len = len;
+      n++;
+    }
+    vq->used->ring[used_idx % vq->num].id = head;
+    vq->used->ring[used_idx % vq->num].len = 0;
+    used_idx++;
+  }
+  /* The frames may point into guest memory, so they are switched before
+     the descriptors are given back */
+  if (n > 0)
+    vmnet_switch_input(vh->sw, vh->port_no, frames, n, vmnet_switch_now());
+  __atomic_store_n(&vq->used->idx, used_idx, __ATOMIC_RELEASE);
+  vhost_signal(vq);
+  return 1;
+}
+
+static int
+vhost_set_mem_table(struct vmnet_vhost *vh, struct vhost_msg *m, int *fds,
+                    int nfds)
+{
+  uint32_t n = m->payload.mem.nregions;
+  if (n > VHOST_MAX_REGIONS || (int)n > nfds)
+    return 0;
+  vhost_unmap(vh);
+  for (uint32_t i = 0; i < n; i++) {
+    struct vhost_region *r = &vh->regions[i];
+    uint64_t off = m->payload.mem.regions[i].mmap_offset;
+    r->gpa = m->payload.mem.regions[i].gpa;
+    r->size = m->payload.mem.regions[i].size;
+    r->uva = m->payload.mem.regions[i].uva;
+    r->map_len = r->size + off;
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fds[i], 0);
+    close(fds[i]);
+    fds[i] = -1;
+    if (r->map == MAP_FAILED)
+      return 0;
+    r->base = (uint8_t *)r->map + off;
+    vh->nregions = i + 1;
+  }
+  return 1;
+}
+
+static int
+vhost_reply(struct vmnet_vhost *vh, struct vhost_msg *m, size_t size)
+{
+  m->flags = VHOST_USER_VERSION | VHOST_USER_REPLY;
+  m->size = (uint32_t)size;
+  size_t len = VHOST_MSG_HLEN + size;
+  ssize_t r;
+  while ((r = send(vh->conn_fd, m, len, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+  return r == (ssize_t)len;
+}
+
+/* Act on [m].  Returns 0 if the front-end must be dropped. */
+static int
+vhost_handle(struct vmnet_vhost *vh, struct vhost_msg *m, int *fds, int nfds)
+{
+  struct vhost_vq *vq = NULL;
+  switch (m->request) {
+  case VHOST_USER_SET_VRING_NUM:
+  case VHOST_USER_SET_VRING_ADDR:
+  case VHOST_USER_SET_VRING_BASE:
+  case VHOST_USER_GET_VRING_BASE:
+  case VHOST_USER_SET_VRING_ENABLE:
+    if (m->payload.state.index > VHOST_TX)
+      return 0;
+    vq = &vh->vq[m->payload.state.index];
+    break;
+  case VHOST_USER_SET_VRING_KICK:
+  case VHOST_USER_SET_VRING_CALL:
+  case VHOST_USER_SET_VRING_ERR:
+    if ((m->payload.u64 & 0xff) > VHOST_TX)
+      return 0;
+    vq = &vh->vq[m->payload.u64 & 0xff];
+    break;
+  }
+
+  switch (m->request) {
+  case VHOST_USER_GET_FEATURES:
+    m->payload.u64 = VHOST_FEATURES;
+    return vhost_reply(vh, m, sizeof(uint64_t));
+  case VHOST_USER_SET_FEATURES:
+    vh->features = m->payload.u64 & VHOST_FEATURES;
+    return 1;
+  case VHOST_USER_GET_PROTOCOL_FEATURES:
+    m->payload.u64 = 0;
+    return vhost_reply(vh, m, sizeof(uint64_t));
+  case VHOST_USER_SET_PROTOCOL_FEATURES:
+    vh->protocol_features = m->payload.u64;
+    return 1;
+  case VHOST_USER_GET_QUEUE_NUM:
+    m->payload.u64 = 1;
+    return vhost_reply(vh, m, sizeof(uint64_t));
+  case VHOST_USER_SET_OWNER:
+  case VHOST_USER_RESET_OWNER:
+    return 1;
+  case VHOST_USER_SET_MEM_TABLE:
+    return vhost_set_mem_table(vh, m, fds, nfds);
+  case VHOST_USER_SET_VRING_NUM:
+    if (m->payload.state.num == 0 || m->payload.state.num > VHOST_MAX_VRING ||
+        (m->payload.state.num & (m->payload.state.num - 1)))
+      return 0;
+    /* The ring addresses were checked against the old size: the queue
+       is not ready until they are given again */
+    vq->num = m->payload.state.num;
+    vq->desc = NULL;
+    vq->avail = NULL;
+    vq->used = NULL;
+    return 1;
+  case VHOST_USER_SET_VRING_ADDR:
+    if (vq->num == 0)
+      return 0;
+    vq->desc = (struct vring_desc *)
+      vhost_uva(vh, m->payload.addr.desc, vq->num * sizeof(struct vring_desc));
+    vq->avail = (struct vring_avail *)
+      vhost_uva(vh, m->payload.addr.avail, 4 + vq->num * 2);
+    vq->used = (struct vring_used *)
+      vhost_uva(vh, m->payload.addr.used,
+                4 + vq->num * sizeof(struct vring_used_elem));
+    return vq->desc && vq->avail && vq->used;
+  case VHOST_USER_SET_VRING_BASE:
+    vq->last_avail = (uint16_t)m->payload.state.num;
+    return 1;
+  case VHOST_USER_GET_VRING_BASE:
+    vq->started = 0;
+    m->payload.state.num = vq->last_avail;
+    return vhost_reply(vh, m, sizeof(m->payload.state));
+  case VHOST_USER_SET_VRING_KICK:
+  case VHOST_USER_SET_VRING_CALL:
+  case VHOST_USER_SET_VRING_ERR: {
+    int fd = -1;
+    if (!(m->payload.u64 & VHOST_USER_VRING_NOFD)) {
+      if (nfds < 1)
+        return 0;
+      fd = fds[0];
+      fds[0] = -1;
+    }
+    if (m->request == VHOST_USER_SET_VRING_KICK) {
+      if (vq->kick >= 0)
+        close(vq->kick);
+      vq->kick = fd;
+      vq->started = 1;
+      /* Without protocol features, rings are enabled once started */
+      if (!(vh->features & VHOST_USER_F_PROTOCOL_FEATURES))
+        vq->enabled = 1;
+    } else if (m->request == VHOST_USER_SET_VRING_CALL) {
+      if (vq->call >= 0)
+        close(vq->call);
+      vq->call = fd;
+    } else if (fd >= 0) {
+      close(fd);
+    }
+    return 1;
+  }
+  case VHOST_USER_SET_VRING_ENABLE:
+    vq->enabled = m->payload.state.num != 0;
+    return 1;
+  default:
+    /* Logging is not offered; anything else is ignored */
+    return 1;
+  }
+}
+
+/* Receive one message and its file descriptors.  Called unlocked.
+   Returns the number of descriptors, or -1 if the front-end went away or
+   sent garbage. */
+static int
+vhost_recv(int fd, struct vhost_msg *m, int *fds)
+{
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(VHOST_MAX_FDS * sizeof(int))];
+  } control;
+  struct iovec iov = { m, VHOST_MSG_HLEN };
+  struct msghdr msg;
+  ssize_t r;
+  int nfds = 0;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  while ((r = recvmsg(fd, &msg, 0)) < 0 && errno == EINTR);
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+      continue;
+    int k = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    for (int i = 0; i < k; i++) {
+      int cfd;
+      memcpy(&cfd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+      if (nfds < VHOST_MAX_FDS)
+        fds[nfds++] = cfd;
+      else
+        close(cfd);
+    }
+  }
+  if (r != VHOST_MSG_HLEN || m->size > sizeof(m->payload))
+    goto fail;
+  size_t got = 0;
+  while (got < m->size) {
+    r = recv(fd, (char *)&m->payload + got, m->size - got, 0);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      goto fail;
+    got += r;
+  }
+  return nfds;
+ fail:
+  for (int i = 0; i < nfds; i++)
+    close(fds[i]);
+  return -1;
+}
+
+static void
+vhost_drain(int fd)
+{
+  uint64_t buf[8];
+  while (read(fd, buf, sizeof(buf)) < 0 && errno == EINTR);
+}
+
+/* The thread serving the socket and the transmit kicks.  It runs unlocked
+   and takes the switch lock for each step; it frees everything once the
+   port has been removed. */
+static void *
+vhost_thread(void *arg)
+{
+  struct vmnet_vhost *vh = arg;
+  struct vmnet_switch *sw = vh->sw;
+  int tx_more = 0;             /* the budget ran out with frames left */
+  for (;;) {
+    struct pollfd pfd[3];
+    int n = 0, kick = -1;
+    pthread_mutex_lock(&sw->lock);
+    if (vh->stopping) {
+      pthread_mutex_unlock(&sw->lock);
+      break;
+    }
+    int conn = vh->conn_fd;
+    if (vhost_vq_ready(&vh->vq[VHOST_TX]))
+      kick = vh->vq[VHOST_TX].kick;
+    pthread_mutex_unlock(&sw->lock);
+
+    pfd[n].fd = vh->wake[0];
+    pfd[n++].events = POLLIN;
+    pfd[n].fd = conn >= 0 ? conn : vh->listen_fd;
+    pfd[n++].events = POLLIN;
+    if (kick >= 0) {
+      pfd[n].fd = kick;
+      pfd[n++].events = POLLIN;
+    } else
+      tx_more = 0;
+    if (poll(pfd, n, tx_more ? 0 : -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (pfd[0].revents)
+      break;
+
+    if (pfd[1].revents && conn < 0) {
+      int fd = accept(vh->listen_fd, NULL, NULL);
+      if (fd >= 0) {
+        int on = 1;
+        (void)on;
+#ifdef SO_NOSIGPIPE
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        pthread_mutex_lock(&sw->lock);
+        vh->conn_fd = fd;
+        pthread_mutex_unlock(&sw->lock);
+      }
+    } else if (pfd[1].revents) {
+      struct vhost_msg m;
+      int fds[VHOST_MAX_FDS];
+      int nfds = vhost_recv(conn, &m, fds);
+      pthread_mutex_lock(&sw->lock);
+      if (!vh->stopping && (nfds < 0 || !vhost_handle(vh, &m, fds, nfds)))
+        vhost_reset(vh);
+      pthread_mutex_unlock(&sw->lock);
+      for (int i = 0; i < nfds; i++)
+        if (fds[i] >= 0)
+          close(fds[i]);
+    }
+
+    /* The switch is unlocked between batches, and after VHOST_TX_BUDGET
+       of them the socket and the wake pipe are polled again before going
+       on, so a busy guest cannot starve the other ports or the control
+       path */
+    if (kick >= 0 && (pfd[2].revents || tx_more)) {
+      if (pfd[2].revents)
+        vhost_drain(kick);
+      tx_more = 0;
+      for (int b = 0; b < VHOST_TX_BUDGET; b++) {
+        pthread_mutex_lock(&sw->lock);
+        /* The ring may have been reconfigured since it was polled */
+        int more = !vh->stopping && vh->vq[VHOST_TX].kick == kick &&
+                   vhost_tx(vh);
+        pthread_mutex_unlock(&sw->lock);
+        if (!more)
+          break;
+        tx_more = b == VHOST_TX_BUDGET - 1;
+      }
+    }
+  }
+  pthread_mutex_lock(&sw->lock);
+  vhost_reset(vh);
+  pthread_mutex_unlock(&sw->lock);
+  vmnet_switch_unlink(vh->listen_fd);
+  close(vh->listen_fd);
+  close(vh->wake[0]);
+  close(vh->wake[1]);
+  free(vh->scratch);
+  free(vh);
+  vmnet_switch_release(sw);
+  return NULL;
+}
+
+/* Called with the switch locked when the port is removed: the thread
+   notices and cleans up */
+static void
+vhost_detach(void *ctx)
+{
+  struct vmnet_vhost *vh = ctx;
+  char c = 0;
+  vh->stopping = 1;
+  while (write(vh->wake[1], &c, 1) < 0 && errno == EINTR);
+}
+
+/* Serve vhost-user on the listening socket [v_fd], which is taken over,
+   as a new port of [v_sw].  Returns the port number, or -1 if the switch
+   is full. */
+CAMLprim value
+caml_vmnet_switch_add_vhost(value v_sw, value v_fd)
+{
+  CAMLparam2(v_sw, v_fd);
+  struct vmnet_switch *sw = Vmnet_switch_val(v_sw);
+  struct vmnet_vhost *vh = calloc(1, sizeof(struct vmnet_vhost));
+  uint8_t *scratch = malloc((size_t)VMNET_SWITCH_BATCH * VHOST_FRAME_MAX);
+  if (!vh || !scratch) {
+    free(vh);
+    free(scratch);
+    caml_raise_out_of_memory();
+  }
+  if (pipe(vh->wake) < 0) {
+    free(vh);
+    free(scratch);
+    caml_failwith("pipe failed unexpectedly");
+  }
+  vh->sw = sw;
+  vh->listen_fd = Int_val(v_fd);
+  vh->conn_fd = -1;
+  vh->scratch = scratch;
+  for (int q = 0; q < 2; q++) {
+    vh->vq[q].kick = -1;
+    vh->vq[q].call = -1;
+  }
+  pthread_mutex_lock(&sw->lock);
+  int port = vmnet_switch_add_port(sw, vhost_output, vh);
+  if (port >= 0) {
+    vh->port = &sw->ports[port];
+    vh->port_no = port;
+    vh->port->detach = vhost_detach;
+  }
+  pthread_mutex_unlock(&sw->lock);
+  pthread_t thread;
+  if (port >= 0) {
+    vmnet_switch_retain(sw);
+    if (pthread_create(&thread, NULL, vhost_thread, vh) == 0) {
+      pthread_detach(thread);
+      CAMLreturn(Val_int(port));
+    }
+    vmnet_switch_release(sw);
+    pthread_mutex_lock(&sw->lock);
+    vh->port->detach = NULL;
+    vmnet_switch_remove_port(sw, port);
+    pthread_mutex_unlock(&sw->lock);
+  }
+  close(vh->wake[0]);
+  close(vh->wake[1]);
+  free(scratch);
+  free(vh);
+  if (port >= 0)
+    caml_failwith("Vmnet.Switch.add_vhost_port: cannot start thread");
+  CAMLreturn(Val_int(-1));
+}
@@ -0,0 +1,53 @@
+(*
+ * Copyright (c) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+
+(* Compare Vmnet.Checksum against a straightforward OCaml implementation
+ * over frame-sized buffers. No vmnet interface is needed.
+ *
+ * Usage: vmnet_checksum_bench.exe [iterations]
+ *)
+
+let ocaml_ones_complement buf =
+  let len = Cstruct.len buf in
+  let sum = ref 0 in
+  for i = 0 to (len / 2) - 1 do
+    sum := !sum + Cstruct.BE.get_uint16 buf (i * 2)
+  done;
+  if len land 1 = 1 then sum := !sum + (Cstruct.get_uint8 buf (len - 1) lsl 8);
+  while !sum lsr 16 <> 0 do
+    sum := (!sum land 0xffff) + (!sum lsr 16)
+  done;
+  lnot !sum land 0xffff
+
+let time name iterations size f =
+  let start = Unix.gettimeofday () in
+  for _ = 1 to iterations do ignore (f ()) done;
+  let elapsed = Unix.gettimeofday () -. start in
+  Printf.printf "%-8s %5d bytes: %8.1f ns/buffer, %6.2f GB/s\n%!" name size
+    (elapsed *. 1e9 /. float iterations)
+    (float (iterations * size) /. elapsed /. 1e9)
+
+let _ =
+  let iterations =
+    if Array.length Sys.argv > 1 then int_of_string Sys.argv.(1) else 1_000_000 in
+  List.iter (fun size ->
+      let buf = Cstruct.create size in
+      for i = 0 to size - 1 do Cstruct.set_uint8 buf i (Random.int 256) done;
+      assert (Vmnet.Checksum.ones_complement buf = ocaml_ones_complement buf);
+      time "ocaml" iterations size (fun () -> ocaml_ones_complement buf);
+      time "vmnet" iterations size (fun () -> Vmnet.Checksum.ones_complement buf))
+    [ 64; 576; 1500; 9000 ]
@@ -0,0 +1,59 @@
+(*
+ * Copyright (c) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+
+(* Time installing and removing many port forwarding rules one at a time and
+ * in bulk. The rules point at an address inside the configured range, no
+ * lease is needed for vmnet to accept them.
+ *
+ * Usage: vmnet_fw_bulk.exe [number of rules]
+ *)
+
+let time name f =
+  let start = Unix.gettimeofday () in
+  let r = f () in
+  Printf.printf "%s: %.3fs\n%!" name (Unix.gettimeofday () -. start);
+  r
+
+let _ =
+  let n = if Array.length Sys.argv > 1 then int_of_string Sys.argv.(1) else 1000 in
+  let ipv4_config = Vmnet.({
+                 ipv4_start_address = (Ipaddr.V4.of_string_exn "192.168.124.1");
+                 ipv4_end_address = (Ipaddr.V4.of_string_exn "192.168.124.128");
+                 ipv4_netmask = (Ipaddr.V4.of_string_exn "255.255.255.0")
+        }) in
+  let vmnet_t = Vmnet.init ~mode:(Shared_mode) ~ipv4_config () in
+  let internal_address = Ipaddr.V4.of_string_exn "192.168.124.2" in
+  let rules = Array.to_list (Array.init n (fun i ->
+        Vmnet.({ protocol = TCP; external_port = 20000 + i;
+                 internal_address; internal_port = 20000 + i }))) in
+  let keys = List.map (fun r -> Vmnet.(r.protocol, r.external_port)) rules in
+
+  time (Printf.sprintf "add %d rules one by one" n) (fun () ->
+        List.iter (fun r ->
+              Vmnet.(add_port_forwarding_rule vmnet_t r.protocol r.external_port
+                       r.internal_address r.internal_port)) rules);
+  time (Printf.sprintf "remove %d rules one by one" n) (fun () ->
+        List.iter (fun (proto, port) ->
+              Vmnet.remove_port_forwarding_rule vmnet_t proto port) keys);
+
+  let failed results =
+    List.length (List.filter (function (_, Error _) -> true | _ -> false) results) in
+  let added = time (Printf.sprintf "add %d rules in bulk" n) (fun () ->
+        Vmnet.add_port_forwarding_rules vmnet_t rules) in
+  let removed = time (Printf.sprintf "remove %d rules in bulk" n) (fun () ->
+        Vmnet.remove_port_forwarding_rules vmnet_t keys) in
+  Printf.printf "failures: %d added, %d removed\n" (failed added) (failed removed)
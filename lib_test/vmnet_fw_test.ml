@@ -20,6 +20,10 @@
  * used to set up the firewall rule to forward a port from the external 
  * interface (typically en0).
  *
+ * The lease is kept in a cache keyed by the interface UUID, which can be given
+ * on the command line: when the example is run again with the same UUID it
+ * asks for the cached address with a single DHCPREQUEST instead.
+ *
  * Note: In 10.15 it seems that the port will only be open if accessed from the
  * network. Connecting to the external IP from the same machine will not work.
  *)
@@ -54,10 +58,57 @@ let rec wait_for_lease vmnet_t state =
                       wait_for_lease vmnet_t (Some dhcp_t')
               end
               | `New_lease (_, pkt') -> begin
-                      pkt'.yiaddr
+                      pkt'
               end
         end
 
+let ack_timeout = 5.
+
+(* Ask for the cached lease again; None if the server refused it or did not
+   answer within [ack_timeout] seconds, as when it is gone *)
+let wait_for_ack vmnet_t xid lease =
+        let deadline = Unix.gettimeofday () +. ack_timeout in
+        let buf = Cstruct.create (Vmnet.max_packet_size vmnet_t) in
+        let rec loop () =
+                let timeout = deadline -. Unix.gettimeofday () in
+                if timeout <= 0. then None
+                else match Vmnet.read vmnet_t buf with
+                | exception Vmnet.No_packets_waiting -> begin
+                        match Vmnet.wait_for_event ~timeout vmnet_t with
+                        | () -> loop ()
+                        | exception Vmnet.Timeout -> None
+                end
+                | buf ->
+                        match Vmnet_lease.input ~xid ~mac:(Vmnet.mac vmnet_t) lease buf with
+                        | `Noop -> loop ()
+                        | `Nak -> None
+                        | `Ack lease' -> Some lease'
+        in
+        loop ()
+
+let get_lease vmnet_t cache =
+        let uuid = Vmnet.uuid vmnet_t in
+        let full () =
+                let pkt = wait_for_lease vmnet_t None in
+                (match Vmnet_lease.of_ack (Dhcp_wire.buf_of_pkt pkt) with
+                 | Some lease -> Vmnet_lease.add cache uuid lease
+                 | None -> ());
+                pkt.yiaddr
+        in
+        match Vmnet_lease.find cache uuid with
+        | None -> full ()
+        | Some lease -> begin
+                print_endline (Printf.sprintf "Requesting cached DHCP lease %s" (Ipaddr.V4.to_string lease.address));
+                let xid = Vmnet_lease.reboot vmnet_t lease in
+                match wait_for_ack vmnet_t xid lease with
+                | Some lease' ->
+                        Vmnet_lease.add cache uuid lease';
+                        lease'.address
+                | None ->
+                        Vmnet_lease.remove cache uuid;
+                        full ()
+        end
+
 let send_garp vmnet_t mac ip =
   let garp = Arp_packet.({
           operation = Request;
@@ -101,14 +152,19 @@ let _ =
                  ipv4_end_address = (Ipaddr.V4.of_string_exn "192.168.123.128");
                  ipv4_netmask = (Ipaddr.V4.of_string_exn "255.255.255.0")
         }) in
-  let vmnet_t = Vmnet.init ~mode:(Shared_mode) ~ipv4_config () in
+  let uuid =
+          if Array.length Sys.argv > 1 then Uuidm.of_string Sys.argv.(1)
+          else None
+  in
+  let vmnet_t = Vmnet.init ~mode:(Shared_mode) ?uuid ~ipv4_config () in
   Printf.printf "Vmnet interface UUID is %s\n" (Uuidm.to_string (Vmnet.uuid vmnet_t));
   print_endline (Printf.sprintf "MAC is %s" (Macaddr.to_string (Vmnet.mac vmnet_t)));
 
   let () = Vmnet.set_event_handler vmnet_t in
 
   (* get DHCP lease *)
-  let local_ip = (wait_for_lease vmnet_t None) in
+  let cache = Vmnet_lease.openfile (Filename.concat (Filename.get_temp_dir_name ()) "vmnet-leases") in
+  let local_ip = get_lease vmnet_t cache in
   print_endline (Printf.sprintf "Got DHCP lease %s" (Ipaddr.V4.to_string local_ip));
 
   (* send gARP so gateway finds us when routing external traffic *)
@@ -0,0 +1,49 @@
+(*
+ * Copyright (c) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+
+(* Count what reaches OCaml from a vmnet interface with receive coalescing
+ * off and then on.  Run a bulk TCP transfer towards the interface (for
+ * instance from a guest stack attached to it) while this is running.
+ *
+ * Usage: vmnet_gro_bench.exe [seconds]
+ *)
+
+let run t name seconds =
+  let buf = Cstruct.create (Vmnet.rx_buffer_size t) in
+  let reads = ref 0 and bytes = ref 0 and segments = ref 0 in
+  let start = Unix.gettimeofday () in
+  while Unix.gettimeofday () -. start < seconds do
+    match Vmnet.read_info t buf with
+    | frame, info ->
+      incr reads;
+      bytes := !bytes + Cstruct.len frame;
+      segments := !segments + info.Vmnet.segments
+    | exception Vmnet.No_packets_waiting -> Vmnet.wait_for_event t
+  done;
+  let elapsed = Unix.gettimeofday () -. start in
+  Printf.printf "%-4s %9.0f reads/s %8.1f MB/s %6.2f segments/read\n%!" name
+    (float !reads /. elapsed) (float !bytes /. elapsed /. 1e6)
+    (if !reads = 0 then 0. else float !segments /. float !reads)
+
+let _ =
+  let seconds =
+    if Array.length Sys.argv > 1 then float_of_string Sys.argv.(1) else 10. in
+  let t = Vmnet.init () in
+  Vmnet.set_event_handler t;
+  run t "off" seconds;
+  Vmnet.set_gro t true;
+  run t "on" seconds
@@ -0,0 +1,80 @@
+(*
+ * Copyright (c) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(* Exercises Lwt_vmnet_pool against vmnet (run as root): the pool fills up
+ * in the background, refills after a take, hands out reserved interfaces
+ * by UUID and releases everything it holds on shutdown. Exits non-zero on
+ * the first check that fails.
+ *)
+
+open Lwt.Infix
+
+let size = 2
+
+(* vmnet takes a while to create an interface *)
+let fill_timeout = 30.
+
+let check what ok =
+  if ok then Printf.printf "ok: %s\n%!" what
+  else begin
+    Printf.printf "FAILED: %s\n%!" what;
+    exit 1
+  end
+
+let rec wait_available pool n deadline =
+  if Lwt_vmnet_pool.available pool >= n then Lwt.return_true
+  else if Unix.gettimeofday () > deadline then Lwt.return_false
+  else Lwt_unix.sleep 0.05 >>= fun () -> wait_available pool n deadline
+
+let filled pool =
+  wait_available pool size (Unix.gettimeofday () +. fill_timeout)
+
+let main () =
+  let pool = Lwt_vmnet_pool.create ~size () in
+  filled pool >>= fun ok ->
+  check "pool fills up in the background" ok;
+
+  Lwt_vmnet_pool.take pool >>= fun dev ->
+  check "take hands out a warm interface"
+    (Lwt_vmnet_pool.available pool = size - 1);
+  filled pool >>= fun ok ->
+  check "pool refills after a take" ok;
+
+  let uuid = Uuidm.v `V4 in
+  Lwt_vmnet_pool.reserve pool uuid;
+  Lwt_vmnet_pool.take ~uuid pool >>= fun reserved ->
+  check "take ~uuid does not use the warm interfaces"
+    (Lwt_vmnet_pool.available pool = size);
+  let mac = Lwt_vmnet.mac reserved in
+  Lwt_vmnet.stop reserved >>= fun () ->
+  Lwt_vmnet_pool.take ~uuid pool >>= fun again ->
+  check "an interface for the same UUID keeps its MAC"
+    (Macaddr.compare mac (Lwt_vmnet.mac again) = 0);
+
+  Lwt_vmnet_pool.shutdown pool >>= fun () ->
+  check "shutdown releases the warm interfaces"
+    (Lwt_vmnet_pool.available pool = 0);
+  Lwt.catch
+    (fun () -> Lwt_vmnet_pool.take pool >|= fun _ -> false)
+    (function Invalid_argument _ -> Lwt.return_true | e -> Lwt.fail e)
+  >>= fun refused ->
+  check "take fails after shutdown" refused;
+  Lwt_unix.sleep 0.5 >>= fun () ->
+  check "shutdown stops replenishing" (Lwt_vmnet_pool.available pool = 0);
+
+  Lwt.join (List.map Lwt_vmnet.stop [ dev; again ])
+
+let () = Lwt_main.run (main ())
@@ -0,0 +1,63 @@
+(*
+ * Copyright (c) 2019 Magnus Skjegstad <magnus@skjegstad.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+
+(* Switch traffic between local ports of a Vmnet.Switch, with no vmnet
+ * interface involved, to measure the cost of learning and forwarding as
+ * the number of ports grows.  Each port first announces its address with a
+ * broadcast, then batches of unicast frames are sent between random ports.
+ *
+ * Usage: vmnet_switch_bench.exe [ports] [seconds]
+ *)
+
+let mac_of_port p = Macaddr.of_octets_exn (Printf.sprintf "\x02\x00\x00\x00\x00%c" (Char.chr (p + 1)))
+
+let frame ~src ~dst =
+  let c = Cstruct.create 60 in
+  Cstruct.blit_from_string (Macaddr.to_octets dst) 0 c 0 6;
+  Cstruct.blit_from_string (Macaddr.to_octets src) 0 c 6 6;
+  Cstruct.BE.set_uint16 c 12 0x0800;
+  c
+
+let _ =
+  let nports =
+    if Array.length Sys.argv > 1 then max 2 (int_of_string Sys.argv.(1)) else 48 in
+  let seconds =
+    if Array.length Sys.argv > 2 then float_of_string Sys.argv.(2) else 5. in
+  let sw = Vmnet.Switch.create () in
+  let ports = Array.init nports (fun _ -> Vmnet.Switch.add_local_port ~slots:0 sw) in
+  Array.iteri (fun i p ->
+      Vmnet.Switch.inject sw p [frame ~src:(mac_of_port i) ~dst:Macaddr.broadcast])
+    ports;
+  (* One batch per source port, each frame to a random other port *)
+  let batches = Array.init nports (fun i ->
+      List.init 32 (fun _ ->
+          let j = (i + 1 + Random.int (nports - 1)) mod nports in
+          frame ~src:(mac_of_port i) ~dst:(mac_of_port j))) in
+  let frames = ref 0 in
+  let start = Unix.gettimeofday () in
+  while Unix.gettimeofday () -. start < seconds do
+    for i = 0 to 99 do
+      let p = (i + !frames) mod nports in
+      Vmnet.Switch.inject sw ports.(p) batches.(p);
+      frames := !frames + 32
+    done
+  done;
+  let elapsed = Unix.gettimeofday () -. start in
+  let s = Vmnet.Switch.stats sw in
+  Printf.printf "%d ports: %.0f frames/s (forwarded %d, flooded %d, dropped %d, %d addresses)\n%!"
+    nports (float !frames /. elapsed) s.Vmnet.Switch.forwarded s.Vmnet.Switch.flooded
+    s.Vmnet.Switch.dropped s.Vmnet.Switch.entries